@@ -0,0 +1,27 @@
+#ifndef _AHCI_DRIVER_H
+#define _AHCI_DRIVER_H
+
+// AHCI (SATA) disk support, with native command queuing where the disk has it
+
+#include <stdint.h>
+#include <blockdevice.h>
+
+// Ports that can be registered as disks ("sd0" to "sd3")
+#define AHCI_MAX_DISKS		4
+
+// Largest transfer in one command. Longer requests are rejected by Submit and split by Read/Write
+#define AHCI_MAX_SECTORS	128
+
+// Find the first AHCI controller on the PCI bus, set up every port with a SATA disk on it and
+// register the disks as block devices. irqBaseVector is the interrupt vector of IRQ 0; the
+// controller's IRQ line (from PCI configuration space) is installed relative to it.
+// Returns the number of disks found
+int AhciInstall(int irqBaseVector);
+
+// Return the block device for disk (0 to AHCI_MAX_DISKS - 1), or 0 if there is no such disk
+BlockDevice* AhciGetBlockDevice(int disk);
+
+// Move the ports on. Called from the controller's IRQ handler
+void AhciServiceInterrupt();
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _ATA_DRIVER_H
+#define _ATA_DRIVER_H
+
+// ATA (IDE) hard disk support for the primary and secondary channels. When the IDE controller
+// can bus master, drives that support DMA transfer through a per channel PRD (physical region
+// descriptor) table, and the controller copies to and from the caller's buffer itself. A channel
+// falls back to PIO if the controller cannot bus master or its PRD table could not be allocated
+// and mapped. A single transfer also uses PIO when its buffer cannot be described in a PRD table
+// (part of it is unmapped or not word aligned)
+
+#include <stdint.h>
+#include <blockdevice.h>
+
+// Drives on the two channels: primary master, primary slave, secondary master, secondary slave
+#define ATA_MAX_DRIVES		4
+
+// Install the driver. Resets both channels, identifies the drives on them and registers each
+// ATA disk found as a block device ("hd0" to "hd3"). The primary channel uses IRQ 14 and the
+// secondary IRQ 15, installed at the given interrupt vectors
+void AtaInstall(int primaryVector, int secondaryVector);
+
+// Return the block device for drive (0 to ATA_MAX_DRIVES - 1), or 0 if there is no disk there
+BlockDevice* AtaGetBlockDevice(int drive);
+
+// Return the model name reported by drive, or 0 if there is no disk there
+const char* AtaGetModel(int drive);
+
+// Read up to count sectors starting at lba into buffer. Returns the number of sectors read, 0 on error
+int AtaReadSectors(int drive, uint32_t lba, uint32_t count, uint8_t* buffer);
+
+// Write up to count sectors starting at lba from buffer. Returns the number of sectors written, 0 on error
+int AtaWriteSectors(int drive, uint32_t lba, uint32_t count, const uint8_t* buffer);
+
+// Flush the drive's write cache. Returns 0 on success
+int AtaFlush(int drive);
+
+// Move the transfer on a channel along. Called from the IRQ 14/15 handlers
+void AtaServiceInterrupt(int channel);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+// Block device microbenchmark
+
+#include <stdint.h>
+#include <blockdevice.h>
+
+// Most requests that can be kept in flight
+#define BENCH_MAX_DEPTH		32
+
+// Size of the blocks read by the random benchmark
+#define BENCH_IO_SIZE		4096
+
+// Largest block that can be read in one request
+#define BENCH_MAX_IO_SIZE	65536
+
+typedef struct _BenchResult
+{
+	uint32_t	Ios;			// Requests completed
+	uint32_t	Bytes;			// Bytes transferred
+	uint32_t	Errors;			// Requests that failed
+	uint32_t	Ticks;			// Time taken
+	uint32_t	Depth;			// Requests actually kept in flight
+} BenchResult;
+
+// Read ioSize byte blocks from device for ticks timer ticks, keeping up to depth requests in
+// flight (no more than the device can queue). Blocks are read from random aligned offsets,
+// or one after another from the start of the device if sequential is true.
+// Returns 0 on success, -1 if the device is too small, ioSize is not a multiple of the
+// sector size or the buffers could not be allocated
+int Bench_Run(BlockDevice* device, uint32_t depth, uint32_t ioSize, bool sequential, uint32_t ticks, BenchResult* result);
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef _BLOCKDEVICE_H
+#define _BLOCKDEVICE_H
+
+// Block device layer. Drivers describe each disk they find with a BlockDevice and
+// register it, and file systems read and write through the device's operations
+// without knowing which driver is behind it.
+
+#include <stdint.h>
+
+// Maximum number of devices that can be registered
+#define BLOCKDEVICE_MAX		8
+
+typedef struct _BlockDevice BlockDevice;
+
+// Transfer up to count sectors starting at lba. Returns the number of sectors transferred,
+// which may be less than count (e.g. at a cylinder boundary). 0 means the transfer failed
+typedef int (*BlockDeviceRead)(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer);
+typedef int (*BlockDeviceWrite)(BlockDevice* device, uint32_t lba, uint32_t count, const uint8_t* buffer);
+
+// Make sure everything written has reached the media. Returns 0 on success
+typedef int (*BlockDeviceFlush)(BlockDevice* device);
+
+// Status of a BlockRequest
+#define BLOCK_REQUEST_PENDING	0
+#define BLOCK_REQUEST_DONE		1
+#define BLOCK_REQUEST_ERROR		2
+
+typedef struct _BlockRequest BlockRequest;
+
+// Called (possibly from interrupt context) when a request has finished
+typedef void (*BlockCompletion)(BlockRequest* request);
+
+// An asynchronous transfer. The request and its buffer must stay put until it completes
+struct _BlockRequest
+{
+	uint32_t			LBA;
+	uint32_t			Count;			// Sectors to transfer
+	uint8_t*			Buffer;
+	bool				Write;
+	volatile int		Status;			// BLOCK_REQUEST_xxx
+	BlockCompletion		Completion;		// May be null
+	void*				Context;		// For use by the submitter
+};
+
+// Start a transfer of all of request->Count sectors. Returns 0 if the request was accepted,
+// -1 if it was rejected (e.g. all of the device's queue slots are in use)
+typedef int (*BlockDeviceSubmit)(BlockDevice* device, BlockRequest* request);
+
+// Look for finished requests and complete them. Returns the number completed
+typedef int (*BlockDevicePoll)(BlockDevice* device);
+
+// Return a number that goes up whenever the media may have been changed. Anything read
+// from the device while the number was lower (cached sectors, file system tables) may be stale
+typedef uint32_t (*BlockDeviceMediaGeneration)(BlockDevice* device);
+
+// Called before the device is mounted, so the driver can look at the media again (e.g. the
+// format of a floppy) if it has changed. May touch the hardware. Returns 0 on success
+typedef int (*BlockDeviceRevalidate)(BlockDevice* device);
+
+struct _BlockDevice
+{
+	const char*			Name;			// Short name, e.g. "fd0"
+	uint32_t			SectorSize;		// Bytes per sector
+	uint32_t			SectorCount;	// Sectors on the device
+	uint32_t			QueueDepth;		// Requests the device can work on at once
+	BlockDeviceRead		Read;
+	BlockDeviceWrite	Write;			// Null if the device is read only
+	BlockDeviceFlush	Flush;			// Null if writes go straight to the media
+	BlockDeviceSubmit	Submit;			// Null if the device only does one transfer at a time
+	BlockDevicePoll		Poll;			// Null if requests are completed by interrupts
+	BlockDeviceMediaGeneration	MediaGeneration;	// Null if the media can not be changed
+	BlockDeviceRevalidate	Revalidate;		// Null if there is nothing to look at again
+	void*				Private;		// For use by the driver
+};
+
+// Add a device to the list of devices. Returns false if the list is full or
+// a device with the same name is already registered
+bool BlockDevice_Register(BlockDevice* device);
+
+// Return the number of registered devices
+int BlockDevice_GetCount();
+
+// Return registered device index, or 0 if there is no such device
+BlockDevice* BlockDevice_Get(int index);
+
+// Find a registered device by name. Returns 0 if there is no such device
+BlockDevice* BlockDevice_Find(const char* name);
+
+// Read count sectors starting at lba, issuing as many device reads as it takes.
+// Returns 0 on success, -1 if the range is outside the device or a read failed
+int BlockDevice_Read(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer);
+
+// Write count sectors starting at lba. Returns 0 on success, -1 on failure or if the device is read only
+int BlockDevice_Write(BlockDevice* device, uint32_t lba, uint32_t count, const uint8_t* buffer);
+
+// Flush any writes the device is holding. Returns 0 on success
+int BlockDevice_Flush(BlockDevice* device);
+
+// Start an asynchronous transfer. Devices without a Submit operation do the transfer there and then
+// and complete the request before returning. Returns 0 if the request was accepted
+int BlockDevice_Submit(BlockDevice* device, BlockRequest* request);
+
+// Complete any finished requests on a device that is polled rather than interrupt driven.
+// Returns the number completed
+int BlockDevice_Poll(BlockDevice* device);
+
+// Return the device's media generation. Always 0 for media that can not be changed.
+// Cheap enough to call once per file system operation, it does not start any I/O
+uint32_t BlockDevice_GetMediaGeneration(BlockDevice* device);
+
+// Get the device ready to be mounted. Returns 0 on success
+int BlockDevice_Revalidate(BlockDevice* device);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _BUFFERCACHE_H
+#define _BUFFERCACHE_H
+
+// Sector buffer cache. Sits between the file system and the block devices and keeps the
+// sectors read most recently in memory, looked up by device and LBA through a hash table.
+// When it is full the least recently used sector is dropped. Each sector is tagged with the
+// media generation it was read under, and only handed out to reads under the same generation.
+// Not for use from interrupt context
+
+#include <stdint.h>
+#include <blockdevice.h>
+
+// Size of the sectors that get cached. Devices with other sector sizes are read straight through
+#define BUFFERCACHE_SECTOR_SIZE		512
+
+// Cache counters
+typedef struct _BufferCacheStats
+{
+	uint32_t	Buffers;		// Sectors the cache can hold
+	uint32_t	Hits;			// Sectors found in the cache
+	uint32_t	Misses;			// Sectors that had to be read from the device
+	uint32_t	Evictions;		// Sectors dropped to make room for another
+} BufferCacheStats;
+
+// Carve a cache of sectors sectors (and its lookup tables) out of physical memory.
+// Returns false if the memory could not be found, in which case reads go straight to the device
+bool BufferCache_Initialise(uint32_t sectors);
+
+// Read count sectors starting at lba, from the cache where it has them and from the device
+// where it does not. generation is the device's media generation as the caller last saw it
+// (the file system checks it once per operation). Sectors cached under any other generation
+// are dropped. Returns 0 on success, -1 if the range is outside the device or a read failed
+int BufferCache_Read(BlockDevice* device, uint32_t generation, uint32_t lba, uint32_t count, uint8_t* buffer);
+
+// Return the cache counters
+void BufferCache_GetStats(BufferCacheStats* stats);
+
+// Set the hit, miss and eviction counters back to zero
+void BufferCache_ResetStats();
+
+#endif
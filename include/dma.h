@@ -112,4 +112,9 @@ void DMA_SetRead(uint8_t channel);
 void DMA_SetWrite(uint8_t channel); 
 void DMA_SetExternalPageRegister(uint8_t reg, uint8_t val); 
 
+// Program channel to transfer length bytes at physical address, including its page register.
+// Channels 0-3 reach any 64K bank below 16MB, channels 5-7 transfer words and any 128K bank.
+// Returns false if the buffer is out of reach or crosses a bank. The channel is left masked
+bool DMA_SetTransfer(uint8_t channel, uint32_t physical, uint32_t length);
+
 #endif
@@ -4,12 +4,18 @@
 #define _FSYS_H
 
 #include <stdint.h>
+#include <blockdevice.h>
 
 //	File flags (Bit Flags)
 #define FS_FILE       0b1
 #define FS_DIRECTORY  0b10
 #define FS_INVALID    0b100
 
+//	Where FsFat12_Seek measures from
+#define FS_SEEK_SET   0
+#define FS_SEEK_CUR   1
+#define FS_SEEK_END   2
+
 #define DIR_DIRECTORY  0x10
 #define LONGFILENAME_ATTRIB 0x0F
 
@@ -32,6 +38,8 @@ typedef struct _File
 	uint32_t    Eof;
 	uint32_t    Position;
 	uint32_t    CurrentCluster;
+	uint32_t    FirstCluster;
+	uint32_t    Generation;     // Media generation the file was opened under
 } FILE;
 typedef FILE * PFILE;
 
@@ -96,8 +104,15 @@ typedef bool (*DirectoryDelegate)(pDirectoryEntry, uintptr_t* ptrs);
 //         False otherwise.
 bool FsFat12_RetrieveNameFromDirectoryEntry(pDirectoryEntry entry, char* name);
 
-// Initialise the fs
-void FsFat12_Initialise();
+// Initialise the fs. If the device's media generation goes up later on (the disk has been
+// changed), the next operation mounts it again and files opened before then stop reading.
+// @param device the device to mount
+// @return true if the device holds a FAT12 file system we can use
+bool FsFat12_Initialise(BlockDevice* device);
+
+// Get the device passed to the last FsFat12_Initialise
+// @return the device, or NULL if nothing has been mounted
+BlockDevice* FsFat12_GetDevice();
 
 // Open a file
 // @param filename - filename
@@ -121,6 +136,13 @@ void FsFat12_IterateFolder(FILE dir, DirectoryDelegate fileFn, uintptr_t* ptrs);
 // @param length - length to read to. 
 unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length);
 
+// Move to a position in a file, so the next read starts there. 
+// @param file - file to move in
+// @param offset - offset from the place given by whence
+// @param whence - FS_SEEK_SET (start of the file), FS_SEEK_CUR (current position) or FS_SEEK_END (end of the file)
+// @return the new position, or -1 if it is outside the file or file is not a file
+int FsFat12_Seek(PFILE file, int offset, int whence);
+
 // Close the file
 // @param file - Pointer to the file to close
 void FsFat12_Close(PFILE file);
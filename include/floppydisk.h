@@ -5,9 +5,98 @@
 // Floppy disk support
 
 #include <stdint.h>
+#include <blockdevice.h>
 
-// Set address for floppy drive to use for DMA transfers
-void FloppyDriveSetDMA(int addr);
+// Largest geometry the driver handles (a 2.88MB disk has 36 sectors per track)
+#define FLPY_MAX_SECTORS_PER_TRACK	36
+#define FLPY_MAX_HEADS				2
+#define FLPY_MAX_CYLINDERS			84
+#define FLPY_MAX_SECTORS			(FLPY_MAX_SECTORS_PER_TRACK * FLPY_MAX_HEADS * FLPY_MAX_CYLINDERS)
+
+// Size of each DMA transfer buffer. Big enough to hold a full cylinder of the largest format
+// (2 heads x 36 sectors x 512 bytes)
+#define FLPY_DMA_BUFFER_SIZE	36864
+
+// Number of DMA transfer buffers. With two, the next cylinder is read into one while the other is copied out
+#define FLPY_DMA_BUFFER_COUNT	2
+
+// Data rates, as written to the configuration control register
+#define FLPY_RATE_500KBPS		0		// 1.44MB and 1.68MB (DMF) disks
+#define FLPY_RATE_300KBPS		1
+#define FLPY_RATE_250KBPS		2		// 720K disks
+#define FLPY_RATE_1MBPS			3		// 2.88MB disks
+
+// Geometry of the disk in the drive
+typedef struct _FloppyGeometry
+{
+	int			SectorsPerTrack;
+	int			Heads;
+	int			Cylinders;
+	uint8_t		DataRate;		// FLPY_RATE_xxx
+} FloppyGeometry;
+
+// When the controller is reset and recalibrated
+typedef enum _FloppyResetMode
+{
+	FLPY_RESET_ON_ERROR,	// Reset at install time and when a seek or read fails
+	FLPY_RESET_ALWAYS		// Reset before every read (old behaviour)
+} FloppyResetMode;
+
+// Default number of timer ticks the motor keeps running after the last request (2 seconds)
+#define FLPY_MOTOR_IDLE_TICKS_DEFAULT	200
+
+// Request status
+#define FLPY_REQUEST_PENDING	0
+#define FLPY_REQUEST_DONE		1
+#define FLPY_REQUEST_ERROR		2
+
+typedef struct _FloppyRequest FloppyRequest;
+
+// Called (from interrupt context) when a request finishes
+typedef void (*FloppyCompletion)(FloppyRequest* request);
+
+// An asynchronous read. Owned by the caller and must stay valid until it completes
+struct _FloppyRequest
+{
+	int						SectorLBA;		// First sector to read
+	int						Count;			// Number of sectors to read
+	uint8_t*				Buffer;			// Where to put them
+	volatile int			Status;			// FLPY_REQUEST_xxx
+	int						Transferred;	// Sectors read so far
+	FloppyCompletion		Completion;		// Set by FloppyDriveSubmit
+	void*					Context;		// For use by the submitter
+	int						Bypassed;		// Times the scheduler has served a later request first
+	struct _FloppyRequest*	Next;			// Used by the driver's queue
+};
+
+// Number of times a request can be passed over by the C-SCAN scheduler before it is served next
+#define FLPY_SCHEDULER_MAX_BYPASS	8
+
+// Driver performance counters. Times are in PIT ticks. Average seek distance is SeekDistance / Seeks
+typedef struct _FloppyDriveStats
+{
+	uint32_t	Resets;			// Controller resets
+	uint32_t	Calibrations;	// RECALIBRATE commands issued
+	uint32_t	Seeks;			// Seeks (explicit or implied) to a different cylinder
+	uint32_t	SeekDistance;	// Total cylinders travelled by those seeks
+	uint32_t	SpinUps;		// Times the motor was started
+	uint32_t	Commands;		// Commands sent to the controller
+	uint32_t	Sectors;		// Sectors transferred by the controller
+	uint32_t	BufferHits;		// Sectors served from the DMA buffers without a transfer
+	uint32_t	Retries;		// Runs retried after an error
+	uint32_t	Errors;			// Runs that failed for good
+	uint32_t	WaitTicks;		// Time spent waiting for the floppy IRQ
+	uint32_t	SleepTicks;		// Time spent waiting for the motor and head
+	uint32_t	Merged;			// Requests merged into the command of an adjacent request
+	uint32_t	Starved;		// Times the starvation bound overrode C-SCAN order
+	uint32_t	MediaChanges;	// Times the change line showed the disk had been changed or taken out
+} FloppyDriveStats;
+
+// Return the physical address of DMA transfer buffer index (0 to FLPY_DMA_BUFFER_COUNT - 1)
+uint32_t FloppyDriveGetDMABuffer(int index);
+
+// Read the rest of the cylinder after the last read into a spare DMA buffer when no requests are waiting
+void FloppyDriveSetReadAhead(bool enable);
 
 // Convert LBA to CHS
 void FloppyDriveLBAToCHS(int lba,int *head,int *track,int *sector); 
@@ -21,7 +110,54 @@ void FloppyDriveSetWorkingDrive(uint8_t drive);
 //! get current working drive
 uint8_t FloppyDriveGetWorkingDrive(); 
 
-// Read a sector
+// Select when the controller gets reset. Defaults to FLPY_RESET_ON_ERROR
+void FloppyDriveSetResetMode(FloppyResetMode mode);
+
+// Set how many timer ticks the motor keeps running after the last request.
+// 0 switches it off as soon as each request completes
+void FloppyDriveSetMotorIdleTimeout(uint32_t ticks);
+
+// Queue a request. The completion routine (which may be null) is called from interrupt context
+// once the request has finished. Returns 0 if the request was queued
+int FloppyDriveSubmit(FloppyRequest* request, FloppyCompletion completion);
+
+// Return the media generation. It goes up every time the disk change line shows the disk has been
+// changed or taken out, so anything read while the generation was lower may be stale.
+// Cheap: the line is only sampled if the motor is already running. Otherwise a change is
+// picked up when the next request starts
+uint32_t FloppyDriveGetMediaGeneration();
+
+// Get ready to mount the disk in the drive. Starts the motor to read the change line, and works
+// the geometry out again if the disk has changed since it was last done. Blocks until the reads
+// finish. Returns false if the disk could not be read
+bool FloppyDriveRevalidate();
+
+// Read the boot sector of the disk in the drive and take the geometry (and data rate) from it.
+// Done at install time, and by FloppyDriveRevalidate when the media generation has gone up.
+// Blocks until the reads finish. Returns false if nothing could be read at any data rate
+bool FloppyDriveDetectGeometry();
+
+// Return the geometry of the disk in the drive
+void FloppyDriveGetGeometry(FloppyGeometry* geometry);
+
+// Return the performance counters
+void FloppyDriveGetStats(FloppyDriveStats* stats);
+
+// Set all the performance counters back to zero
+void FloppyDriveResetStats();
+
+// Move the request state machine on. Called from the floppy IRQ handler
+void FloppyDriveServiceInterrupt();
+
+// Read a sector. Blocks until the read completes
 uint8_t* FloppyDriveReadSector(int sectorLBA); 
 
+// Read up to count sectors into buffer with a single controller command.
+// The run stops at the end of the cylinder. The data is DMAed straight into buffer when
+// it is below 16MB and does not cross a 64K boundary. Returns the number of sectors read
+int FloppyDriveReadSectors(int sectorLBA, int count, uint8_t* buffer);
+
+// Return the block device for the drive (registered as "fd0" by FloppyDriveInstall)
+BlockDevice* FloppyDriveGetBlockDevice();
+
 #endif
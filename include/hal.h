@@ -27,18 +27,52 @@ void HAL_GenerateInterrupt(int n);
 // Notify hal interrupt is done
 void HAL_InterruptDone(unsigned int intno);
 
+// Notify hal a message signalled interrupt (delivered through the local APIC) is done
+void HAL_MessageInterruptDone();
+
+// Return the physical address of the local APIC's registers, or 0 if there is no local APIC
+uint32_t HAL_GetLocalApicAddress();
+
+// Enable the local APIC, whose registers are mapped at registers, so that it can
+// take message signalled interrupts. The PICs carry on delivering the ISA IRQs
+void HAL_EnableLocalApic(void* registers);
+
+// Return the local APIC ID of this processor
+uint8_t HAL_GetLocalApicId();
+
 // Read byte from device using port mapped io
 uint8_t HAL_InputByteFromPort(uint16_t portid); 
 
 // Write byte to device through port mapped io
 void  HAL_OutputByteToPort(uint16_t portid, uint8_t value); 
 
+// Read word from device using port mapped io
+uint16_t HAL_InputWordFromPort(uint16_t portid); 
+
+// Write word to device through port mapped io
+void  HAL_OutputWordToPort(uint16_t portid, uint16_t value); 
+
+// Read double word from device using port mapped io
+uint32_t HAL_InputDwordFromPort(uint16_t portid); 
+
+// Write double word to device through port mapped io
+void  HAL_OutputDwordToPort(uint16_t portid, uint32_t value); 
+
+// Read count words from a port into buffer with a single string instruction
+void  HAL_InputWordsFromPort(uint16_t portid, void* buffer, uint32_t count); 
+
+// Write count words from buffer to a port with a single string instruction
+void  HAL_OutputWordsToPort(uint16_t portid, const void* buffer, uint32_t count); 
+
 // HAL_EnableInterrupts all hardware interrupts
 void  HAL_EnableInterrupts();
 
 // HAL_DisableInterrupts all hardware interrupts
 void  HAL_DisableInterrupts();
 
+// Enable interrupts and sleep until the next one. Call with interrupts disabled
+void  HAL_WaitForInterrupt();
+
 // Set new interrupt vector
 void  HAL_SetInterruptVector(int intno, void (*vect)());
 
@@ -54,6 +88,10 @@ uint32_t HAL_GetTickCount();
 // Wait for a specified number of tick counts
 void HAL_Sleep(uint32_t tickCount); 
 
+// Add a routine to be called from the timer interrupt on every tick.
+// Returns false if no more routines can be added
+bool HAL_AddTickHandler(void (*handler)(uint32_t tickCount));
+
 // Routines to enable/disable paging and load/get the page directory register
 
 void HAL_EnablePaging(); 
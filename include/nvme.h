@@ -0,0 +1,31 @@
+#ifndef _NVME_H
+#define _NVME_H
+
+// NVMe disk support
+
+#include <stdint.h>
+#include <blockdevice.h>
+
+// Controllers that can be registered ("nv0" and "nv1", namespace 1 of each)
+#define NVME_MAX_DISKS			2
+
+// I/O submission/completion queue pairs to ask each controller for
+#define NVME_IO_QUEUES			4
+
+// Largest transfer in one command. Longer requests are rejected by Submit and split by Read/Write
+#define NVME_MAX_TRANSFER		65536
+
+// Find the NVMe controllers on the PCI bus, create their I/O queues and register namespace 1
+// of each as a block device. With interrupts false, completions are found by polling the
+// completion queues' phase bits (the block device has a Poll operation); otherwise the
+// controller's IRQ line (from PCI configuration space) is installed relative to irqBaseVector.
+// Returns the number of disks found
+int NvmeInstall(int irqBaseVector, bool interrupts);
+
+// Return the block device for disk (0 to NVME_MAX_DISKS - 1), or 0 if there is no such disk
+BlockDevice* NvmeGetBlockDevice(int disk);
+
+// Collect finished commands from every I/O queue. Called from the IRQ handler
+void NvmeServiceInterrupt();
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef _PCI_H
+#define _PCI_H
+
+// PCI bus support. Configuration space is reached with configuration mechanism #1;
+// PCI_Initialise walks every bus once and records each function it finds, with its BARs decoded
+
+#include <stdint.h>
+
+//	Configuration space registers
+
+#define	PCI_CONFIG_VENDOR_ID		0x00
+#define	PCI_CONFIG_DEVICE_ID		0x02
+#define	PCI_CONFIG_COMMAND			0x04
+#define	PCI_CONFIG_STATUS			0x06
+#define	PCI_CONFIG_REVISION			0x08
+#define	PCI_CONFIG_PROG_IF			0x09
+#define	PCI_CONFIG_SUBCLASS			0x0a
+#define	PCI_CONFIG_CLASS			0x0b
+#define	PCI_CONFIG_HEADER_TYPE		0x0e
+#define	PCI_CONFIG_BAR0				0x10
+#define	PCI_CONFIG_CAPABILITIES		0x34
+#define	PCI_CONFIG_INTERRUPT_LINE	0x3c
+
+//	Command register bits
+
+#define	PCI_COMMAND_IO				0x0001
+#define	PCI_COMMAND_MEMORY			0x0002
+#define	PCI_COMMAND_BUS_MASTER		0x0004
+#define	PCI_COMMAND_INTX_DISABLE	0x0400
+
+// Status register bit saying there is a capabilities list
+#define	PCI_STATUS_CAPABILITIES		0x0010
+
+// Capability IDs
+#define	PCI_CAPABILITY_MSI			0x05
+
+// Most functions that are recorded
+#define	PCI_MAX_DEVICES				64
+
+// BARs in a (type 0) configuration header
+#define	PCI_BAR_COUNT				6
+
+//	BAR flags
+
+#define	PCI_BAR_IO					0x01	// I/O ports rather than memory
+#define	PCI_BAR_PREFETCHABLE		0x02
+#define	PCI_BAR_64BIT				0x04	// Takes this BAR and the next
+#define	PCI_BAR_HIGH				0x08	// Above 4G, so we cannot reach it
+
+// A function on the bus
+typedef struct _PciAddress
+{
+	uint8_t		Bus;
+	uint8_t		Device;
+	uint8_t		Function;
+} PciAddress;
+
+// A decoded BAR. Size is 0 if the BAR is not implemented
+typedef struct _PciBar
+{
+	uint32_t	Base;
+	uint32_t	Size;
+	uint8_t		Flags;
+} PciBar;
+
+// A function found by PCI_Initialise
+typedef struct _PciDevice
+{
+	PciAddress	Address;
+	uint16_t	Vendor;
+	uint16_t	Device;
+	uint8_t		Class;
+	uint8_t		Subclass;
+	uint8_t		ProgIf;
+	uint8_t		Revision;
+	uint8_t		HeaderType;
+	uint8_t		InterruptLine;
+	uint8_t		MsiCapability;		// Offset of the MSI capability, 0 if there is none
+	int			MsiVector;			// Vector MSI was enabled with, -1 if it is not
+	PciBar		Bars[PCI_BAR_COUNT];
+} PciDevice;
+
+// Read and write configuration space registers. Offsets must be aligned to the access size
+uint32_t PCI_ReadConfig32(PciAddress address, uint8_t offset);
+uint16_t PCI_ReadConfig16(PciAddress address, uint8_t offset);
+uint8_t PCI_ReadConfig8(PciAddress address, uint8_t offset);
+void PCI_WriteConfig32(PciAddress address, uint8_t offset, uint32_t value);
+void PCI_WriteConfig16(PciAddress address, uint8_t offset, uint16_t value);
+
+// Walk the buses and record every function, sizing its BARs. Also enables the local APIC
+// (if there is one) so devices can use MSI. Returns the number of functions found
+int PCI_Initialise();
+
+// Return the number of functions found
+int PCI_GetDeviceCount();
+
+// Return function index, or 0 if there is no such function
+PciDevice* PCI_GetDevice(int index);
+
+// Return the function at address, or 0 if there is none
+PciDevice* PCI_GetDeviceAt(PciAddress address);
+
+// Find the index'th function (counting from 0) with the given class and subclass.
+// Returns false if there are not that many
+bool PCI_FindClass(uint8_t classCode, uint8_t subclass, int index, PciAddress* address);
+
+// Find the index'th function (counting from 0) with the given vendor and device id.
+// Returns false if there are not that many
+bool PCI_FindDevice(uint16_t vendor, uint16_t device, int index, PciAddress* address);
+
+// Return BAR n of a function (the raw register value)
+uint32_t PCI_GetBar(PciAddress address, int n);
+
+// Turn on bits in the command register
+void PCI_EnableCommand(PciAddress address, uint16_t bits);
+
+// Map memory BAR n of a function, uncached, and turn on memory decoding.
+// Returns the address of the registers, or 0 for I/O BARs and BARs we cannot reach
+void* PCI_MapBar(PciDevice* device, int n);
+
+// Route the function's interrupt to handler through MSI, on a vector of its own, and turn off
+// its INTx interrupt. The handler must finish with HAL_MessageInterruptDone.
+// Returns the vector, or -1 if the function has no MSI capability or there is no local APIC
+int PCI_EnableMsi(PciDevice* device, void (*handler)());
+
+// Return a short description of a class, e.g. "SATA controller"
+const char* PCI_GetClassName(uint8_t classCode, uint8_t subclass);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _RAMDISK_H
+#define _RAMDISK_H
+
+// Memory backed block devices
+
+#include <stdint.h>
+#include <blockdevice.h>
+
+// Maximum number of RAM disks
+#define RAMDISK_MAX		2
+
+// Sectors copied per read when filling a RAM disk and the caller does not know better
+// (one cylinder of a 1.44MB floppy)
+#define RAMDISK_COPY_SECTORS	36
+
+// Create and register a RAM disk of sectorCount sectors of sectorSize bytes, filled with zeros.
+// Returns 0 if the memory could not be found or the name is taken
+BlockDevice* RamDisk_Create(const char* name, uint32_t sectorCount, uint32_t sectorSize);
+
+// Create and register a RAM disk holding a copy of source, read chunkSectors at a time. Pass the
+// sectors in one cylinder for a floppy so each read is a whole multi-track transfer, or 0 to use
+// RAMDISK_COPY_SECTORS. Returns 0 on failure
+BlockDevice* RamDisk_CreateFrom(const char* name, BlockDevice* source, uint32_t chunkSectors);
+
+#endif
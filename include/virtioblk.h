@@ -0,0 +1,27 @@
+#ifndef _VIRTIOBLK_H
+#define _VIRTIOBLK_H
+
+// virtio-blk paravirtual disk support (legacy virtio PCI interface)
+
+#include <stdint.h>
+#include <blockdevice.h>
+
+// Disks that can be registered ("vd0" to "vd3")
+#define VIRTIO_BLK_MAX_DISKS		4
+
+// Largest transfer in one request. Longer requests are rejected by Submit and split by Read/Write
+#define VIRTIO_BLK_MAX_SECTORS		128
+
+// Find the virtio block devices on the PCI bus, set up their request queues and register them
+// as block devices. irqBaseVector is the interrupt vector of IRQ 0; each device's IRQ line
+// (from PCI configuration space) is installed relative to it.
+// Returns the number of disks found
+int VirtioBlkInstall(int irqBaseVector);
+
+// Return the block device for disk (0 to VIRTIO_BLK_MAX_DISKS - 1), or 0 if there is no such disk
+BlockDevice* VirtioBlkGetBlockDevice(int disk);
+
+// Collect finished requests from every disk. Called from the IRQ handler
+void VirtioBlkServiceInterrupt();
+
+#endif
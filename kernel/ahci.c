@@ -0,0 +1,808 @@
+#include <hal.h>
+#include <ahci.h>
+#include <pci.h>
+#include <string.h>
+#include "physicalmemorymanager.h"
+#include "virtualmemorymanager.h"
+
+// AHCI (SATA) disk support
+//
+// Each port has a command list of up to 32 slots. A slot points at a command table holding
+// the command FIS and the Physical Region Descriptors for the data. Setting a slot's bit in
+// PxCI hands it to the controller. Disks that support NCQ take READ/WRITE FPDMA QUEUED, so every
+// slot can be outstanding at once and the disk completes them in whatever order suits it; the
+// IRQ handler finds finished slots by looking at which bits have cleared from PxSACT and PxCI.
+
+//	HBA registers
+
+#define	AHCI_CAP				0x00
+#define	AHCI_GHC				0x04
+#define	AHCI_IS					0x08
+#define	AHCI_PI					0x0c
+
+#define	AHCI_CAP_NCS_SHIFT		8
+#define	AHCI_CAP_NCS_MASK		0x1f
+#define	AHCI_CAP_SNCQ			0x40000000
+
+#define	AHCI_GHC_IE				0x00000002
+#define	AHCI_GHC_AE				0x80000000
+
+//	Port registers, offsets from the port's registers
+
+#define	AHCI_PORT_BASE			0x100
+#define	AHCI_PORT_SIZE			0x80
+
+#define	AHCI_PxCLB				0x00
+#define	AHCI_PxCLBU				0x04
+#define	AHCI_PxFB				0x08
+#define	AHCI_PxFBU				0x0c
+#define	AHCI_PxIS				0x10
+#define	AHCI_PxIE				0x14
+#define	AHCI_PxCMD				0x18
+#define	AHCI_PxTFD				0x20
+#define	AHCI_PxSIG				0x24
+#define	AHCI_PxSSTS				0x28
+#define	AHCI_PxSERR				0x30
+#define	AHCI_PxSACT				0x34
+#define	AHCI_PxCI				0x38
+
+#define	AHCI_PxCMD_ST			0x00000001
+#define	AHCI_PxCMD_SUD			0x00000002
+#define	AHCI_PxCMD_POD			0x00000004
+#define	AHCI_PxCMD_FRE			0x00000010
+#define	AHCI_PxCMD_FR			0x00004000
+#define	AHCI_PxCMD_CR			0x00008000
+
+#define	AHCI_PxIS_DHRS			0x00000001	// Device to host register FIS
+#define	AHCI_PxIS_PSS			0x00000002	// PIO setup FIS
+#define	AHCI_PxIS_DSS			0x00000004	// DMA setup FIS
+#define	AHCI_PxIS_SDBS			0x00000008	// Set device bits FIS (NCQ completion)
+#define	AHCI_PxIS_IFS			0x08000000
+#define	AHCI_PxIS_HBDS			0x10000000
+#define	AHCI_PxIS_HBFS			0x20000000
+#define	AHCI_PxIS_TFES			0x40000000
+#define	AHCI_PxIS_ERRORS		(AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+#define	AHCI_TFD_ERR			0x01
+#define	AHCI_TFD_DRQ			0x08
+#define	AHCI_TFD_BSY			0x80
+
+#define	AHCI_SSTS_DET_MASK		0x0f
+#define	AHCI_SSTS_DET_PRESENT	0x03
+
+// Signature of a SATA disk (as opposed to ATAPI, port multipliers etc.)
+#define	AHCI_SIG_ATA			0x00000101
+
+//	ATA commands
+
+#define	AHCI_CMD_READ_DMA_EXT		0x25
+#define	AHCI_CMD_WRITE_DMA_EXT		0x35
+#define	AHCI_CMD_READ_FPDMA			0x60
+#define	AHCI_CMD_WRITE_FPDMA		0x61
+#define	AHCI_CMD_FLUSH_CACHE_EXT	0xea
+#define	AHCI_CMD_IDENTIFY			0xec
+
+//	IDENTIFY DEVICE words
+
+#define	AHCI_IDENT_MODEL			27
+#define	AHCI_IDENT_QUEUE_DEPTH		75
+#define	AHCI_IDENT_SATA_CAPS		76
+#define	AHCI_IDENT_SECTORS			60
+#define	AHCI_IDENT_COMMAND_SETS		83
+#define	AHCI_IDENT_SECTORS_EXT		100
+
+#define	AHCI_SATA_CAP_NCQ			0x0100
+#define	AHCI_COMMAND_SET_LBA48		0x0400
+
+// Register host to device FIS
+#define	AHCI_FIS_TYPE_REG_H2D		0x27
+#define	AHCI_FIS_COMMAND			0x80
+
+// PCI class of AHCI controllers
+#define	AHCI_PCI_CLASS				0x01
+#define	AHCI_PCI_SUBCLASS			0x06
+#define	AHCI_PCI_ABAR				5
+
+#define	AHCI_BYTES_PER_SECTOR		512
+#define	AHCI_PAGE_SIZE				4096
+#define	AHCI_MAX_SLOTS				32
+
+// PRDs in each command table. A 64K transfer needs at most 17, even if every page is somewhere else
+#define	AHCI_PRD_ENTRIES			24
+
+// Number of ticks to wait for the controller or a command before giving up
+#define	AHCI_TIMEOUT				300
+
+// Number of ticks to wait for the link to come up on a port
+#define	AHCI_LINK_TIMEOUT			10
+
+// Command header, one per slot in the command list
+typedef struct _AhciCommandHeader
+{
+	uint16_t	Flags;				// Bits 0-4 FIS length in dwords, bit 6 write
+	uint16_t	PrdtLength;			// PRDs in the table
+	uint32_t	PrdByteCount;		// Bytes transferred, filled in by the controller
+	uint32_t	TableAddress;		// Physical address of the command table, 128 byte aligned
+	uint32_t	TableAddressUpper;
+	uint32_t	Reserved[4];
+} __attribute__((packed)) AhciCommandHeader;
+
+#define	AHCI_HEADER_WRITE			0x0040
+
+// Physical Region Descriptor
+typedef struct _AhciPrd
+{
+	uint32_t	Address;
+	uint32_t	AddressUpper;
+	uint32_t	Reserved;
+	uint32_t	ByteCount;			// Bits 0-21 bytes - 1, bit 31 interrupt on completion
+} __attribute__((packed)) AhciPrd;
+
+// Command table. 128 byte aligned
+typedef struct _AhciCommandTable
+{
+	uint8_t		CommandFis[64];
+	uint8_t		AtapiCommand[16];
+	uint8_t		Reserved[48];
+	AhciPrd		Prdt[AHCI_PRD_ENTRIES];
+} __attribute__((packed)) AhciCommandTable;
+
+typedef struct _AhciPort
+{
+	volatile uint8_t*	Registers;
+	int					Index;				// Port number on the controller
+	AhciCommandHeader*	CommandList;		// 1K, 1K aligned
+	uint8_t*			ReceivedFis;		// 256 bytes, 256 aligned
+	AhciCommandTable*	Tables;				// One per slot
+	bool				Ncq;
+	uint32_t			QueueDepth;			// Slots we use
+	uint32_t			Active;				// Slots handed to the controller
+	BlockRequest*		Requests[AHCI_MAX_SLOTS];
+	uint32_t			SectorCount;
+	char				Model[41];
+	char				Name[4];
+	BlockDevice			Device;
+} AhciPort;
+
+// The controller's registers
+static volatile uint8_t* _Registers = 0;
+
+// IRQ the controller is on, if it is not using MSI
+static int _Irq = -1;
+
+static AhciPort _Disks[AHCI_MAX_DISKS];
+static int _DiskCount = 0;
+
+// Slots available on each port
+static uint32_t _Slots = 1;
+
+// Set while the IRQ handler runs, so requests submitted from a completion routine
+// do not turn interrupts back on
+static volatile bool _InInterrupt = false;
+
+// Read a register
+static inline uint32_t AhciRead(volatile uint8_t* registers, uint32_t reg)
+{
+	return *(volatile uint32_t*)(registers + reg);
+}
+
+// Write a register
+static inline void AhciWrite(volatile uint8_t* registers, uint32_t reg, uint32_t value)
+{
+	*(volatile uint32_t*)(registers + reg) = value;
+}
+
+// Wait for bits of a register to clear. Returns false if they did not in time
+static bool AhciWaitClear(volatile uint8_t* registers, uint32_t reg, uint32_t bits)
+{
+	uint32_t timeout = HAL_GetTickCount() + AHCI_TIMEOUT;
+	while (AhciRead(registers, reg) & bits)
+	{
+		if (HAL_GetTickCount() > timeout)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Stop the port processing its command list and receiving FISes
+static bool AhciStopPort(AhciPort* port)
+{
+	AhciWrite(port->Registers, AHCI_PxCMD, AhciRead(port->Registers, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+	if (!AhciWaitClear(port->Registers, AHCI_PxCMD, AHCI_PxCMD_CR))
+	{
+		return false;
+	}
+	AhciWrite(port->Registers, AHCI_PxCMD, AhciRead(port->Registers, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+	return AhciWaitClear(port->Registers, AHCI_PxCMD, AHCI_PxCMD_FR);
+}
+
+// Start the port once the disk is ready
+static bool AhciStartPort(AhciPort* port)
+{
+	AhciWrite(port->Registers, AHCI_PxCMD, AhciRead(port->Registers, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+	if (!AhciWaitClear(port->Registers, AHCI_PxTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ))
+	{
+		return false;
+	}
+	AhciWrite(port->Registers, AHCI_PxCMD, AhciRead(port->Registers, AHCI_PxCMD) | AHCI_PxCMD_ST);
+	return true;
+}
+
+// Finish the request in slot with the given status
+static void AhciCompleteSlot(AhciPort* port, int slot, int status)
+{
+	BlockRequest* request = port->Requests[slot];
+	port->Requests[slot] = 0;
+	port->Active &= ~(1u << slot);
+	if (request)
+	{
+		request->Status = status;
+		if (request->Completion)
+		{
+			request->Completion(request);
+		}
+	}
+}
+
+// Something went wrong. Restart the port, which throws away everything it was doing,
+// and fail every outstanding request
+static void AhciRecoverPort(AhciPort* port)
+{
+	AhciStopPort(port);
+	AhciWrite(port->Registers, AHCI_PxSERR, 0xffffffff);
+	AhciWrite(port->Registers, AHCI_PxIS, 0xffffffff);
+	AhciStartPort(port);
+	for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++)
+	{
+		if (port->Active & (1u << slot))
+		{
+			AhciCompleteSlot(port, slot, BLOCK_REQUEST_ERROR);
+		}
+	}
+}
+
+// See which commands on a port have finished
+static void AhciServicePort(AhciPort* port)
+{
+	uint32_t status = AhciRead(port->Registers, AHCI_PxIS);
+	AhciWrite(port->Registers, AHCI_PxIS, status);
+
+	if (status & AHCI_PxIS_ERRORS)
+	{
+		AhciRecoverPort(port);
+		return;
+	}
+	// Queued commands stay in PxSACT until the disk says they are done, others stay in PxCI
+	uint32_t outstanding = AhciRead(port->Registers, AHCI_PxSACT) | AhciRead(port->Registers, AHCI_PxCI);
+	uint32_t finished = port->Active & ~outstanding;
+	for (int slot = 0; finished; slot++, finished >>= 1)
+	{
+		if (finished & 1)
+		{
+			AhciCompleteSlot(port, slot, BLOCK_REQUEST_DONE);
+		}
+	}
+}
+
+// Move the ports on
+void AhciServiceInterrupt()
+{
+	uint32_t pending = AhciRead(_Registers, AHCI_IS);
+
+	// Includes the port being set up by AhciInstall, which identifies its disk with interrupts
+	for (int i = 0; i <= _DiskCount && i < AHCI_MAX_DISKS; i++)
+	{
+		if (_Disks[i].Registers && (pending & (1u << _Disks[i].Index)))
+		{
+			AhciServicePort(&_Disks[i]);
+		}
+	}
+	// Port status first, then the HBA's
+	AhciWrite(_Registers, AHCI_IS, pending);
+}
+
+// AHCI controller IRQ handler
+void I86_AhciInterruptHandler()
+{
+	asm("pushal");
+	asm("cli");
+
+	_InInterrupt = true;
+	AhciServiceInterrupt();
+	_InInterrupt = false;
+
+	// Tell HAL we are done
+	HAL_InterruptDone(_Irq);
+
+	asm("sti");
+	asm("popal");
+	asm("leave");
+	asm("iret");
+}
+
+// AHCI controller MSI handler
+void I86_AhciMsiHandler()
+{
+	asm("pushal");
+	asm("cli");
+
+	_InInterrupt = true;
+	AhciServiceInterrupt();
+	_InInterrupt = false;
+
+	// Tell HAL we are done
+	HAL_MessageInterruptDone();
+
+	asm("sti");
+	asm("popal");
+	asm("leave");
+	asm("iret");
+}
+
+// Describe bytes of buffer in a command table. Returns the number of PRDs used, or 0 if
+// part of the buffer is not mapped, is not word aligned or needs too many PRDs
+static int AhciBuildPrdTable(AhciCommandTable* table, uint8_t* buffer, uint32_t bytes)
+{
+	int entries = 0;
+	uint32_t address = 0;
+	uint32_t length = 0;
+
+	while (bytes > 0)
+	{
+		uint32_t physical = VMM_GetPhysicalAddress(buffer);
+		if (physical == 0 || (physical & 1))
+		{
+			return 0;
+		}
+		uint32_t piece = AHCI_PAGE_SIZE - (physical & (AHCI_PAGE_SIZE - 1));
+		piece = piece > bytes ? bytes : piece;
+
+		if (length > 0 && address + length == physical)
+		{
+			length += piece;
+		}
+		else
+		{
+			if (length > 0)
+			{
+				if (entries == AHCI_PRD_ENTRIES)
+				{
+					return 0;
+				}
+				table->Prdt[entries].Address = address;
+				table->Prdt[entries].AddressUpper = 0;
+				table->Prdt[entries].Reserved = 0;
+				table->Prdt[entries].ByteCount = length - 1;
+				entries++;
+			}
+			address = physical;
+			length = piece;
+		}
+		buffer += piece;
+		bytes -= piece;
+	}
+	if (entries == AHCI_PRD_ENTRIES)
+	{
+		return 0;
+	}
+	table->Prdt[entries].Address = address;
+	table->Prdt[entries].AddressUpper = 0;
+	table->Prdt[entries].Reserved = 0;
+	table->Prdt[entries].ByteCount = (length - 1) | 0x80000000;
+	return entries + 1;
+}
+
+// Hand a command for request to the controller. Queued commands go in any free slot,
+// others only when the port is otherwise idle. Returns -1 if there is no room or the
+// buffer cannot be described to the controller
+static int AhciIssue(AhciPort* port, BlockRequest* request, uint8_t command, bool queued)
+{
+	bool interruptsOff = !_InInterrupt;
+	int result = -1;
+
+	if (interruptsOff)
+	{
+		HAL_DisableInterrupts();
+	}
+	int slot = -1;
+	if (queued || port->Active == 0)
+	{
+		for (uint32_t i = 0; i < port->QueueDepth; i++)
+		{
+			if (!(port->Active & (1u << i)))
+			{
+				slot = (int)i;
+				break;
+			}
+		}
+	}
+	if (slot >= 0)
+	{
+		AhciCommandTable* table = &port->Tables[slot];
+		AhciCommandHeader* header = &port->CommandList[slot];
+		int prds = 0;
+		if (request->Count > 0)
+		{
+			prds = AhciBuildPrdTable(table, request->Buffer, request->Count * AHCI_BYTES_PER_SECTOR);
+		}
+		if (request->Count == 0 || prds > 0)
+		{
+			uint8_t* fis = table->CommandFis;
+			uint32_t lba = request->LBA;
+			uint32_t count = request->Count;
+			memset(fis, 0, 20);
+			fis[0] = AHCI_FIS_TYPE_REG_H2D;
+			fis[1] = AHCI_FIS_COMMAND;
+			fis[2] = command;
+			fis[4] = (uint8_t)lba;
+			fis[5] = (uint8_t)(lba >> 8);
+			fis[6] = (uint8_t)(lba >> 16);
+			fis[7] = 0x40;		// LBA mode
+			fis[8] = (uint8_t)(lba >> 24);
+			if (queued)
+			{
+				// The count goes in the features registers, the tag in the count register
+				fis[3] = (uint8_t)count;
+				fis[11] = (uint8_t)(count >> 8);
+				fis[12] = (uint8_t)(slot << 3);
+			}
+			else
+			{
+				fis[12] = (uint8_t)count;
+				fis[13] = (uint8_t)(count >> 8);
+			}
+
+			// FIS length is 5 dwords
+			header->Flags = 5 | (request->Write ? AHCI_HEADER_WRITE : 0);
+			header->PrdtLength = (uint16_t)prds;
+			header->PrdByteCount = 0;
+
+			request->Status = BLOCK_REQUEST_PENDING;
+			port->Requests[slot] = request;
+			port->Active |= 1u << slot;
+			if (queued)
+			{
+				AhciWrite(port->Registers, AHCI_PxSACT, 1u << slot);
+			}
+			AhciWrite(port->Registers, AHCI_PxCI, 1u << slot);
+			result = 0;
+		}
+	}
+	if (interruptsOff)
+	{
+		HAL_EnableInterrupts();
+	}
+	return result;
+}
+
+// Block device Submit. Read and write commands are queued if the disk has NCQ
+static int AhciSubmit(BlockDevice* device, BlockRequest* request)
+{
+	AhciPort* port = (AhciPort*)device->Private;
+	if (request->Count > AHCI_MAX_SECTORS)
+	{
+		return -1;
+	}
+	uint8_t command;
+	if (port->Ncq)
+	{
+		command = request->Write ? AHCI_CMD_WRITE_FPDMA : AHCI_CMD_READ_FPDMA;
+	}
+	else
+	{
+		command = request->Write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
+	}
+	return AhciIssue(port, request, command, port->Ncq);
+}
+
+// Wait for a request to finish. If the port takes too long it is restarted and the request fails
+static bool AhciWait(AhciPort* port, BlockRequest* request)
+{
+	uint32_t timeout = HAL_GetTickCount() + AHCI_TIMEOUT;
+
+	HAL_DisableInterrupts();
+	while (request->Status == BLOCK_REQUEST_PENDING)
+	{
+		if (HAL_GetTickCount() > timeout)
+		{
+			HAL_EnableInterrupts();
+			AhciRecoverPort(port);
+			return false;
+		}
+		HAL_WaitForInterrupt();
+		HAL_DisableInterrupts();
+	}
+	HAL_EnableInterrupts();
+	return request->Status == BLOCK_REQUEST_DONE;
+}
+
+// Issue a command and wait for it. Waits for a slot if the port is busy with queued requests
+static bool AhciExecute(AhciPort* port, BlockRequest* request, uint8_t command, bool queued)
+{
+	uint32_t timeout = HAL_GetTickCount() + AHCI_TIMEOUT;
+
+	request->Completion = 0;
+	while (AhciIssue(port, request, command, queued) != 0)
+	{
+		// A buffer we cannot use will never work, a busy port will clear eventually
+		if (request->Count > 0 && port->Active == 0)
+		{
+			return false;
+		}
+		if (HAL_GetTickCount() > timeout)
+		{
+			return false;
+		}
+		HAL_DisableInterrupts();
+		if (port->Active != 0)
+		{
+			HAL_WaitForInterrupt();
+		}
+		HAL_EnableInterrupts();
+	}
+	return AhciWait(port, request);
+}
+
+// Block device read and write
+static int AhciTransfer(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer, bool write)
+{
+	AhciPort* port = (AhciPort*)device->Private;
+	BlockRequest request;
+
+	request.LBA = lba;
+	request.Count = count > AHCI_MAX_SECTORS ? AHCI_MAX_SECTORS : count;
+	request.Buffer = buffer;
+	request.Write = write;
+	request.Context = 0;
+	uint8_t command;
+	if (port->Ncq)
+	{
+		command = write ? AHCI_CMD_WRITE_FPDMA : AHCI_CMD_READ_FPDMA;
+	}
+	else
+	{
+		command = write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
+	}
+	if (!AhciExecute(port, &request, command, port->Ncq))
+	{
+		return 0;
+	}
+	return request.Count;
+}
+
+static int AhciBlockRead(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	return AhciTransfer(device, lba, count, buffer, false);
+}
+
+static int AhciBlockWrite(BlockDevice* device, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+	return AhciTransfer(device, lba, count, (uint8_t*)buffer, true);
+}
+
+// Flush the disk's write cache. Not a queued command, so it waits for the queue to drain
+static int AhciBlockFlush(BlockDevice* device)
+{
+	AhciPort* port = (AhciPort*)device->Private;
+	BlockRequest request;
+
+	request.LBA = 0;
+	request.Count = 0;
+	request.Buffer = 0;
+	request.Write = false;
+	request.Context = 0;
+	return AhciExecute(port, &request, AHCI_CMD_FLUSH_CACHE_EXT, false) ? 0 : -1;
+}
+
+// Copy an IDENTIFY string (byte swapped words, space padded) into name
+static void AhciCopyIdentifyString(const uint16_t* words, int count, char* name)
+{
+	for (int i = 0; i < count; i++)
+	{
+		name[i * 2] = (char)(words[i] >> 8);
+		name[i * 2 + 1] = (char)(words[i] & 0xff);
+	}
+	int length = count * 2;
+	while (length > 0 && name[length - 1] == ' ')
+	{
+		length--;
+	}
+	name[length] = 0;
+}
+
+// Identify the disk on a started port
+static bool AhciIdentify(AhciPort* port)
+{
+	static uint16_t identify[256];
+	BlockRequest request;
+
+	request.LBA = 0;
+	request.Count = 1;
+	request.Buffer = (uint8_t*)identify;
+	request.Write = false;
+	request.Context = 0;
+	if (!AhciExecute(port, &request, AHCI_CMD_IDENTIFY, false))
+	{
+		return false;
+	}
+	// We only issue LBA48 commands
+	if (!(identify[AHCI_IDENT_COMMAND_SETS] & AHCI_COMMAND_SET_LBA48))
+	{
+		return false;
+	}
+	if (identify[AHCI_IDENT_SECTORS_EXT + 2] || identify[AHCI_IDENT_SECTORS_EXT + 3])
+	{
+		port->SectorCount = 0xffffffff;
+	}
+	else
+	{
+		port->SectorCount = identify[AHCI_IDENT_SECTORS_EXT] | ((uint32_t)identify[AHCI_IDENT_SECTORS_EXT + 1] << 16);
+	}
+	AhciCopyIdentifyString(&identify[AHCI_IDENT_MODEL], 20, port->Model);
+
+	// Queue as deep as both the controller and the disk allow
+	port->Ncq = (AhciRead(_Registers, AHCI_CAP) & AHCI_CAP_SNCQ) && (identify[AHCI_IDENT_SATA_CAPS] & AHCI_SATA_CAP_NCQ);
+	if (port->Ncq)
+	{
+		uint32_t depth = (identify[AHCI_IDENT_QUEUE_DEPTH] & 0x1f) + 1;
+		port->QueueDepth = depth < _Slots ? depth : _Slots;
+	}
+	return true;
+}
+
+// Set up a port with a disk on it. Returns false if there is no usable disk there
+static bool AhciSetupPort(AhciPort* port, int index)
+{
+	port->Registers = _Registers + AHCI_PORT_BASE + index * AHCI_PORT_SIZE;
+	port->Index = index;
+	port->Active = 0;
+
+	// Anything there?
+	uint32_t timeout = HAL_GetTickCount() + AHCI_LINK_TIMEOUT;
+	while ((AhciRead(port->Registers, AHCI_PxSSTS) & AHCI_SSTS_DET_MASK) != AHCI_SSTS_DET_PRESENT)
+	{
+		if (HAL_GetTickCount() > timeout)
+		{
+			return false;
+		}
+	}
+	if (AhciRead(port->Registers, AHCI_PxSIG) != AHCI_SIG_ATA || !AhciStopPort(port))
+	{
+		return false;
+	}
+
+	// Command list and received FIS area share a block. Command tables get 4 more
+	uint32_t tableBlocks = (AHCI_MAX_SLOTS * sizeof(AhciCommandTable) + AHCI_PAGE_SIZE - 1) / AHCI_PAGE_SIZE;
+	uint8_t* block = (uint8_t*)PMM_AllocateBlock();
+	port->Tables = (AhciCommandTable*)PMM_AllocateBlocks(tableBlocks);
+	if (!block || !port->Tables || !VMM_IdentityMapRange(block, AHCI_PAGE_SIZE) ||
+		!VMM_IdentityMapRange(port->Tables, tableBlocks * AHCI_PAGE_SIZE))
+	{
+		if (block)
+		{
+			PMM_FreeBlock(block);
+		}
+		if (port->Tables)
+		{
+			PMM_FreeBlocks(port->Tables, tableBlocks);
+			port->Tables = 0;
+		}
+		return false;
+	}
+	memset(block, 0, AHCI_PAGE_SIZE);
+	port->CommandList = (AhciCommandHeader*)block;
+	port->ReceivedFis = block + 1024;
+	for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++)
+	{
+		memset(&port->Tables[slot], 0, sizeof(AhciCommandTable));
+		port->CommandList[slot].TableAddress = VMM_GetPhysicalAddress(&port->Tables[slot]);
+		port->CommandList[slot].TableAddressUpper = 0;
+		port->Requests[slot] = 0;
+	}
+	AhciWrite(port->Registers, AHCI_PxCLB, VMM_GetPhysicalAddress(port->CommandList));
+	AhciWrite(port->Registers, AHCI_PxCLBU, 0);
+	AhciWrite(port->Registers, AHCI_PxFB, VMM_GetPhysicalAddress(port->ReceivedFis));
+	AhciWrite(port->Registers, AHCI_PxFBU, 0);
+
+	port->Active = 0;
+	port->Ncq = false;
+	port->QueueDepth = 1;
+	AhciWrite(port->Registers, AHCI_PxSERR, 0xffffffff);
+	AhciWrite(port->Registers, AHCI_PxIS, 0xffffffff);
+	AhciWrite(port->Registers, AHCI_PxCMD, AhciRead(port->Registers, AHCI_PxCMD) | AHCI_PxCMD_SUD | AHCI_PxCMD_POD);
+	if (!AhciStartPort(port))
+	{
+		return false;
+	}
+	AhciWrite(port->Registers, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS | AHCI_PxIS_ERRORS);
+	if (!AhciIdentify(port))
+	{
+		// Keep the port quiet, nothing will service it
+		AhciWrite(port->Registers, AHCI_PxIE, 0);
+		AhciStopPort(port);
+		AhciWrite(port->Registers, AHCI_PxIS, 0xffffffff);
+		return false;
+	}
+	return true;
+}
+
+// Find the controller and set up its ports
+int AhciInstall(int irqBaseVector)
+{
+	PciAddress address;
+
+	if (!PCI_FindClass(AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS, 0, &address))
+	{
+		return 0;
+	}
+	PciDevice* device = PCI_GetDeviceAt(address);
+	_Registers = (volatile uint8_t*)PCI_MapBar(device, AHCI_PCI_ABAR);
+	if (!_Registers)
+	{
+		return 0;
+	}
+	// A vector of our own if the controller can do MSI, otherwise the legacy IRQ line
+	if (PCI_EnableMsi(device, I86_AhciMsiHandler) < 0)
+	{
+		if (device->InterruptLine > 15)
+		{
+			// Nothing to complete commands with
+			return 0;
+		}
+		_Irq = device->InterruptLine;
+		HAL_SetInterruptVector(irqBaseVector + _Irq, I86_AhciInterruptHandler);
+		PCI_WriteConfig16(address, PCI_CONFIG_COMMAND, PCI_ReadConfig16(address, PCI_CONFIG_COMMAND) & ~PCI_COMMAND_INTX_DISABLE);
+	}
+	PCI_EnableCommand(address, PCI_COMMAND_BUS_MASTER);
+
+	// AHCI mode, with interrupts from the ports once they are set up
+	AhciWrite(_Registers, AHCI_GHC, AhciRead(_Registers, AHCI_GHC) | AHCI_GHC_AE);
+	AhciWrite(_Registers, AHCI_IS, 0xffffffff);
+	AhciWrite(_Registers, AHCI_GHC, AhciRead(_Registers, AHCI_GHC) | AHCI_GHC_IE);
+	_Slots = ((AhciRead(_Registers, AHCI_CAP) >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1;
+
+	uint32_t implemented = AhciRead(_Registers, AHCI_PI);
+	for (int index = 0; index < 32 && _DiskCount < AHCI_MAX_DISKS; index++)
+	{
+		if (!(implemented & (1u << index)))
+		{
+			continue;
+		}
+		AhciPort* port = &_Disks[_DiskCount];
+		if (!AhciSetupPort(port, index))
+		{
+			continue;
+		}
+		port->Name[0] = 's';
+		port->Name[1] = 'd';
+		port->Name[2] = (char)('0' + _DiskCount);
+		port->Name[3] = 0;
+		port->Device.Name = port->Name;
+		port->Device.SectorSize = AHCI_BYTES_PER_SECTOR;
+		port->Device.SectorCount = port->SectorCount;
+		port->Device.QueueDepth = port->QueueDepth;
+		port->Device.Read = AhciBlockRead;
+		port->Device.Write = AhciBlockWrite;
+		port->Device.Flush = AhciBlockFlush;
+		port->Device.Submit = AhciSubmit;
+		port->Device.Poll = 0;
+		port->Device.MediaGeneration = 0;
+		port->Device.Revalidate = 0;
+		port->Device.Private = port;
+		_DiskCount++;
+		BlockDevice_Register(&port->Device);
+	}
+	return _DiskCount;
+}
+
+// Return the block device for disk
+BlockDevice* AhciGetBlockDevice(int disk)
+{
+	if (disk < 0 || disk >= _DiskCount)
+	{
+		return 0;
+	}
+	return &_Disks[disk].Device;
+}
@@ -0,0 +1,889 @@
+#include <hal.h>
+#include <ata.h>
+#include <pci.h>
+#include <string.h>
+#include "physicalmemorymanager.h"
+#include "virtualmemorymanager.h"
+
+// ATA (IDE) hard disk support
+//
+// Each channel has a command block of eight registers and a control block. If the IDE
+// controller can bus master (PIIX style), transfers use DMA: the controller walks a table
+// of Physical Region Descriptors (PRDs) describing the pieces of the caller's buffer and
+// raises one IRQ at the end, so the CPU never touches the data. Otherwise transfers use
+// PIO with READ/WRITE MULTIPLE, so the drive raises one IRQ per block of sectors rather than
+// one per sector, and each block is moved with a single rep insw/outsw.
+
+//	Command block registers, offsets from the channel's base port
+
+#define	ATA_REG_DATA			0
+#define	ATA_REG_ERROR			1
+#define	ATA_REG_FEATURES		1
+#define	ATA_REG_SECCOUNT		2
+#define	ATA_REG_LBA_LOW			3
+#define	ATA_REG_LBA_MID			4
+#define	ATA_REG_LBA_HIGH		5
+#define	ATA_REG_DRIVE			6
+#define	ATA_REG_STATUS			7
+#define	ATA_REG_COMMAND			7
+
+//	Control block register. Reads give the alternate status, which does not clear the IRQ
+
+#define	ATA_REG_CONTROL			0
+#define	ATA_REG_ALT_STATUS		0
+
+//	Status register bits
+
+#define	ATA_SR_ERR				0x01	//00000001
+#define	ATA_SR_DRQ				0x08	//00001000
+#define	ATA_SR_DF				0x20	//00100000
+#define	ATA_SR_DRDY				0x40	//01000000
+#define	ATA_SR_BSY				0x80	//10000000
+
+//	Device control register bits
+
+#define	ATA_CTRL_NIEN			0x02	//00000010	Disable the IRQ
+#define	ATA_CTRL_SRST			0x04	//00000100	Software reset
+
+//	Drive/head register bits
+
+#define	ATA_DRIVE_BASE			0xa0	//10100000
+#define	ATA_DRIVE_LBA			0x40	//01000000
+#define	ATA_DRIVE_SLAVE			0x10	//00010000
+
+//	Commands
+
+#define	ATA_CMD_READ_SECTORS		0x20
+#define	ATA_CMD_READ_SECTORS_EXT	0x24
+#define	ATA_CMD_READ_MULTIPLE_EXT	0x29
+#define	ATA_CMD_WRITE_SECTORS		0x30
+#define	ATA_CMD_WRITE_SECTORS_EXT	0x34
+#define	ATA_CMD_WRITE_MULTIPLE_EXT	0x39
+#define	ATA_CMD_READ_DMA_EXT		0x25
+#define	ATA_CMD_WRITE_DMA_EXT		0x35
+#define	ATA_CMD_READ_DMA			0xc8
+#define	ATA_CMD_WRITE_DMA			0xca
+#define	ATA_CMD_READ_MULTIPLE		0xc4
+#define	ATA_CMD_WRITE_MULTIPLE		0xc5
+#define	ATA_CMD_SET_MULTIPLE		0xc6
+#define	ATA_CMD_FLUSH_CACHE			0xe7
+#define	ATA_CMD_FLUSH_CACHE_EXT		0xea
+#define	ATA_CMD_IDENTIFY			0xec
+
+//	IDENTIFY DEVICE words
+
+#define	ATA_IDENT_MODEL				27
+#define	ATA_IDENT_MAX_MULTIPLE		47
+#define	ATA_IDENT_CAPABILITIES		49
+#define	ATA_IDENT_SECTORS			60
+#define	ATA_IDENT_COMMAND_SETS		83
+#define	ATA_IDENT_SECTORS_EXT		100
+
+#define	ATA_CAPABILITY_DMA			0x0100
+#define	ATA_CAPABILITY_LBA			0x0200
+#define	ATA_COMMAND_SET_LBA48		0x0400
+
+//	Bus master registers, offsets from the channel's bus master base (BAR 4 of the IDE controller, + 8 for the secondary)
+
+#define	ATA_BM_COMMAND				0
+#define	ATA_BM_STATUS				2
+#define	ATA_BM_PRDT					4
+
+#define	ATA_BM_CMD_START			0x01	//00000001
+#define	ATA_BM_CMD_READ				0x08	//00001000	Device to memory
+
+#define	ATA_BM_STATUS_ACTIVE		0x01	//00000001
+#define	ATA_BM_STATUS_ERROR			0x02	//00000010
+#define	ATA_BM_STATUS_INTERRUPT		0x04	//00000100
+
+// PCI class of IDE controllers, and the programming interface bit saying it can bus master
+#define	ATA_PCI_CLASS				0x01
+#define	ATA_PCI_SUBCLASS			0x01
+#define	ATA_PCI_PROG_IF_BUS_MASTER	0x80
+
+// Last entry in a PRD table
+#define	ATA_PRD_END_OF_TABLE		0x8000
+
+// Bytes per sector
+#define	ATA_BYTES_PER_SECTOR		512
+
+// Largest DMA transfer in one command. Even if every page of the buffer is in a different place
+// this needs 257 PRDs, which fit in the one page table
+#define	ATA_DMA_MAX_SECTORS			2048
+#define	ATA_PAGE_SIZE				4096
+
+// Largest transfer in one command. A sector count of 0 means 256 for LBA28 commands
+#define	ATA_MAX_SECTORS_LBA28		256
+#define	ATA_MAX_SECTORS_LBA48		65536
+
+// Number of ticks to wait for a drive before giving up on it
+#define	ATA_TIMEOUT					300
+
+// Transfer states
+#define	ATA_TRANSFER_IDLE			0
+#define	ATA_TRANSFER_BUSY			1
+#define	ATA_TRANSFER_DONE			2
+#define	ATA_TRANSFER_ERROR			3
+
+// IRQs of the two channels
+const int ATA_PRIMARY_IRQ = 14;
+const int ATA_SECONDARY_IRQ = 15;
+
+// Physical Region Descriptor. A byte count of 0 means 64K. A region must not cross a 64K boundary
+typedef struct _AtaPrd
+{
+	uint32_t			Address;
+	uint16_t			ByteCount;
+	uint16_t			Flags;
+} __attribute__((packed)) AtaPrd;
+
+// Number of PRDs in a channel's table (one page)
+#define	ATA_PRD_ENTRIES				(ATA_PAGE_SIZE / sizeof(AtaPrd))
+
+typedef struct _AtaChannel
+{
+	uint16_t			Base;			// Command block registers
+	uint16_t			Control;		// Control block register
+	int					Selected;		// Drive last selected (0 master, 1 slave, -1 unknown)
+	uint16_t			BusMaster;		// Bus master registers, 0 if the channel cannot do DMA
+	AtaPrd*				PrdTable;
+	uint32_t			PrdPhysical;
+
+	// The transfer in progress
+	volatile int		Status;			// ATA_TRANSFER_xxx
+	bool				Writing;
+	bool				Dma;
+	uint8_t*			Buffer;			// Where the next block goes to or comes from
+	uint32_t			Remaining;		// Sectors still to move
+	uint32_t			BlockSectors;	// Sectors per DRQ block
+} AtaChannel;
+
+typedef struct _AtaDrive
+{
+	bool				Present;
+	int					Channel;
+	int					Slave;
+	bool				Lba48;
+	uint32_t			SectorCount;
+	uint32_t			MultipleSectors;	// Sectors per block for READ/WRITE MULTIPLE, 0 if not supported
+	bool				Dma;				// Transfers use bus master DMA
+	char				Model[41];
+	char				Name[4];
+	BlockDevice			Device;
+} AtaDrive;
+
+static AtaChannel _Channels[2] =
+{
+	{ 0x1f0, 0x3f6, -1, 0, 0, 0, ATA_TRANSFER_IDLE, false, false, 0, 0, 0 },
+	{ 0x170, 0x376, -1, 0, 0, 0, ATA_TRANSFER_IDLE, false, false, 0, 0, 0 }
+};
+
+static AtaDrive _Drives[ATA_MAX_DRIVES];
+
+// Read the status register. This clears a pending IRQ
+static uint8_t AtaReadStatus(AtaChannel* channel)
+{
+	return HAL_InputByteFromPort(channel->Base + ATA_REG_STATUS);
+}
+
+// Read the alternate status register. Leaves the IRQ alone
+static uint8_t AtaReadAltStatus(AtaChannel* channel)
+{
+	return HAL_InputByteFromPort(channel->Control + ATA_REG_ALT_STATUS);
+}
+
+// Give the drive the 400ns it needs to put a valid status up after a command or select
+static void AtaDelay(AtaChannel* channel)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		AtaReadAltStatus(channel);
+	}
+}
+
+// Wait for BSY to clear. Returns the status, or 0xff if the drive never became ready
+static uint8_t AtaWaitNotBusy(AtaChannel* channel)
+{
+	uint32_t timeout = HAL_GetTickCount() + ATA_TIMEOUT;
+	uint8_t status;
+	while ((status = AtaReadAltStatus(channel)) & ATA_SR_BSY)
+	{
+		if (HAL_GetTickCount() > timeout)
+		{
+			return 0xff;
+		}
+	}
+	return status;
+}
+
+// Wait for the drive to ask for data (DRQ) or report an error. Returns false on error or timeout
+static bool AtaWaitForData(AtaChannel* channel)
+{
+	uint8_t status = AtaWaitNotBusy(channel);
+	while (status != 0xff && !(status & (ATA_SR_DRQ | ATA_SR_ERR | ATA_SR_DF)))
+	{
+		status = AtaWaitNotBusy(channel);
+	}
+	return status != 0xff && (status & (ATA_SR_ERR | ATA_SR_DF)) == 0;
+}
+
+// Select a drive on its channel
+static void AtaSelect(AtaChannel* channel, int slave, uint8_t bits)
+{
+	HAL_OutputByteToPort(channel->Base + ATA_REG_DRIVE, (uint8_t)(ATA_DRIVE_BASE | (slave ? ATA_DRIVE_SLAVE : 0) | bits));
+	if (channel->Selected != slave)
+	{
+		AtaDelay(channel);
+		channel->Selected = slave;
+	}
+}
+
+// Reset both drives on a channel. The IRQ is left disabled. Returns false if there is nothing on the channel
+static bool AtaResetChannel(AtaChannel* channel)
+{
+	// A floating bus reads back all ones
+	if (AtaReadAltStatus(channel) == 0xff)
+	{
+		return false;
+	}
+	HAL_OutputByteToPort(channel->Control + ATA_REG_CONTROL, ATA_CTRL_SRST | ATA_CTRL_NIEN);
+	AtaDelay(channel);
+	HAL_OutputByteToPort(channel->Control + ATA_REG_CONTROL, ATA_CTRL_NIEN);
+	AtaDelay(channel);
+	channel->Selected = -1;
+	return AtaWaitNotBusy(channel) != 0xff;
+}
+
+// Copy an IDENTIFY string (byte swapped words, space padded) into name
+static void AtaCopyIdentifyString(const uint16_t* words, int count, char* name)
+{
+	for (int i = 0; i < count; i++)
+	{
+		name[i * 2] = (char)(words[i] >> 8);
+		name[i * 2 + 1] = (char)(words[i] & 0xff);
+	}
+	int length = count * 2;
+	while (length > 0 && name[length - 1] == ' ')
+	{
+		length--;
+	}
+	name[length] = 0;
+}
+
+// Identify the drive and set it up for READ/WRITE MULTIPLE. Runs polled, with the IRQ disabled.
+// Returns false if there is no ATA disk there
+static bool AtaIdentify(AtaDrive* drive)
+{
+	AtaChannel* channel = &_Channels[drive->Channel];
+	uint16_t identify[256];
+
+	AtaSelect(channel, drive->Slave, 0);
+	HAL_OutputByteToPort(channel->Base + ATA_REG_SECCOUNT, 0);
+	HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_LOW, 0);
+	HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_MID, 0);
+	HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_HIGH, 0);
+	HAL_OutputByteToPort(channel->Base + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+	AtaDelay(channel);
+	if (AtaReadAltStatus(channel) == 0 || AtaWaitNotBusy(channel) == 0xff)
+	{
+		// No drive
+		return false;
+	}
+	// ATAPI and SATA devices put a signature here and abort the command
+	if (HAL_InputByteFromPort(channel->Base + ATA_REG_LBA_MID) != 0 ||
+		HAL_InputByteFromPort(channel->Base + ATA_REG_LBA_HIGH) != 0)
+	{
+		return false;
+	}
+	if (!AtaWaitForData(channel))
+	{
+		return false;
+	}
+	HAL_InputWordsFromPort(channel->Base + ATA_REG_DATA, identify, 256);
+	AtaReadStatus(channel);
+
+	if (!(identify[ATA_IDENT_CAPABILITIES] & ATA_CAPABILITY_LBA))
+	{
+		// CHS only. Too old to bother with
+		return false;
+	}
+	drive->Lba48 = (identify[ATA_IDENT_COMMAND_SETS] & ATA_COMMAND_SET_LBA48) != 0;
+	// Only used if the controller turns out to be able to bus master
+	drive->Dma = (identify[ATA_IDENT_CAPABILITIES] & ATA_CAPABILITY_DMA) != 0;
+	drive->SectorCount = identify[ATA_IDENT_SECTORS] | ((uint32_t)identify[ATA_IDENT_SECTORS + 1] << 16);
+	if (drive->Lba48 && (identify[ATA_IDENT_SECTORS_EXT + 2] || identify[ATA_IDENT_SECTORS_EXT + 3]))
+	{
+		// Bigger than we can address with 32 bits. Use what we can
+		drive->SectorCount = 0xffffffff;
+	}
+	else if (drive->Lba48)
+	{
+		drive->SectorCount = identify[ATA_IDENT_SECTORS_EXT] | ((uint32_t)identify[ATA_IDENT_SECTORS_EXT + 1] << 16);
+	}
+	AtaCopyIdentifyString(&identify[ATA_IDENT_MODEL], 20, drive->Model);
+
+	// Use the biggest block the drive allows for READ/WRITE MULTIPLE
+	drive->MultipleSectors = 0;
+	uint8_t maxMultiple = identify[ATA_IDENT_MAX_MULTIPLE] & 0xff;
+	if (maxMultiple > 0)
+	{
+		AtaSelect(channel, drive->Slave, 0);
+		HAL_OutputByteToPort(channel->Base + ATA_REG_SECCOUNT, maxMultiple);
+		HAL_OutputByteToPort(channel->Base + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+		AtaDelay(channel);
+		uint8_t status = AtaWaitNotBusy(channel);
+		AtaReadStatus(channel);
+		if (status != 0xff && !(status & (ATA_SR_ERR | ATA_SR_DF)))
+		{
+			drive->MultipleSectors = maxMultiple;
+		}
+	}
+	return true;
+}
+
+// Select the drive and send it a command for count sectors at lba. Returns false if the
+// drive never became ready for it
+static bool AtaIssueCommand(AtaDrive* drive, uint32_t lba, uint32_t count, bool lba48, uint8_t command)
+{
+	AtaChannel* channel = &_Channels[drive->Channel];
+
+	if (lba48)
+	{
+		AtaSelect(channel, drive->Slave, ATA_DRIVE_LBA);
+		if (AtaWaitNotBusy(channel) == 0xff)
+		{
+			return false;
+		}
+		// High order bytes first, then the low order ones. A count of 0 means 65536
+		HAL_OutputByteToPort(channel->Base + ATA_REG_SECCOUNT, (uint8_t)(count >> 8));
+		HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_LOW, (uint8_t)(lba >> 24));
+		HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_MID, 0);
+		HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_HIGH, 0);
+	}
+	else
+	{
+		AtaSelect(channel, drive->Slave, (uint8_t)(ATA_DRIVE_LBA | ((lba >> 24) & 0x0f)));
+		if (AtaWaitNotBusy(channel) == 0xff)
+		{
+			return false;
+		}
+	}
+	HAL_OutputByteToPort(channel->Base + ATA_REG_SECCOUNT, (uint8_t)count);
+	HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_LOW, (uint8_t)lba);
+	HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
+	HAL_OutputByteToPort(channel->Base + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 16));
+	HAL_OutputByteToPort(channel->Base + ATA_REG_COMMAND, command);
+	return true;
+}
+
+// Start a PIO read or write on the drive's channel. Sets up the transfer state before the
+// command goes out, as the IRQ can fire straight away
+static bool AtaStartPio(AtaDrive* drive, uint32_t lba, uint32_t count, uint8_t* buffer, bool writing)
+{
+	AtaChannel* channel = &_Channels[drive->Channel];
+	bool lba48 = lba + count > 0x10000000 || count > ATA_MAX_SECTORS_LBA28;
+	bool multiple = drive->MultipleSectors > 0;
+	uint8_t command;
+
+	if (lba48)
+	{
+		command = writing ? (multiple ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_SECTORS_EXT)
+						  : (multiple ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_SECTORS_EXT);
+	}
+	else
+	{
+		command = writing ? (multiple ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_WRITE_SECTORS)
+						  : (multiple ? ATA_CMD_READ_MULTIPLE : ATA_CMD_READ_SECTORS);
+	}
+
+	channel->Status = ATA_TRANSFER_BUSY;
+	channel->Writing = writing;
+	channel->Dma = false;
+	channel->Buffer = buffer;
+	channel->Remaining = count;
+	channel->BlockSectors = multiple ? drive->MultipleSectors : 1;
+
+	if (!AtaIssueCommand(drive, lba, count, lba48, command))
+	{
+		channel->Status = ATA_TRANSFER_IDLE;
+		return false;
+	}
+
+	if (writing)
+	{
+		// No IRQ for the first block of a write. The drive just asks for it
+		AtaDelay(channel);
+		if (!AtaWaitForData(channel))
+		{
+			channel->Status = ATA_TRANSFER_IDLE;
+			return false;
+		}
+		// The IRQ for this block must not see the transfer state until it has been updated
+		HAL_DisableInterrupts();
+		uint32_t sectors = channel->Remaining < channel->BlockSectors ? channel->Remaining : channel->BlockSectors;
+		HAL_OutputWordsToPort(channel->Base + ATA_REG_DATA, channel->Buffer, sectors * (ATA_BYTES_PER_SECTOR / 2));
+		channel->Buffer += sectors * ATA_BYTES_PER_SECTOR;
+		channel->Remaining -= sectors;
+		HAL_EnableInterrupts();
+	}
+	return true;
+}
+
+// Describe bytes of buffer in the channel's PRD table. Pieces that are next to each other in
+// physical memory share a PRD as long as it does not cross a 64K boundary. Returns false if part
+// of the buffer is not mapped or is not word aligned
+static bool AtaBuildPrdTable(AtaChannel* channel, uint8_t* buffer, uint32_t bytes)
+{
+	AtaPrd* prd = channel->PrdTable;
+	uint32_t entries = 0;
+	uint32_t address = 0;
+	uint32_t length = 0;
+
+	while (bytes > 0)
+	{
+		uint32_t physical = VMM_GetPhysicalAddress(buffer);
+		if (physical == 0 || (physical & 1))
+		{
+			return false;
+		}
+		// Take what is left of this page
+		uint32_t piece = ATA_PAGE_SIZE - (physical & (ATA_PAGE_SIZE - 1));
+		piece = piece > bytes ? bytes : piece;
+
+		if (length > 0 && address + length == physical && (address >> 16) == ((physical + piece - 1) >> 16))
+		{
+			length += piece;
+		}
+		else
+		{
+			if (length > 0)
+			{
+				if (entries == ATA_PRD_ENTRIES)
+				{
+					return false;
+				}
+				prd[entries].Address = address;
+				prd[entries].ByteCount = (uint16_t)length;
+				prd[entries].Flags = 0;
+				entries++;
+			}
+			address = physical;
+			length = piece;
+		}
+		buffer += piece;
+		bytes -= piece;
+	}
+	if (entries == ATA_PRD_ENTRIES)
+	{
+		return false;
+	}
+	prd[entries].Address = address;
+	prd[entries].ByteCount = (uint16_t)length;
+	prd[entries].Flags = ATA_PRD_END_OF_TABLE;
+	return true;
+}
+
+// Start a bus master DMA read or write. Returns false if the buffer cannot be described to
+// the controller (the caller then falls back to PIO) or the drive did not take the command
+static bool AtaStartDma(AtaDrive* drive, uint32_t lba, uint32_t count, uint8_t* buffer, bool writing)
+{
+	AtaChannel* channel = &_Channels[drive->Channel];
+	bool lba48 = lba + count > 0x10000000 || count > ATA_MAX_SECTORS_LBA28;
+	uint8_t command = lba48 ? (writing ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT)
+							: (writing ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+	uint8_t direction = writing ? 0 : ATA_BM_CMD_READ;
+
+	if (!AtaBuildPrdTable(channel, buffer, count * ATA_BYTES_PER_SECTOR))
+	{
+		return false;
+	}
+
+	channel->Status = ATA_TRANSFER_BUSY;
+	channel->Writing = writing;
+	channel->Dma = true;
+	channel->Buffer = buffer;
+	channel->Remaining = count;
+
+	// Stop anything left running, point the controller at the table and clear the old status
+	HAL_OutputByteToPort(channel->BusMaster + ATA_BM_COMMAND, 0);
+	HAL_OutputDwordToPort(channel->BusMaster + ATA_BM_PRDT, channel->PrdPhysical);
+	HAL_OutputByteToPort(channel->BusMaster + ATA_BM_STATUS, ATA_BM_STATUS_ERROR | ATA_BM_STATUS_INTERRUPT);
+	HAL_OutputByteToPort(channel->BusMaster + ATA_BM_COMMAND, direction);
+
+	if (!AtaIssueCommand(drive, lba, count, lba48, command))
+	{
+		channel->Status = ATA_TRANSFER_IDLE;
+		return false;
+	}
+	HAL_OutputByteToPort(channel->BusMaster + ATA_BM_COMMAND, direction | ATA_BM_CMD_START);
+	return true;
+}
+
+// Wait for the transfer on a channel to finish. Returns false if it failed, or if the
+// drive went ATA_TIMEOUT ticks without moving a block
+static bool AtaWaitForTransfer(AtaChannel* channel)
+{
+	uint32_t timeout = HAL_GetTickCount() + ATA_TIMEOUT;
+	uint32_t remaining = channel->Remaining;
+
+	// Sleep between IRQs rather than spin. Interrupts are off while the status is checked,
+	// so the IRQ that ends the transfer cannot slip in between the check and the halt
+	HAL_DisableInterrupts();
+	while (channel->Status == ATA_TRANSFER_BUSY)
+	{
+		if (channel->Remaining != remaining)
+		{
+			remaining = channel->Remaining;
+			timeout = HAL_GetTickCount() + ATA_TIMEOUT;
+		}
+		if (HAL_GetTickCount() > timeout)
+		{
+			// Leave the channel in a known state for the next command
+			HAL_EnableInterrupts();
+			if (channel->BusMaster)
+			{
+				HAL_OutputByteToPort(channel->BusMaster + ATA_BM_COMMAND, 0);
+			}
+			AtaResetChannel(channel);
+			HAL_OutputByteToPort(channel->Control + ATA_REG_CONTROL, 0);
+			channel->Status = ATA_TRANSFER_IDLE;
+			return false;
+		}
+		HAL_WaitForInterrupt();
+		HAL_DisableInterrupts();
+	}
+	HAL_EnableInterrupts();
+	bool ok = channel->Status == ATA_TRANSFER_DONE;
+	channel->Status = ATA_TRANSFER_IDLE;
+	return ok;
+}
+
+// Move the transfer on a channel along
+void AtaServiceInterrupt(int index)
+{
+	AtaChannel* channel = &_Channels[index];
+
+	if (channel->Status == ATA_TRANSFER_BUSY && channel->Dma)
+	{
+		// The controller has either finished the table or hit an error. Stop it and acknowledge
+		// both the controller and the drive
+		uint8_t bmStatus = HAL_InputByteFromPort(channel->BusMaster + ATA_BM_STATUS);
+		if (!(bmStatus & (ATA_BM_STATUS_INTERRUPT | ATA_BM_STATUS_ERROR)))
+		{
+			return;
+		}
+		HAL_OutputByteToPort(channel->BusMaster + ATA_BM_COMMAND, 0);
+		uint8_t status = AtaReadStatus(channel);
+		HAL_OutputByteToPort(channel->BusMaster + ATA_BM_STATUS, ATA_BM_STATUS_ERROR | ATA_BM_STATUS_INTERRUPT);
+		if ((bmStatus & ATA_BM_STATUS_ERROR) || (status & (ATA_SR_ERR | ATA_SR_DF)))
+		{
+			channel->Status = ATA_TRANSFER_ERROR;
+			return;
+		}
+		channel->Remaining = 0;
+		channel->Status = ATA_TRANSFER_DONE;
+		return;
+	}
+
+	// Reading the status acknowledges the IRQ
+	uint8_t status = AtaReadStatus(channel);
+	if (channel->Status != ATA_TRANSFER_BUSY)
+	{
+		return;
+	}
+	if (status & (ATA_SR_ERR | ATA_SR_DF))
+	{
+		channel->Status = ATA_TRANSFER_ERROR;
+		return;
+	}
+	if (channel->Remaining == 0)
+	{
+		// The drive has taken the last block of a write
+		channel->Status = ATA_TRANSFER_DONE;
+		return;
+	}
+	if (!(status & ATA_SR_DRQ))
+	{
+		return;
+	}
+
+	uint32_t sectors = channel->Remaining < channel->BlockSectors ? channel->Remaining : channel->BlockSectors;
+	if (channel->Writing)
+	{
+		HAL_OutputWordsToPort(channel->Base + ATA_REG_DATA, channel->Buffer, sectors * (ATA_BYTES_PER_SECTOR / 2));
+	}
+	else
+	{
+		HAL_InputWordsFromPort(channel->Base + ATA_REG_DATA, channel->Buffer, sectors * (ATA_BYTES_PER_SECTOR / 2));
+	}
+	channel->Buffer += sectors * ATA_BYTES_PER_SECTOR;
+	channel->Remaining -= sectors;
+
+	// A read is finished once the last block is in. A write waits for one more IRQ
+	if (channel->Remaining == 0 && !channel->Writing)
+	{
+		channel->Status = ATA_TRANSFER_DONE;
+	}
+}
+
+// Primary channel IRQ handler
+void I86_AtaPrimaryInterruptHandler()
+{
+	asm("pushal");
+	asm("cli");
+
+	AtaServiceInterrupt(0);
+
+	// Tell HAL we are done
+	HAL_InterruptDone(ATA_PRIMARY_IRQ);
+
+	asm("sti");
+	asm("popal");
+	asm("leave");
+	asm("iret");
+}
+
+// Secondary channel IRQ handler
+void I86_AtaSecondaryInterruptHandler()
+{
+	asm("pushal");
+	asm("cli");
+
+	AtaServiceInterrupt(1);
+
+	// Tell HAL we are done
+	HAL_InterruptDone(ATA_SECONDARY_IRQ);
+
+	asm("sti");
+	asm("popal");
+	asm("leave");
+	asm("iret");
+}
+
+// Return the drive, if there is a disk there
+static AtaDrive* AtaGetDrive(int drive)
+{
+	if (drive < 0 || drive >= ATA_MAX_DRIVES || !_Drives[drive].Present)
+	{
+		return 0;
+	}
+	return &_Drives[drive];
+}
+
+// Transfer up to count sectors with a single command
+static int AtaTransfer(int index, uint32_t lba, uint32_t count, uint8_t* buffer, bool writing)
+{
+	AtaDrive* drive = AtaGetDrive(index);
+	if (!drive || !buffer || count == 0 || lba >= drive->SectorCount)
+	{
+		return 0;
+	}
+	if (count > drive->SectorCount - lba)
+	{
+		count = drive->SectorCount - lba;
+	}
+	uint32_t maxCount = drive->Lba48 ? ATA_MAX_SECTORS_LBA48 : ATA_MAX_SECTORS_LBA28;
+	if (drive->Dma && maxCount > ATA_DMA_MAX_SECTORS)
+	{
+		maxCount = ATA_DMA_MAX_SECTORS;
+	}
+	if (count > maxCount)
+	{
+		count = maxCount;
+	}
+	if (!drive->Lba48 && lba + count > 0x10000000)
+	{
+		return 0;
+	}
+
+	// DMA if the buffer can be handed to the controller, PIO if not
+	bool started = drive->Dma && AtaStartDma(drive, lba, count, buffer, writing);
+	if (!started && _Channels[drive->Channel].Status == ATA_TRANSFER_IDLE)
+	{
+		if (count > ATA_MAX_SECTORS_LBA28 && !drive->Lba48)
+		{
+			count = ATA_MAX_SECTORS_LBA28;
+		}
+		started = AtaStartPio(drive, lba, count, buffer, writing);
+	}
+	if (!started || !AtaWaitForTransfer(&_Channels[drive->Channel]))
+	{
+		return 0;
+	}
+	return count;
+}
+
+// Read up to count sectors starting at lba into buffer
+int AtaReadSectors(int drive, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	return AtaTransfer(drive, lba, count, buffer, false);
+}
+
+// Write up to count sectors starting at lba from buffer
+int AtaWriteSectors(int drive, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+	return AtaTransfer(drive, lba, count, (uint8_t*)buffer, true);
+}
+
+// Flush the drive's write cache
+int AtaFlush(int index)
+{
+	AtaDrive* drive = AtaGetDrive(index);
+	if (!drive)
+	{
+		return -1;
+	}
+	AtaChannel* channel = &_Channels[drive->Channel];
+
+	// No data, so the IRQ just says it has finished
+	channel->Status = ATA_TRANSFER_BUSY;
+	channel->Writing = true;
+	channel->Dma = false;
+	channel->Remaining = 0;
+	AtaSelect(channel, drive->Slave, 0);
+	if (AtaWaitNotBusy(channel) == 0xff)
+	{
+		channel->Status = ATA_TRANSFER_IDLE;
+		return -1;
+	}
+	HAL_OutputByteToPort(channel->Base + ATA_REG_COMMAND, drive->Lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+	return AtaWaitForTransfer(channel) ? 0 : -1;
+}
+
+// Block device operations
+static int AtaBlockRead(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	return AtaReadSectors((int)device->Private, lba, count, buffer);
+}
+
+static int AtaBlockWrite(BlockDevice* device, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+	return AtaWriteSectors((int)device->Private, lba, count, buffer);
+}
+
+static int AtaBlockFlush(BlockDevice* device)
+{
+	return AtaFlush((int)device->Private);
+}
+
+// Find the IDE controller on the PCI bus and, if it can bus master, give each channel
+// with a DMA capable drive on it a PRD table. A channel left without one has BusMaster 0
+static void AtaSetupBusMaster()
+{
+	PciAddress address;
+
+	if (!PCI_FindClass(ATA_PCI_CLASS, ATA_PCI_SUBCLASS, 0, &address) ||
+		!(PCI_ReadConfig8(address, PCI_CONFIG_PROG_IF) & ATA_PCI_PROG_IF_BUS_MASTER))
+	{
+		return;
+	}
+	// The bus master registers are I/O space
+	uint32_t bar = PCI_GetBar(address, 4);
+	if (!(bar & 1) || (bar & ~3) == 0)
+	{
+		return;
+	}
+	PCI_EnableCommand(address, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+	for (int c = 0; c < 2; c++)
+	{
+		AtaChannel* channel = &_Channels[c];
+		if (!_Drives[c * 2].Dma && !_Drives[c * 2 + 1].Dma)
+		{
+			continue;
+		}
+		channel->PrdTable = (AtaPrd*)PMM_AllocateBlock();
+		if (!channel->PrdTable)
+		{
+			continue;
+		}
+		// The controller reads the table, so it has to be where we can find its physical address.
+		// If it cannot be mapped the channel stays on PIO
+		if (!VMM_IdentityMapRange(channel->PrdTable, ATA_PAGE_SIZE))
+		{
+			PMM_FreeBlock(channel->PrdTable);
+			channel->PrdTable = 0;
+			continue;
+		}
+		channel->PrdPhysical = VMM_GetPhysicalAddress(channel->PrdTable);
+		channel->BusMaster = (uint16_t)((bar & ~3) + c * 8);
+	}
+}
+
+// Install the driver
+void AtaInstall(int primaryVector, int secondaryVector)
+{
+	HAL_SetInterruptVector(primaryVector, I86_AtaPrimaryInterruptHandler);
+	HAL_SetInterruptVector(secondaryVector, I86_AtaSecondaryInterruptHandler);
+
+	for (int i = 0; i < ATA_MAX_DRIVES; i++)
+	{
+		AtaDrive* drive = &_Drives[i];
+		drive->Present = false;
+		drive->Dma = false;
+		drive->Channel = i / 2;
+		drive->Slave = i % 2;
+	}
+	for (int c = 0; c < 2; c++)
+	{
+		AtaChannel* channel = &_Channels[c];
+		if (!AtaResetChannel(channel))
+		{
+			continue;
+		}
+		for (int slave = 0; slave < 2; slave++)
+		{
+			AtaDrive* drive = &_Drives[c * 2 + slave];
+			drive->Present = AtaIdentify(drive);
+		}
+		// Identification is done polled. Transfers use the IRQ
+		HAL_OutputByteToPort(channel->Control + ATA_REG_CONTROL, 0);
+	}
+
+	// Use DMA wherever both the drive and the controller can
+	AtaSetupBusMaster();
+	for (int i = 0; i < ATA_MAX_DRIVES; i++)
+	{
+		_Drives[i].Dma = _Drives[i].Present && _Drives[i].Dma && _Channels[_Drives[i].Channel].BusMaster != 0;
+	}
+
+	for (int i = 0; i < ATA_MAX_DRIVES; i++)
+	{
+		AtaDrive* drive = &_Drives[i];
+		if (!drive->Present)
+		{
+			continue;
+		}
+		drive->Name[0] = 'h';
+		drive->Name[1] = 'd';
+		drive->Name[2] = (char)('0' + i);
+		drive->Name[3] = 0;
+		drive->Device.Name = drive->Name;
+		drive->Device.SectorSize = ATA_BYTES_PER_SECTOR;
+		drive->Device.SectorCount = drive->SectorCount;
+		drive->Device.QueueDepth = 1;
+		drive->Device.Read = AtaBlockRead;
+		drive->Device.Write = AtaBlockWrite;
+		drive->Device.Flush = AtaBlockFlush;
+		drive->Device.Submit = 0;
+		drive->Device.Poll = 0;
+		drive->Device.MediaGeneration = 0;
+		drive->Device.Revalidate = 0;
+		drive->Device.Private = (void*)i;
+		BlockDevice_Register(&drive->Device);
+	}
+}
+
+// Return the block device for drive
+BlockDevice* AtaGetBlockDevice(int drive)
+{
+	AtaDrive* ataDrive = AtaGetDrive(drive);
+	return ataDrive ? &ataDrive->Device : 0;
+}
+
+// Return the model name reported by drive
+const char* AtaGetModel(int drive)
+{
+	AtaDrive* ataDrive = AtaGetDrive(drive);
+	return ataDrive ? ataDrive->Model : 0;
+}
@@ -0,0 +1,200 @@
+#include <bench.h>
+#include <hal.h>
+#include <string.h>
+#include "physicalmemorymanager.h"
+#include "virtualmemorymanager.h"
+
+// Block device microbenchmark
+//
+// Keeps a number of reads in flight with BlockDevice_Submit and counts how many finish
+// in a given time. The requests are resubmitted from here rather than from their
+// completion routines so the loop looks the same for queued and synchronous devices.
+// Polled devices are polled while we wait, everything else is waited for with hlt.
+
+// Ticks to wait for outstanding requests at the end of a run
+#define BENCH_DRAIN_TIMEOUT		300
+
+#define BENCH_BLOCK_SIZE		4096
+
+static BlockRequest _Requests[BENCH_MAX_DEPTH];
+
+// Requests that have been submitted and not yet counted
+static bool _Busy[BENCH_MAX_DEPTH];
+
+// Random number state
+static uint32_t _Seed = 1;
+
+// Block the next sequential read starts at
+static uint32_t _NextBlock;
+
+// Read blocks one after another rather than at random
+static bool _Sequential;
+
+static uint32_t Bench_Random()
+{
+	_Seed = _Seed * 1103515245 + 12345;
+	return _Seed >> 8;
+}
+
+// Start request on the next block
+static bool Bench_Submit(BlockDevice* device, BlockRequest* request, uint32_t blocks)
+{
+	uint32_t block = Bench_Random() % blocks;
+	if (_Sequential)
+	{
+		block = _NextBlock;
+		_NextBlock = (_NextBlock + 1) % blocks;
+	}
+	request->LBA = block * request->Count;
+	request->Status = BLOCK_REQUEST_PENDING;
+	return BlockDevice_Submit(device, request) == 0;
+}
+
+// Return the index of a finished request, or -1 if they are all in flight
+static int Bench_FindFinished(uint32_t depth)
+{
+	for (uint32_t i = 0; i < depth; i++)
+	{
+		if (_Busy[i] && _Requests[i].Status != BLOCK_REQUEST_PENDING)
+		{
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// Give the device a chance to finish something. Called with interrupts disabled
+static void Bench_Wait(BlockDevice* device)
+{
+	if (device->Poll)
+	{
+		HAL_EnableInterrupts();
+		BlockDevice_Poll(device);
+		HAL_DisableInterrupts();
+	}
+	else
+	{
+		// The timer wakes us up if the device does not
+		HAL_WaitForInterrupt();
+		HAL_DisableInterrupts();
+	}
+}
+
+// Wait until a request finishes or the tick count passes until. Returns the request or -1
+static int Bench_WaitForAny(BlockDevice* device, uint32_t depth, uint32_t until)
+{
+	HAL_DisableInterrupts();
+	int finished = Bench_FindFinished(depth);
+	while (finished < 0 && HAL_GetTickCount() < until)
+	{
+		Bench_Wait(device);
+		finished = Bench_FindFinished(depth);
+	}
+	HAL_EnableInterrupts();
+	return finished;
+}
+
+int Bench_Run(BlockDevice* device, uint32_t depth, uint32_t ioSize, bool sequential, uint32_t ticks, BenchResult* result)
+{
+	if (ioSize == 0 || ioSize > BENCH_MAX_IO_SIZE || ioSize % device->SectorSize != 0)
+	{
+		return -1;
+	}
+	uint32_t sectors = ioSize / device->SectorSize;
+	if (device->SectorCount < sectors)
+	{
+		return -1;
+	}
+	_Sequential = sequential;
+	_NextBlock = 0;
+	uint32_t blocks = device->SectorCount / sectors;
+
+	// Devices without a queue finish each request inside BlockDevice_Submit, more than one is pointless
+	uint32_t queue = device->Submit ? device->QueueDepth : 1;
+	depth = depth > queue ? queue : depth;
+	depth = depth > BENCH_MAX_DEPTH ? BENCH_MAX_DEPTH : depth;
+	depth = depth == 0 ? 1 : depth;
+
+	uint32_t bufferBlocks = (depth * ioSize + BENCH_BLOCK_SIZE - 1) / BENCH_BLOCK_SIZE;
+	uint8_t* buffers = (uint8_t*)PMM_AllocateBlocks(bufferBlocks);
+	if (!buffers)
+	{
+		return -1;
+	}
+	// The drivers DMA into the buffers, so they must be reachable at their physical address
+	if (!VMM_IdentityMapRange(buffers, bufferBlocks * BENCH_BLOCK_SIZE))
+	{
+		PMM_FreeBlocks(buffers, bufferBlocks);
+		return -1;
+	}
+	memset(result, 0, sizeof(BenchResult));
+	result->Depth = depth;
+
+	uint32_t start = HAL_GetTickCount();
+	uint32_t end = start + ticks;
+	uint32_t inFlight = 0;
+	for (uint32_t i = 0; i < depth; i++)
+	{
+		_Requests[i].Count = sectors;
+		_Requests[i].Buffer = buffers + i * ioSize;
+		_Requests[i].Write = false;
+		_Requests[i].Completion = 0;
+		_Requests[i].Context = 0;
+		_Busy[i] = Bench_Submit(device, &_Requests[i], blocks);
+		if (_Busy[i])
+		{
+			inFlight++;
+		}
+		else
+		{
+			result->Errors++;
+		}
+	}
+
+	// Keep the queue full until the time is up
+	while (inFlight > 0 && HAL_GetTickCount() < end)
+	{
+		int finished = Bench_WaitForAny(device, depth, end);
+		if (finished < 0)
+		{
+			break;
+		}
+		BlockRequest* request = &_Requests[finished];
+		if (request->Status == BLOCK_REQUEST_DONE)
+		{
+			result->Ios++;
+			result->Bytes += ioSize;
+		}
+		else
+		{
+			result->Errors++;
+		}
+		if (!Bench_Submit(device, request, blocks))
+		{
+			_Busy[finished] = false;
+			inFlight--;
+		}
+	}
+	result->Ticks = HAL_GetTickCount() - start;
+
+	// Let whatever is still in flight finish before the buffers go back
+	uint32_t drainEnd = HAL_GetTickCount() + BENCH_DRAIN_TIMEOUT;
+	bool drained = true;
+	for (uint32_t i = 0; i < depth; i++)
+	{
+		HAL_DisableInterrupts();
+		while (_Busy[i] && _Requests[i].Status == BLOCK_REQUEST_PENDING && HAL_GetTickCount() < drainEnd)
+		{
+			Bench_Wait(device);
+		}
+		drained = drained && !(_Busy[i] && _Requests[i].Status == BLOCK_REQUEST_PENDING);
+		_Busy[i] = false;
+		HAL_EnableInterrupts();
+	}
+	if (drained)
+	{
+		PMM_FreeBlocks(buffers, bufferBlocks);
+	}
+	// Otherwise the device may still write into them, so they are left allocated
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include <blockdevice.h>
+#include <string.h>
+
+// Registered devices, in the order they were registered
+static BlockDevice* _Devices[BLOCKDEVICE_MAX];
+static int _DeviceCount = 0;
+
+// Add a device to the list of devices
+bool BlockDevice_Register(BlockDevice* device)
+{
+	if (!device || !device->Name || !device->Read || _DeviceCount >= BLOCKDEVICE_MAX ||
+		BlockDevice_Find(device->Name))
+	{
+		return false;
+	}
+	_Devices[_DeviceCount++] = device;
+	return true;
+}
+
+// Return the number of registered devices
+int BlockDevice_GetCount()
+{
+	return _DeviceCount;
+}
+
+// Return registered device index
+BlockDevice* BlockDevice_Get(int index)
+{
+	if (index < 0 || index >= _DeviceCount)
+	{
+		return 0;
+	}
+	return _Devices[index];
+}
+
+// Find a registered device by name
+BlockDevice* BlockDevice_Find(const char* name)
+{
+	if (!name)
+	{
+		return 0;
+	}
+	for (int i = 0; i < _DeviceCount; i++)
+	{
+		if (strcasecmp(_Devices[i]->Name, name) == 0)
+		{
+			return _Devices[i];
+		}
+	}
+	return 0;
+}
+
+// Read count sectors starting at lba. Drivers may transfer less than was asked for, so keep
+// going until everything has been read
+int BlockDevice_Read(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	if (!device || lba >= device->SectorCount || count > device->SectorCount - lba)
+	{
+		return -1;
+	}
+	while (count > 0)
+	{
+		int read = device->Read(device, lba, count, buffer);
+		if (read <= 0)
+		{
+			return -1;
+		}
+		lba += read;
+		count -= read;
+		buffer += read * device->SectorSize;
+	}
+	return 0;
+}
+
+// Write count sectors starting at lba
+int BlockDevice_Write(BlockDevice* device, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+	if (!device || !device->Write || lba >= device->SectorCount || count > device->SectorCount - lba)
+	{
+		return -1;
+	}
+	while (count > 0)
+	{
+		int written = device->Write(device, lba, count, buffer);
+		if (written <= 0)
+		{
+			return -1;
+		}
+		lba += written;
+		count -= written;
+		buffer += written * device->SectorSize;
+	}
+	return 0;
+}
+
+// Flush any writes the device is holding
+int BlockDevice_Flush(BlockDevice* device)
+{
+	if (!device)
+	{
+		return -1;
+	}
+	if (!device->Flush)
+	{
+		return 0;
+	}
+	return device->Flush(device);
+}
+
+// Start an asynchronous transfer
+int BlockDevice_Submit(BlockDevice* device, BlockRequest* request)
+{
+	if (!device || !request || !request->Buffer || request->Count == 0 ||
+		request->LBA >= device->SectorCount || request->Count > device->SectorCount - request->LBA)
+	{
+		return -1;
+	}
+	if (device->Submit)
+	{
+		request->Status = BLOCK_REQUEST_PENDING;
+		return device->Submit(device, request);
+	}
+	int result = request->Write ? BlockDevice_Write(device, request->LBA, request->Count, request->Buffer)
+								: BlockDevice_Read(device, request->LBA, request->Count, request->Buffer);
+	request->Status = result == 0 ? BLOCK_REQUEST_DONE : BLOCK_REQUEST_ERROR;
+	if (request->Completion)
+	{
+		request->Completion(request);
+	}
+	return 0;
+}
+
+// Complete finished requests on a polled device
+int BlockDevice_Poll(BlockDevice* device)
+{
+	if (!device || !device->Poll)
+	{
+		return 0;
+	}
+	return device->Poll(device);
+}
+
+// Return the media generation
+uint32_t BlockDevice_GetMediaGeneration(BlockDevice* device)
+{
+	if (!device || !device->MediaGeneration)
+	{
+		return 0;
+	}
+	return device->MediaGeneration(device);
+}
+
+// Get the device ready to be mounted
+int BlockDevice_Revalidate(BlockDevice* device)
+{
+	if (!device)
+	{
+		return -1;
+	}
+	if (!device->Revalidate)
+	{
+		return 0;
+	}
+	return device->Revalidate(device);
+}
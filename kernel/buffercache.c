@@ -0,0 +1,252 @@
+#include <buffercache.h>
+#include <string.h>
+#include "physicalmemorymanager.h"
+#include "virtualmemorymanager.h"
+
+// A cached sector. Entries are on a hash chain while they hold a sector, and always on the
+// LRU list, most recently used first. Unused entries have a null Device and sit at the back
+typedef struct _BufferCacheEntry
+{
+	BlockDevice*				Device;
+	uint32_t					LBA;
+	uint32_t					Generation;		// Media generation of the device when it was read
+	uint8_t*					Data;
+	struct _BufferCacheEntry*	HashNext;
+	struct _BufferCacheEntry*	Newer;
+	struct _BufferCacheEntry*	Older;
+} BufferCacheEntry;
+
+static BufferCacheEntry* _Entries = 0;
+static uint32_t _EntryCount = 0;
+
+// Hash table. The number of buckets is a power of two
+static BufferCacheEntry** _Buckets = 0;
+static uint32_t _BucketMask = 0;
+
+// Ends of the LRU list
+static BufferCacheEntry* _Newest = 0;
+static BufferCacheEntry* _Oldest = 0;
+
+static BufferCacheStats _Stats;
+
+// Return the hash chain for a sector
+static BufferCacheEntry** BufferCache_Bucket(BlockDevice* device, uint32_t lba)
+{
+	return &_Buckets[(lba ^ ((uint32_t)device >> 4)) & _BucketMask];
+}
+
+// Take an entry off the LRU list
+static void BufferCache_Unlink(BufferCacheEntry* entry)
+{
+	if (entry->Newer)
+	{
+		entry->Newer->Older = entry->Older;
+	}
+	else
+	{
+		_Newest = entry->Older;
+	}
+	if (entry->Older)
+	{
+		entry->Older->Newer = entry->Newer;
+	}
+	else
+	{
+		_Oldest = entry->Newer;
+	}
+}
+
+// Put an entry at the front (most recently used end) of the LRU list
+static void BufferCache_PushNewest(BufferCacheEntry* entry)
+{
+	entry->Newer = 0;
+	entry->Older = _Newest;
+	if (_Newest)
+	{
+		_Newest->Newer = entry;
+	}
+	else
+	{
+		_Oldest = entry;
+	}
+	_Newest = entry;
+}
+
+// Put an entry at the back of the LRU list, so it is the next to be reused
+static void BufferCache_PushOldest(BufferCacheEntry* entry)
+{
+	entry->Older = 0;
+	entry->Newer = _Oldest;
+	if (_Oldest)
+	{
+		_Oldest->Older = entry;
+	}
+	else
+	{
+		_Newest = entry;
+	}
+	_Oldest = entry;
+}
+
+// Take an entry off its hash chain and mark it unused
+static void BufferCache_Forget(BufferCacheEntry* entry)
+{
+	BufferCacheEntry** link = BufferCache_Bucket(entry->Device, entry->LBA);
+	while (*link != entry)
+	{
+		link = &(*link)->HashNext;
+	}
+	*link = entry->HashNext;
+	entry->HashNext = 0;
+	entry->Device = 0;
+}
+
+// Find a sector. Anything read under an older media generation is dropped on the way
+static BufferCacheEntry* BufferCache_Find(BlockDevice* device, uint32_t lba, uint32_t generation)
+{
+	for (BufferCacheEntry* entry = *BufferCache_Bucket(device, lba); entry; entry = entry->HashNext)
+	{
+		if (entry->Device == device && entry->LBA == lba)
+		{
+			if (entry->Generation == generation)
+			{
+				return entry;
+			}
+			BufferCache_Forget(entry);
+			BufferCache_Unlink(entry);
+			BufferCache_PushOldest(entry);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// Copy a sector that has just been read into the cache, reusing the least recently used entry
+static void BufferCache_Insert(BlockDevice* device, uint32_t lba, uint32_t generation, const uint8_t* data)
+{
+	BufferCacheEntry* entry = _Oldest;
+	if (entry->Device)
+	{
+		_Stats.Evictions++;
+		BufferCache_Forget(entry);
+	}
+	BufferCache_Unlink(entry);
+
+	entry->Device = device;
+	entry->LBA = lba;
+	entry->Generation = generation;
+	memcpy(entry->Data, data, BUFFERCACHE_SECTOR_SIZE);
+	BufferCacheEntry** bucket = BufferCache_Bucket(device, lba);
+	entry->HashNext = *bucket;
+	*bucket = entry;
+	BufferCache_PushNewest(entry);
+}
+
+// Carve the cache out of physical memory. The sector buffers come first, so they stay
+// block aligned, then the entries, then the hash table
+bool BufferCache_Initialise(uint32_t sectors)
+{
+	if (_Entries || sectors == 0)
+	{
+		return false;
+	}
+	uint32_t buckets = 1;
+	while (buckets < sectors)
+	{
+		buckets <<= 1;
+	}
+	uint32_t size = sectors * BUFFERCACHE_SECTOR_SIZE + sectors * sizeof(BufferCacheEntry) +
+					buckets * sizeof(BufferCacheEntry*);
+	uint32_t blocks = (size + PMM_GetBlockSize() - 1) / PMM_GetBlockSize();
+	uint8_t* memory = (uint8_t*)PMM_AllocateBlocks(blocks);
+	if (!memory)
+	{
+		return false;
+	}
+	if (!VMM_IdentityMapRange(memory, blocks * PMM_GetBlockSize()))
+	{
+		PMM_FreeBlocks(memory, blocks);
+		return false;
+	}
+
+	_Entries = (BufferCacheEntry*)(memory + sectors * BUFFERCACHE_SECTOR_SIZE);
+	_Buckets = (BufferCacheEntry**)(_Entries + sectors);
+	_BucketMask = buckets - 1;
+	memset(_Buckets, 0, buckets * sizeof(BufferCacheEntry*));
+	for (uint32_t i = 0; i < sectors; i++)
+	{
+		_Entries[i].Device = 0;
+		_Entries[i].Data = memory + i * BUFFERCACHE_SECTOR_SIZE;
+		_Entries[i].HashNext = 0;
+		BufferCache_PushOldest(&_Entries[i]);
+	}
+	_EntryCount = sectors;
+	memset(&_Stats, 0, sizeof(_Stats));
+	_Stats.Buffers = sectors;
+	return true;
+}
+
+// Read through the cache. Runs of sectors that are not cached are read from the device with a
+// single BlockDevice_Read, straight into the caller's buffer, and copied into the cache from there.
+// The generation comes from the caller, so a cached read does not go near the device
+int BufferCache_Read(BlockDevice* device, uint32_t generation, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	if (!device || lba >= device->SectorCount || count > device->SectorCount - lba)
+	{
+		return -1;
+	}
+	if (_EntryCount == 0 || device->SectorSize != BUFFERCACHE_SECTOR_SIZE)
+	{
+		return BlockDevice_Read(device, lba, count, buffer);
+	}
+
+	while (count > 0)
+	{
+		BufferCacheEntry* entry = BufferCache_Find(device, lba, generation);
+		if (entry)
+		{
+			memcpy(buffer, entry->Data, BUFFERCACHE_SECTOR_SIZE);
+			BufferCache_Unlink(entry);
+			BufferCache_PushNewest(entry);
+			_Stats.Hits++;
+			lba++;
+			count--;
+			buffer += BUFFERCACHE_SECTOR_SIZE;
+			continue;
+		}
+
+		// Read up to the next sector we already have
+		uint32_t run = 1;
+		while (run < count && !BufferCache_Find(device, lba + run, generation))
+		{
+			run++;
+		}
+		if (BlockDevice_Read(device, lba, run, buffer) != 0)
+		{
+			return -1;
+		}
+		_Stats.Misses += run;
+		for (uint32_t i = 0; i < run; i++)
+		{
+			BufferCache_Insert(device, lba + i, generation, buffer + i * BUFFERCACHE_SECTOR_SIZE);
+		}
+		lba += run;
+		count -= run;
+		buffer += run * BUFFERCACHE_SECTOR_SIZE;
+	}
+	return 0;
+}
+
+// Return the cache counters
+void BufferCache_GetStats(BufferCacheStats* stats)
+{
+	*stats = _Stats;
+}
+
+// Set the counters back to zero
+void BufferCache_ResetStats()
+{
+	_Stats.Hits = 0;
+	_Stats.Misses = 0;
+	_Stats.Evictions = 0;
+}
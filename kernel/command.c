@@ -5,6 +5,12 @@
 #include <console.h>
 #include <floppydisk.h>
 #include <disk_command.h>
+#include <blockdevice.h>
+#include <ramdisk.h>
+#include <filesystem.h>
+#include <bench.h>
+#include <pci.h>
+#include <buffercache.h>
 
 char _prompt[25];
 char _buffer[2048];
@@ -21,6 +27,20 @@ void Command_Prompt(char* cmd);
 void Command_ProcessCommand(char* cmd);
 // Process Disk Command
 void Command_Disk(size_t, char type);
+// Show the floppy driver counters
+void Command_FloppyStats(bool reset);
+// Show the buffer cache counters
+void Command_CacheStats(bool reset);
+// List the block devices
+void Command_Devices();
+// Mount a block device
+void Command_Mount(const char* name);
+// Copy a block device into a RAM disk
+void Command_RamDisk(const char* name);
+// Measure random and sequential read performance of a block device
+void Command_Bench(const char* name);
+// List the PCI functions
+void Command_ListPci();
 
 
 // Run the command
@@ -169,6 +189,300 @@ void Command_Disk(size_t sector, char type)
     }
 }
 
+// Write one line of the fdstat output
+// @param name the counter
+// @param value its value
+static void Command_WriteStat(const char* name, uint32_t value)
+{
+    ConsoleWriteCharacter('\n');
+    ConsoleWriteString(name);
+    ConsoleWriteInt(value, 10);
+}
+
+// Show the floppy driver counters
+// @param reset set the counters back to zero after showing them
+void Command_FloppyStats(bool reset)
+{
+    FloppyDriveStats stats;
+    FloppyDriveGetStats(&stats);
+
+    Command_WriteStat("Resets:          ", stats.Resets);
+    Command_WriteStat("Calibrations:    ", stats.Calibrations);
+    Command_WriteStat("Seeks:           ", stats.Seeks);
+    Command_WriteStat("Cylinders moved: ", stats.SeekDistance);
+    Command_WriteStat("Motor spin ups:  ", stats.SpinUps);
+    Command_WriteStat("Commands:        ", stats.Commands);
+    Command_WriteStat("Sectors read:    ", stats.Sectors);
+    Command_WriteStat("Buffer hits:     ", stats.BufferHits);
+    Command_WriteStat("Merged requests: ", stats.Merged);
+    Command_WriteStat("Starved requests:", stats.Starved);
+    Command_WriteStat("Media changes:   ", stats.MediaChanges);
+    Command_WriteStat("Retries:         ", stats.Retries);
+    Command_WriteStat("Errors:          ", stats.Errors);
+    Command_WriteStat("IRQ wait ticks:  ", stats.WaitTicks);
+    Command_WriteStat("Sleep ticks:     ", stats.SleepTicks);
+
+    if (reset)
+    {
+        FloppyDriveResetStats();
+        ConsoleWriteString("\nCounters reset");
+    }
+}
+
+// Show the buffer cache counters
+// @param reset set the counters back to zero after showing them
+void Command_CacheStats(bool reset)
+{
+    BufferCacheStats stats;
+    BufferCache_GetStats(&stats);
+
+    Command_WriteStat("Buffers:         ", stats.Buffers);
+    Command_WriteStat("Hits:            ", stats.Hits);
+    Command_WriteStat("Misses:          ", stats.Misses);
+    Command_WriteStat("Evictions:       ", stats.Evictions);
+
+    if (reset)
+    {
+        BufferCache_ResetStats();
+        ConsoleWriteString("\nCounters reset");
+    }
+}
+
+// List the block devices
+void Command_Devices()
+{
+    for (int i = 0; i < BlockDevice_GetCount(); i++)
+    {
+        BlockDevice* device = BlockDevice_Get(i);
+        ConsoleWriteCharacter('\n');
+        ConsoleWriteString(device->Name);
+        ConsoleWriteString("  sectors: ");
+        ConsoleWriteInt(device->SectorCount, 10);
+        ConsoleWriteString("  sector size: ");
+        ConsoleWriteInt(device->SectorSize, 10);
+        ConsoleWriteString("  queue depth: ");
+        ConsoleWriteInt(device->QueueDepth, 10);
+        if (!device->Write)
+        {
+            ConsoleWriteString("  read only");
+        }
+    }
+}
+
+// Mount a block device
+// @param name the device to mount
+void Command_Mount(const char* name)
+{
+    BlockDevice* device = BlockDevice_Find(name);
+    if (device == NULL)
+    {
+        ConsoleWriteString("\nNo such device");
+        return;
+    }
+    if (!FsFat12_Initialise(device))
+    {
+        ConsoleWriteString("\nUnable to mount ");
+        ConsoleWriteString(name);
+        return;
+    }
+    // Start again from the root of the new device
+    DiskCommand_Init();
+    ConsoleWriteString("\nMounted ");
+    ConsoleWriteString(name);
+}
+
+// Copy a block device into a RAM disk
+// @param name the device to copy
+void Command_RamDisk(const char* name)
+{
+    static const char* ramDiskNames[RAMDISK_MAX] = { "rd0", "rd1" };
+
+    BlockDevice* source = BlockDevice_Find(name);
+    if (source == NULL)
+    {
+        ConsoleWriteString("\nNo such device");
+        return;
+    }
+    // Copy a floppy a cylinder at a time, anything else in the default chunks
+    uint32_t chunkSectors = 0;
+    if (source == FloppyDriveGetBlockDevice())
+    {
+        FloppyGeometry geometry;
+        FloppyDriveGetGeometry(&geometry);
+        chunkSectors = (uint32_t)(geometry.Heads * geometry.SectorsPerTrack);
+    }
+    for (int i = 0; i < RAMDISK_MAX; i++)
+    {
+        if (BlockDevice_Find(ramDiskNames[i]) == NULL)
+        {
+            BlockDevice* device = RamDisk_CreateFrom(ramDiskNames[i], source, chunkSectors);
+            if (device == NULL)
+            {
+                ConsoleWriteString("\nUnable to create RAM disk");
+                return;
+            }
+            ConsoleWriteString("\nCopied ");
+            ConsoleWriteString(name);
+            ConsoleWriteString(" to ");
+            ConsoleWriteString(device->Name);
+            return;
+        }
+    }
+    ConsoleWriteString("\nNo RAM disks left");
+}
+
+// Show the IOPS and throughput of a benchmark run
+// @param depth the queue depth that was asked for
+// @param result what the run measured
+static void Command_WriteBenchResult(uint32_t depth, BenchResult* result)
+{
+    uint32_t ticks = result->Ticks == 0 ? 1 : result->Ticks;
+    uint32_t kbPerSecond = (result->Bytes / 1024) * 100 / ticks;
+    ConsoleWriteString("QD ");
+    ConsoleWriteInt(depth, 10);
+    if (result->Depth != depth)
+    {
+        ConsoleWriteString(" (ran at ");
+        ConsoleWriteInt(result->Depth, 10);
+        ConsoleWriteString(")");
+    }
+    ConsoleWriteString(": ");
+    ConsoleWriteInt(result->Ios * 100 / ticks, 10);
+    ConsoleWriteString(" IOPS, ");
+    ConsoleWriteInt(kbPerSecond / 1024, 10);
+    ConsoleWriteCharacter('.');
+    ConsoleWriteInt((kbPerSecond % 1024) * 10 / 1024, 10);
+    ConsoleWriteString(" MB/s");
+    if (result->Errors > 0)
+    {
+        ConsoleWriteString(", errors: ");
+        ConsoleWriteInt(result->Errors, 10);
+    }
+}
+
+// Measure random 4K reads from a block device at queue depths 1, 4 and 32,
+// then sequential 64K reads
+// @param name the device to read from
+void Command_Bench(const char* name)
+{
+    static const uint32_t depths[] = { 1, 4, 32 };
+    BenchResult result;
+
+    BlockDevice* device = BlockDevice_Find(name);
+    if (device == NULL)
+    {
+        ConsoleWriteString("\nNo such device");
+        return;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        // Two seconds at each depth, the PIT runs at 100Hz
+        if (Bench_Run(device, depths[i], BENCH_IO_SIZE, false, 200, &result) != 0)
+        {
+            ConsoleWriteString("\nUnable to run the benchmark");
+            return;
+        }
+        ConsoleWriteString("\nRandom 4K, ");
+        Command_WriteBenchResult(depths[i], &result);
+    }
+    if (Bench_Run(device, 8, BENCH_MAX_IO_SIZE, true, 200, &result) != 0)
+    {
+        ConsoleWriteString("\nUnable to run the sequential benchmark");
+        return;
+    }
+    ConsoleWriteString("\nSequential 64K, ");
+    Command_WriteBenchResult(8, &result);
+}
+
+// Write value in hex, padded with zeros to digits digits
+// @param value the value to write
+// @param digits the least number of digits to write
+static void Command_WriteHex(uint32_t value, int digits)
+{
+    static const char hex[] = "0123456789abcdef";
+    char text[9];
+
+    int length = 0;
+    do
+    {
+        text[length++] = hex[value & 0xf];
+        value >>= 4;
+    } while (value != 0 || length < digits);
+    while (length > 0)
+    {
+        ConsoleWriteCharacter(text[--length]);
+    }
+}
+
+// List the PCI functions found at boot, with their BARs and interrupts
+void Command_ListPci()
+{
+    for (int i = 0; i < PCI_GetDeviceCount(); i++)
+    {
+        PciDevice* device = PCI_GetDevice(i);
+        ConsoleWriteCharacter('\n');
+        Command_WriteHex(device->Address.Bus, 2);
+        ConsoleWriteCharacter(':');
+        Command_WriteHex(device->Address.Device, 2);
+        ConsoleWriteCharacter('.');
+        Command_WriteHex(device->Address.Function, 1);
+        ConsoleWriteCharacter(' ');
+        Command_WriteHex(device->Vendor, 4);
+        ConsoleWriteCharacter(':');
+        Command_WriteHex(device->Device, 4);
+        ConsoleWriteCharacter(' ');
+        ConsoleWriteString(PCI_GetClassName(device->Class, device->Subclass));
+        if (device->MsiVector >= 0)
+        {
+            ConsoleWriteString("  MSI vector ");
+            ConsoleWriteInt(device->MsiVector, 10);
+        }
+        else if (device->InterruptLine <= 15)
+        {
+            ConsoleWriteString("  IRQ ");
+            ConsoleWriteInt(device->InterruptLine, 10);
+            if (device->MsiCapability)
+            {
+                ConsoleWriteString(", MSI capable");
+            }
+        }
+        for (int n = 0; n < PCI_BAR_COUNT; n++)
+        {
+            PciBar* bar = &device->Bars[n];
+            if (bar->Size == 0)
+            {
+                continue;
+            }
+            ConsoleWriteString("\n    BAR");
+            ConsoleWriteInt(n, 10);
+            ConsoleWriteString((bar->Flags & PCI_BAR_IO) ? " I/O " : " memory ");
+            Command_WriteHex(bar->Base, (bar->Flags & PCI_BAR_IO) ? 4 : 8);
+            ConsoleWriteString(" size ");
+            if (bar->Size >= 1024)
+            {
+                ConsoleWriteInt(bar->Size / 1024, 10);
+                ConsoleWriteCharacter('K');
+            }
+            else
+            {
+                ConsoleWriteInt(bar->Size, 10);
+            }
+            if (bar->Flags & PCI_BAR_64BIT)
+            {
+                ConsoleWriteString(" 64-bit");
+            }
+            if (bar->Flags & PCI_BAR_PREFETCHABLE)
+            {
+                ConsoleWriteString(" prefetchable");
+            }
+            if (bar->Flags & PCI_BAR_HIGH)
+            {
+                ConsoleWriteString(" (above 4G)");
+            }
+        }
+    }
+}
+
 // Process the command
 void Command_ProcessCommand(char* cmd)
 {
@@ -225,6 +539,42 @@ void Command_ProcessCommand(char* cmd)
     {
         DiskCommand_ReadFile(cmd + 5);
     }
+    else if (strcasecmp("fdstat", cmd) == 0)
+    {
+        Command_FloppyStats(false);
+    }
+    else if (strcasecmp("fdstat /r", cmd) == 0)
+    {
+        Command_FloppyStats(true);
+    }
+    else if (strcasecmp("cachestat", cmd) == 0)
+    {
+        Command_CacheStats(false);
+    }
+    else if (strcasecmp("cachestat /r", cmd) == 0)
+    {
+        Command_CacheStats(true);
+    }
+    else if (strcasecmp("devices", cmd) == 0)
+    {
+        Command_Devices();
+    }
+    else if (strcasecmp("lspci", cmd) == 0)
+    {
+        Command_ListPci();
+    }
+    else if (strncasecmp("mount ", cmd, 6) == 0)
+    {
+        Command_Mount(cmd + 6);
+    }
+    else if (strncasecmp("ramdisk ", cmd, 8) == 0)
+    {
+        Command_RamDisk(cmd + 8);
+    }
+    else if (strncasecmp("bench ", cmd, 6) == 0)
+    {
+        Command_Bench(cmd + 6);
+    }
     else 
     {
         ConsoleWriteString("\nCommand Not Recognized"); 
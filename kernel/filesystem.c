@@ -1,19 +1,90 @@
 #include <filesystem.h>
 #include <bpb.h>
-#include <floppydisk.h>
+#include <blockdevice.h>
+#include <buffercache.h>
 #include <stdint.h>
 #include <size_t.h>
 #include <_null.h>
 #include <string.h>
+#include <ctype.h>
+
+// The mounted device
+static BlockDevice* _device = NULL;
+
+// The device we were last asked to mount, and its media generation when the tables below were read
+static BlockDevice* _mediaDevice = NULL;
+static uint32_t _mediaGeneration = 0;
+
+// Sector buffer for reads that do not fill a whole sector
+static uint8_t _sectorBuffer[BYTES_PER_SECTOR];
 
 // Store the offsets
 static uint32_t offsetFat;
 static uint32_t offsetRoot;
 static uint32_t offsetData;
 static uint32_t rootSize; 
+static uint32_t sectorsPerCluster;
+static uint32_t clusterSize;
 
-// Store info into the FAT Table.
-static uint8_t FAT_Table[9 * SECTORS_PER_FAT_SECTOR];
+// Largest FAT we can hold, in sectors
+#define MAX_FAT_SECTORS 9
+
+// The FAT, unpacked at mount time so the cluster after n is just _nextCluster[n]
+static uint16_t _nextCluster[MAX_FAT_SECTORS * BYTES_PER_SECTOR * 2 / 3];
+static uint32_t _clusterCount;
+
+// A run of clusters that follow on from each other on the disk. FileCluster is the
+// index within the file of the first one
+typedef struct _Extent
+{
+    uint16_t FileCluster;
+    uint16_t Start;
+    uint16_t Length;
+} Extent;
+
+// Extents of a file, worked out the first time it is opened. Files with more than
+// EXTENTS_PER_FILE extents only have the first EXTENTS_PER_FILE, and the chain is
+// followed from the end of the last one
+#define EXTENT_LISTS 8
+#define EXTENTS_PER_FILE 32
+
+typedef struct _ExtentList
+{
+    uint32_t FirstCluster;      // 0 if the list is free
+    uint32_t Count;
+    uint32_t LastUsed;
+    Extent   Extents[EXTENTS_PER_FILE];
+} ExtentList;
+
+static ExtentList _extentLists[EXTENT_LISTS];
+static uint32_t _extentClock = 0;
+
+// Names looked up in directories, so opening a path does not read and search every directory
+// along it each time. Names that were not found are kept too (with FS_INVALID flags). Names
+// longer than DENTRY_NAME_LENGTH are not kept
+#define DENTRY_ENTRIES 128
+#define DENTRY_BUCKETS 64
+#define DENTRY_NAME_LENGTH 64
+
+typedef struct _Dentry
+{
+    uint32_t        Parent;         // Cluster of the directory the name is in, 0 for the root
+    uint32_t        Hash;           // Hash of Parent and the case-folded name, 0 if the entry is free
+    uint32_t        FirstCluster;
+    uint32_t        FileLength;
+    uint32_t        Flags;
+    uint32_t        LastUsed;
+    struct _Dentry* HashNext;
+    char            Name[DENTRY_NAME_LENGTH];   // As it is on the disk, or as asked for if not found
+} Dentry;
+
+static Dentry _dentries[DENTRY_ENTRIES];
+static Dentry* _dentryBuckets[DENTRY_BUCKETS];
+static uint32_t _dentryClock = 0;
+
+// Set when a directory sector cannot be read, so a name that was not found is not
+// remembered as missing
+static bool _directoryReadFailed = false;
 DirectoryEntry _tempEntries[ENTRIES_PER_SECTOR];
 
 // Temp Buffer for files.
@@ -32,6 +103,13 @@ static inline void IterateSubDirectory(FILE file, DirectoryDelegate fileFn, uint
 static inline void IterateRootFolder(DirectoryDelegate fileFn, uint32_t* ptrs);
 static inline bool IterateSector(pDirectoryEntry entry, DirectoryDelegate fileFn, uint32_t* ptrs);
 static inline bool MatchDelegate(pDirectoryEntry entry, uint32_t* filename);
+static bool CheckMedia();
+
+// The work behind FsFat12_OpenFrom, FsFat12_IterateFolder and FsFat12_Read. These do not check
+// the media, the public functions do that once for the whole operation
+static FILE OpenFrom(FILE dir, const char* filePath);
+static void IterateFolder(FILE dir, DirectoryDelegate fileFn, uintptr_t* ptrs);
+static unsigned int ReadFile(PFILE file, unsigned char* buffer, unsigned int length);
 
 //
 //   STATIC DECLARATIONS
@@ -47,8 +125,10 @@ static inline FILE ConvertToFile(pDirectoryEntry entry, char* name)
     file.Eof = 0;
     file.Position = 0;
     file.CurrentCluster = entry->FirstCluster;
+    file.FirstCluster = entry->FirstCluster;
     file.FileLength = entry->FileSize;
     file.Flags = (entry->Attrib & 0x10) ? FS_DIRECTORY : FS_FILE;
+    file.Generation = _mediaGeneration;
     return file;
 }
 
@@ -190,7 +270,11 @@ void IterateSubDirectory(FILE dir, DirectoryDelegate fileFn, uintptr_t* ptrs)
 
     do
     {
-        FsFat12_Read(&dir, (char * )_tempEntries, BYTES_PER_SECTOR);
+        if (ReadFile(&dir, (unsigned char*)_tempEntries, BYTES_PER_SECTOR) == 0)
+        {
+            _directoryReadFailed = true;
+            return;
+        }
         if (IterateSector(_tempEntries, fileFn, ptrs))
         {
             return;
@@ -207,9 +291,13 @@ void IterateSubDirectory(FILE dir, DirectoryDelegate fileFn, uintptr_t* ptrs)
 void IterateRootFolder(DirectoryDelegate fileFn, uintptr_t* ptrs)
 {
     _delegateIsLFN = false;
-    for (size_t i = 0; i < ROOT_DIRECTORY_SECTOR_SIZE; i++)
+    for (size_t i = 0; i < rootSize; i++)
     {
-        memcpy(_tempEntries, FloppyDriveReadSector(offsetRoot + i), BYTES_PER_SECTOR); 
+        if (BufferCache_Read(_device, _mediaGeneration, offsetRoot + i, 1, (uint8_t*) _tempEntries) != 0)
+        {
+            _directoryReadFailed = true;
+            return;
+        }
         if (IterateSector(_tempEntries, fileFn, ptrs))
         {
             return;
@@ -241,26 +329,333 @@ static bool MatchDelegate(pDirectoryEntry entry, uintptr_t* ptrs)
     return false;
 }
 
+// Look up the cluster after cluster in the FAT
+// @param cluster the cluster to look up
+// @return the next cluster in the chain, >= 0xff8 at the end of the chain
+static inline uint32_t GetNextCluster(uint32_t cluster)
+{
+    return cluster < _clusterCount ? _nextCluster[cluster] : 0xfff;
+}
+
+// Return the extents of the file starting at firstCluster, working them out if we
+// have not already. The least recently used list is reused when they are all taken.
+// @param firstCluster the first cluster of the file
+// @return the extent list, or NULL if the file has no clusters
+static ExtentList* GetExtents(uint32_t firstCluster)
+{
+    if (firstCluster < 2 || firstCluster >= _clusterCount)
+    {
+        return NULL;
+    }
+
+    ExtentList* list = &_extentLists[0];
+    for (size_t i = 0; i < EXTENT_LISTS; i++)
+    {
+        if (_extentLists[i].FirstCluster == firstCluster)
+        {
+            _extentLists[i].LastUsed = ++_extentClock;
+            return &_extentLists[i];
+        }
+        if (_extentLists[i].LastUsed < list->LastUsed)
+        {
+            list = &_extentLists[i];
+        }
+    }
+
+    // Walk the chain once, starting a new extent wherever it jumps
+    list->FirstCluster = firstCluster;
+    list->LastUsed = ++_extentClock;
+    list->Count = 0;
+    uint32_t fileCluster = 0;
+    uint32_t cluster = firstCluster;
+    while (cluster >= 2 && cluster < 0xff8 && list->Count < EXTENTS_PER_FILE)
+    {
+        Extent* extent = &list->Extents[list->Count++];
+        extent->FileCluster = fileCluster;
+        extent->Start = cluster;
+        extent->Length = 0;
+        uint32_t next;
+        do
+        {
+            extent->Length++;
+            fileCluster++;
+            next = GetNextCluster(cluster);
+        }
+        while (next == ++cluster);
+        cluster = next;
+    }
+    return list;
+}
+
+// Find the extent holding cluster number fileCluster of a file, by binary search
+// @param list the file's extents
+// @param fileCluster the index of the cluster within the file
+// @return the extent, or NULL if it is past the extents we have
+static Extent* FindExtent(ExtentList* list, uint32_t fileCluster)
+{
+    int low = 0;
+    int high = (int)list->Count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) >> 1;
+        Extent* extent = &list->Extents[middle];
+        if (fileCluster < extent->FileCluster)
+        {
+            high = middle - 1;
+        }
+        else if (fileCluster >= (uint32_t)extent->FileCluster + extent->Length)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            return extent;
+        }
+    }
+    return NULL;
+}
+
+// Find cluster number fileCluster of a file. The extents give it straight away; past them
+// we follow the chain from the end of the last extent, or from the file's current cluster
+// if that is nearer
+// @param file the file
+// @param fileCluster the index of the cluster within the file
+// @return the cluster, >= 0xff8 if the chain ends first
+static uint32_t FindCluster(PFILE file, uint32_t fileCluster)
+{
+    ExtentList* list = GetExtents(file->FirstCluster);
+    if (list == NULL)
+    {
+        return 0xfff;
+    }
+    Extent* extent = FindExtent(list, fileCluster);
+    if (extent)
+    {
+        return extent->Start + (fileCluster - extent->FileCluster);
+    }
+
+    extent = &list->Extents[list->Count - 1];
+    uint32_t index = extent->FileCluster + extent->Length - 1;
+    uint32_t cluster = extent->Start + extent->Length - 1;
+    uint32_t currentIndex = file->Position / clusterSize;
+    if (file->CurrentCluster >= 2 && file->CurrentCluster < 0xff8 && currentIndex > index && currentIndex <= fileCluster)
+    {
+        index = currentIndex;
+        cluster = file->CurrentCluster;
+    }
+    for (; index < fileCluster && cluster >= 2 && cluster < 0xff8; index++)
+    {
+        cluster = GetNextCluster(cluster);
+    }
+    return cluster;
+}
+
+// Hash a name in a directory, ignoring case
+// @param parent the cluster of the directory
+// @param name the name
+// @return the hash, never 0
+static uint32_t DentryHash(uint32_t parent, const char* name)
+{
+    uint32_t hash = 2166136261u ^ parent;
+    for (; *name; name++)
+    {
+        char c = *name;
+        hash = (hash ^ (uint8_t)tolower(c)) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+// Look a name up in the dentry cache
+// @param parent the cluster of the directory
+// @param name the name
+// @param hash DentryHash of parent and name
+// @return the entry, or NULL if we have not looked the name up before
+static Dentry* DentryFind(uint32_t parent, const char* name, uint32_t hash)
+{
+    for (Dentry* dentry = _dentryBuckets[hash % DENTRY_BUCKETS]; dentry != NULL; dentry = dentry->HashNext)
+    {
+        if (dentry->Hash == hash && dentry->Parent == parent && strcasecmp(dentry->Name, name) == 0)
+        {
+            dentry->LastUsed = ++_dentryClock;
+            return dentry;
+        }
+    }
+    return NULL;
+}
+
+// Remember what looking up a name found, reusing the least recently used entry
+// @param parent the cluster of the directory
+// @param hash DentryHash of parent and the name
+// @param name the name to keep: the file's own if it was found, else the one asked for
+// @param file what was found. FS_INVALID if nothing was
+static void DentryInsert(uint32_t parent, uint32_t hash, const char* name, PFILE file)
+{
+    if (strlen(name) >= DENTRY_NAME_LENGTH)
+    {
+        return;
+    }
+
+    Dentry* dentry = &_dentries[0];
+    for (size_t i = 1; i < DENTRY_ENTRIES && dentry->Hash != 0; i++)
+    {
+        if (_dentries[i].Hash == 0 || _dentries[i].LastUsed < dentry->LastUsed)
+        {
+            dentry = &_dentries[i];
+        }
+    }
+
+    // Take it off the chain it was on
+    if (dentry->Hash != 0)
+    {
+        Dentry** link = &_dentryBuckets[dentry->Hash % DENTRY_BUCKETS];
+        while (*link != dentry)
+        {
+            link = &(*link)->HashNext;
+        }
+        *link = dentry->HashNext;
+    }
+
+    dentry->Parent = parent;
+    dentry->Hash = hash;
+    dentry->FirstCluster = file->FirstCluster;
+    dentry->FileLength = file->FileLength;
+    dentry->Flags = file->Flags;
+    dentry->LastUsed = ++_dentryClock;
+    strcpy(dentry->Name, name);
+    dentry->HashNext = _dentryBuckets[hash % DENTRY_BUCKETS];
+    _dentryBuckets[hash % DENTRY_BUCKETS] = dentry;
+}
+
+// Count the clusters from the file's current cluster on that follow on from each other
+// on the disk, stopping once there are at least wanted of them
+// @param file the file
+// @param wanted the number of clusters the caller could use
+// @return the number of contiguous clusters, at least 1
+static uint32_t GetContiguousClusters(PFILE file, uint32_t wanted)
+{
+    // Only files get extents, so walking directories does not push them out
+    uint32_t fileCluster = file->Position / clusterSize;
+    ExtentList* list = file->Flags == FS_FILE ? GetExtents(file->FirstCluster) : NULL;
+    Extent* extent = list ? FindExtent(list, fileCluster) : NULL;
+    if (extent && extent->Start + (fileCluster - extent->FileCluster) == file->CurrentCluster)
+    {
+        // Extents are as long as they can be, so the next cluster after this one is elsewhere
+        return extent->Length - (fileCluster - extent->FileCluster);
+    }
+
+    // Past the extents we keep (or a directory). Follow the chain
+    uint32_t count = 1;
+    uint32_t last = file->CurrentCluster;
+    while (count < wanted && GetNextCluster(last) == last + 1)
+    {
+        last++;
+        count++;
+    }
+    return count;
+}
+
+// Mount the device again if its media has changed since the tables were read.
+// A device that failed to mount after a change is tried again every time.
+// @return true if there is a usable file system mounted
+static bool CheckMedia()
+{
+    if (_mediaDevice == NULL)
+    {
+        return false;
+    }
+    if (_device != NULL && BlockDevice_GetMediaGeneration(_device) == _mediaGeneration)
+    {
+        return true;
+    }
+    return FsFat12_Initialise(_mediaDevice);
+}
+
 //
 //  HEADER DECLARATIONS
 //
 
 // Initialize the file system.
-void FsFat12_Initialise()
+// @param device the device to mount
+// @return true if the device holds a FAT12 file system we can use
+bool FsFat12_Initialise(BlockDevice* device)
 {
+    // The tables below get overwritten, so whatever was mounted before is gone
+    _device = NULL;
+    _mediaDevice = device;
+
+    // Let the driver look at the media again, e.g. work out the format of a new floppy
+    if (BlockDevice_Revalidate(device) != 0)
+    {
+        return false;
+    }
+
+    // Take the generation before reading anything, so a change part way through is picked up next time
+    _mediaGeneration = BlockDevice_GetMediaGeneration(device);
+
     // Retrieve the Bios Parameter Block
-    pBootSector startSector = (pBootSector) FloppyDriveReadSector(0);
+    if (device == NULL || device->SectorSize != BYTES_PER_SECTOR || BufferCache_Read(device, _mediaGeneration, 0, 1, _sectorBuffer) != 0)
+    {
+        return false;
+    }
+    pBootSector startSector = (pBootSector) _sectorBuffer;
+    if (startSector->Bpb.BytesPerSector != BYTES_PER_SECTOR || startSector->Bpb.SectorsPerFat > MAX_FAT_SECTORS ||
+        startSector->Bpb.SectorsPerCluster == 0)
+    {
+        return false;
+    }
 
     offsetFat = startSector->Bpb.ReservedSectors;
     offsetRoot = (startSector->Bpb.NumberOfFats *  startSector->Bpb.SectorsPerFat) + offsetFat;
     rootSize = (startSector->Bpb.NumDirEntries * ENTRY_SIZE) / startSector->Bpb.BytesPerSector;
     offsetData = offsetRoot + rootSize;
 
-    size_t sizePerFat = startSector->Bpb.SectorsPerFat;
-    for (size_t i = 0; i < sizePerFat; i++)
+    // 1.44MB disks have a sector per cluster, DMF and 2.88MB disks have more
+    sectorsPerCluster = startSector->Bpb.SectorsPerCluster;
+    clusterSize = sectorsPerCluster * BYTES_PER_SECTOR;
+
+    // Unpack the FAT a sector at a time. Entries are 12 bits, so every 3 bytes hold 2 of them,
+    // and they carry over from one sector to the next
+    uint32_t fatSectors = startSector->Bpb.SectorsPerFat;
+    uint32_t cluster = 0;
+    uint32_t phase = 0;
+    uint16_t held = 0;
+    for (uint32_t sector = 0; sector < fatSectors; sector++)
     {
-        memcpy(FAT_Table + (i << 9), FloppyDriveReadSector(offsetFat + i), 512);
+        if (BufferCache_Read(device, _mediaGeneration, offsetFat + sector, 1, _sectorBuffer) != 0)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < BYTES_PER_SECTOR; i++)
+        {
+            uint8_t value = _sectorBuffer[i];
+            if (phase == 0)
+            {
+                held = value;
+                phase = 1;
+            }
+            else if (phase == 1)
+            {
+                _nextCluster[cluster++] = held | ((value & 0x0f) << 8);
+                held = value >> 4;
+                phase = 2;
+            }
+            else
+            {
+                _nextCluster[cluster++] = held | (value << 4);
+                phase = 0;
+            }
+        }
     }
+    _clusterCount = cluster;
+
+    // Extents and names belong to the disk that was mounted before
+    memset(_extentLists, 0, sizeof(_extentLists));
+    _extentClock = 0;
+    memset(_dentries, 0, sizeof(_dentries));
+    memset(_dentryBuckets, 0, sizeof(_dentryBuckets));
+    _dentryClock = 0;
+    _device = device;
+    return true;
 }
 
 // Handle the Name, Including Long File Names
@@ -295,6 +690,12 @@ bool FsFat12_RetrieveNameFromDirectoryEntry(pDirectoryEntry entry, char* fname)
     return false;
 }
 
+// Get the device passed to the last FsFat12_Initialise
+// @return the device, or NULL if nothing has been mounted
+BlockDevice* FsFat12_GetDevice()
+{
+    return _mediaDevice;
+}
 
 // Open a file 
 // This starts from the Root.
@@ -305,7 +706,13 @@ FILE FsFat12_Open(const char* filePath)
     FILE res;
     res.Flags = FS_DIRECTORY;
     strcpy(res.Name, "\\");
-    res.Eof = res.CurrentCluster = res.Position = 0;
+    res.Eof = res.CurrentCluster = res.FirstCluster = res.Position = 0;
+    if (!CheckMedia())
+    {
+        res.Flags = FS_INVALID;
+        return res;
+    }
+    res.Generation = _mediaGeneration;
 
     // If we are merely requesting root then we are good. 
     if (strcmp("\\", filePath) == 0) 
@@ -314,7 +721,7 @@ FILE FsFat12_Open(const char* filePath)
     }
 
     // Then navigate from the root directory.
-    return FsFat12_OpenFrom(res, filePath);
+    return OpenFrom(res, filePath);
 }
 
 // Traverse the directory upwards to the filepath we pass in
@@ -322,6 +729,21 @@ FILE FsFat12_Open(const char* filePath)
 // @param filePath - the file path we wish to reach
 // @return The FILE we have found, flag set to INVALID if file not found.
 FILE FsFat12_OpenFrom(FILE dir, const char* filePath) 
+{
+    if (!CheckMedia())
+    {
+        FILE res;
+        res.Flags = FS_INVALID;
+        return res;
+    }
+    return OpenFrom(dir, filePath);
+}
+
+// Traverse the directory upwards to the filepath we pass in, without checking the media
+// @param entry - the initial entry we wish to traverse from (usually from the root)
+// @param filePath - the file path we wish to reach
+// @return The FILE we have found, flag set to INVALID if file not found.
+static FILE OpenFrom(FILE dir, const char* filePath) 
 {
     FILE res;
     res.Flags = FS_INVALID;
@@ -336,11 +758,41 @@ FILE FsFat12_OpenFrom(FILE dir, const char* filePath)
         ExtractNextEntry(&tempFile, nextFile);
         done = !(*tempFile);
 
-        pointers[0] = (uintptr_t) nextFile;
-        FsFat12_IterateFolder(dir, MatchDelegate, pointers);
+        // Only search the directory if we have not looked for this name in it before
+        uint32_t hash = DentryHash(dir.CurrentCluster, nextFile);
+        Dentry* dentry = DentryFind(dir.CurrentCluster, nextFile, hash);
+        if (dentry != NULL)
+        {
+            strcpy(res.Name, dentry->Name);
+            res.Flags = dentry->Flags;
+            res.FileLength = dentry->FileLength;
+            res.FirstCluster = res.CurrentCluster = dentry->FirstCluster;
+            res.Eof = res.Position = 0;
+            res.Generation = _mediaGeneration;
+        }
+        else
+        {
+            // Start from nothing found. In an empty directory the delegate never runs, and res
+            // would still describe the directory we are searching
+            uint32_t generation = _mediaGeneration;
+            _directoryReadFailed = false;
+            res.Flags = FS_INVALID;
+            res.FirstCluster = res.FileLength = 0;
+            pointers[0] = (uintptr_t) nextFile;
+            IterateFolder(dir, MatchDelegate, pointers);
+            if (!_directoryReadFailed && generation == _mediaGeneration)
+            {
+                DentryInsert(dir.CurrentCluster, hash, res.Flags & FS_INVALID ? nextFile : res.Name, &res);
+            }
+        }
         
         if (done) 
         {
+            // Work out where the file lives on the disk now, rather than on the first read
+            if (res.Flags & FS_FILE)
+            {
+                GetExtents(res.FirstCluster);
+            }
             return res; 
         }
         else if (!done && res.Flags & (FS_INVALID | FS_FILE))
@@ -363,6 +815,18 @@ FILE FsFat12_OpenFrom(FILE dir, const char* filePath)
 // @param fileFN the file function 
 // @param passIn Variable to pass to the file function
 void FsFat12_IterateFolder(FILE dir, DirectoryDelegate fileFn, uint32_t* ptrs)
+{
+    if (CheckMedia())
+    {
+        IterateFolder(dir, fileFn, ptrs);
+    }
+}
+
+// Iterate a folder applying a function, without checking the media
+// @param the directory we wish to iterate. 
+// @param fileFN the file function 
+// @param passIn Variable to pass to the file function
+static void IterateFolder(FILE dir, DirectoryDelegate fileFn, uintptr_t* ptrs)
 {
     if (dir.CurrentCluster < 2)
     {
@@ -382,10 +846,32 @@ void FsFat12_IterateFolder(FILE dir, DirectoryDelegate fileFn, uint32_t* ptrs)
 // @pre/post : to be considered: This doesn't expect to be called multiple times,
 //        if the same buffer the programmer should memcpy the buffer themselves if permanence is needed.
 unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length)
+{
+    if (file != NULL && !CheckMedia())
+    {
+        file->Eof = 1;
+        return 0;
+    }
+    return ReadFile(file, buffer, length);
+}
+
+// Read from a file, without checking the media
+// @param file - file to read
+// @param buffer - buffer to read to
+// @param length - length to read to. 
+// @return The Length of what we read.
+static unsigned int ReadFile(PFILE file, unsigned char* buffer, unsigned int length)
 {
     int read = 0;
     if (file != NULL)
     {
+        // A file opened before the disk was changed refers to clusters on the old disk
+        if (file->Generation != _mediaGeneration)
+        {
+            file->Eof = 1;
+            return 0;
+        }
+
         // Get the Max, the file Length or the length of the file. We should not read 
         // Over the length of the file.     
         // If the pointer exists continue
@@ -396,56 +882,67 @@ unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length
             int totalFileRemaining = (file->FileLength - file->Position);
             lenRemaining = length > totalFileRemaining  ? totalFileRemaining : length;
         }
-        
-        int remainder = file->Position % BYTES_PER_SECTOR;
-
-        // What's our increment? Max we can pass is a sector. 
-        int increment = length > BYTES_PER_SECTOR ? BYTES_PER_SECTOR : length;
 
         // We should check CurrentCluster is correct and the LenRemaining is greater than 0
-        // We don't want to evaluate this EVERYTIME, though;
-        bool ok = (file->CurrentCluster > 2) && (lenRemaining > 0);
+        bool ok = (file->CurrentCluster >= 2) && (file->CurrentCluster < 0xff8) && (lenRemaining > 0);
         unsigned char* temp = buffer; 
         while (ok)
         {  
-            int len = BYTES_PER_SECTOR - remainder;
-            len = len > increment ? increment : len; 
-            len = lenRemaining > len ? len : lenRemaining;
+            uint32_t offsetInCluster = file->Position % clusterSize;
+            uint32_t sectorInCluster = offsetInCluster / BYTES_PER_SECTOR;
+            int remainder = file->Position % BYTES_PER_SECTOR;
+            int sector = offsetData + (file->CurrentCluster - 2) * sectorsPerCluster + sectorInCluster;
+            int len;
 
-            // Copy into a buffer and increment the remainder
-            memcpy(temp, FloppyDriveReadSector(PHYSICAL_PADDING + offsetFat + (file->CurrentCluster - 2)) + remainder, len); 
+            if (remainder != 0 || lenRemaining < BYTES_PER_SECTOR)
+            {
+                // Part of a sector, copied out of a sector buffer
+                len = BYTES_PER_SECTOR - remainder;
+                len = lenRemaining > len ? len : lenRemaining;
+                if (BufferCache_Read(_device, _mediaGeneration, sector, 1, _sectorBuffer) != 0)
+                {
+                    break;
+                }
+                memcpy(temp, _sectorBuffer + remainder, len); 
+            }
+            else
+            {
+                // Whole sectors go straight into the caller's buffer. Clusters that follow on from
+                // this one on the disk are read along with it, so the run is a single read
+                uint32_t wanted = lenRemaining / BYTES_PER_SECTOR;
+                uint32_t clusters = GetContiguousClusters(file, (wanted + sectorInCluster + sectorsPerCluster - 1) / sectorsPerCluster);
+                uint32_t count = clusters * sectorsPerCluster - sectorInCluster;
+                count = count > wanted ? wanted : count;
+                if (BufferCache_Read(_device, _mediaGeneration, sector, count, temp) != 0)
+                {
+                    break;
+                }
+                len = count * BYTES_PER_SECTOR;
+            }
 
             // Modify the variables for the next passthrough
             lenRemaining -= len;
             temp += len;
             read += len;
             file->Position += len;
-            remainder = file->Position % BYTES_PER_SECTOR;
-            
-            //  n == even (low four bits in location 1+(3*n)/2 with 8 bits in location (3*n)/2
-            //  n == odd, high four bits in location (3*n)/2 with 8 bits in location 1+(3*n)/2 
-            // (3 * n) / 2 is equivalent to  1.5 * n (We can use a bitshift, which should be more efficient.)
-            size_t baseInd = file->CurrentCluster + (file->CurrentCluster >> 1);
-
-            // Set the cluster to be the next one in the FAT Map. 
-            // Rules Dictated in the comments above.
-            if (remainder == 0) 
+
+            // Move past every cluster we have finished with. They were all part of one contiguous
+            // run, so only the step off the end of the last one goes through the FAT
+            uint32_t crossed = (offsetInCluster + len) / clusterSize;
+            if (crossed > 0)
             {
-                file->CurrentCluster = (file->CurrentCluster % 2 == 0) 
-                                        ?  ((FAT_Table[1 + baseInd] & 0x0F) << 8) | FAT_Table[baseInd] 
-                                        :  ((FAT_Table[baseInd]) >> 4) |  (FAT_Table[1 + baseInd] << 4); 
+                file->CurrentCluster = GetNextCluster(file->CurrentCluster + crossed - 1);
 
                 // We have hit the end of the current cluster, either by hitting the END flag 
                 // OR by hitting something invalid.
                 if (file->CurrentCluster >= 0xff8 || file->CurrentCluster == 0x00) 
                 { 
-                    // Set the flag then break, meaning we will return whatever length was remaining.
+                    // Set the flag, meaning we will return whatever length was remaining.
                     file->Eof = 1;
-                    break;
                 }
             }
 
-            ok = lenRemaining > 0;
+            ok = lenRemaining > 0 && !file->Eof;
         }
 
         if (file->Position == file->FileLength)
@@ -460,6 +957,47 @@ unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length
     return 0;
 }
 
+// Move to a position in a file, so the next read starts there. 
+// @param file - file to move in
+// @param offset - offset from the place given by whence
+// @param whence - FS_SEEK_SET, FS_SEEK_CUR or FS_SEEK_END
+// @return the new position, or -1 if it is outside the file or file is not a file
+int FsFat12_Seek(PFILE file, int offset, int whence)
+{
+    // Directories have no length to seek within
+    if (file == NULL || file->Flags != FS_FILE || !CheckMedia() || file->Generation != _mediaGeneration)
+    {
+        return -1;
+    }
+
+    int position;
+    switch (whence)
+    {
+        case FS_SEEK_SET:
+            position = offset;
+            break;
+        case FS_SEEK_CUR:
+            position = (int)file->Position + offset;
+            break;
+        case FS_SEEK_END:
+            position = (int)file->FileLength + offset;
+            break;
+        default:
+            return -1;
+    }
+    if (position < 0 || (uint32_t)position > file->FileLength)
+    {
+        return -1;
+    }
+
+    // Going to the end of a file that fills its last cluster leaves us past the chain, 
+    // which is what a read to the end would have done too
+    file->CurrentCluster = FindCluster(file, position / clusterSize);
+    file->Position = position;
+    file->Eof = (uint32_t)position == file->FileLength;
+    return position;
+}
+
 // Close the file
 // @param file - Pointer to the file to close
 void FsFat12_Close(PFILE file)
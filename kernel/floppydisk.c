@@ -1,5 +1,9 @@
 #include <hal.h>
 #include <floppydisk.h>
+#include <string.h>
+#include <bpb.h>
+#include "virtualmemorymanager.h"
+#include "physicalmemorymanager.h"
 
 // Floppy disk support
 
@@ -9,6 +13,7 @@
 #define	FLPYDSK_MSR			0x3f4
 #define	FLPYDSK_FIFO		0x3f5
 #define	FLPYDSK_CTRL		0x3f7
+#define	FLPYDSK_DIR			0x3f7	// Read side of FLPYDSK_CTRL
 
 //	Bits 0-4 of command byte. 
 
@@ -21,12 +26,27 @@
 #define	FDC_CMD_CHECK_INT		8
 #define	FDC_CMD_FORMAT_TRACK	0xd
 #define	FDC_CMD_SEEK			0xf
+#define	FDC_CMD_VERSION			0x10
+#define	FDC_CMD_CONFIGURE		0x13
+#define	FDC_CMD_LOCK			0x14
 
 //	Additional command masks. Can be masked with above commands
 
 #define	FDC_CMD_EXT_SKIP		0x20	//00100000
 #define	FDC_CMD_EXT_DENSITY		0x40	//01000000
 #define	FDC_CMD_EXT_MULTITRACK	0x80	//10000000
+#define	FDC_CMD_EXT_LOCK		0x80	//10000000
+
+//	Result of FDC_CMD_VERSION on an 82077AA (or compatible) controller. Older controllers
+//	reject the command and return ST0 with invalid command (0x80)
+
+#define	FDC_VERSION_82077AA		0x90
+
+//	Second parameter byte of FDC_CMD_CONFIGURE. Bits 0-3 are the FIFO threshold - 1
+
+#define	FDC_CONFIG_POLL_DISABLE		0x10	//00010000
+#define	FDC_CONFIG_FIFO_DISABLE		0x20	//00100000
+#define	FDC_CONFIG_IMPLIED_SEEK		0x40	//01000000
 
 //	Digital Output Register
 
@@ -41,6 +61,11 @@
 #define	FLPYDSK_DOR_MASK_DRIVE2_MOTOR		64	//01000000
 #define	FLPYDSK_DOR_MASK_DRIVE3_MOTOR		128	//10000000
 
+//	Digital Input Register. Bit 7 is the disk change line of the selected drive, set once the
+//	door has been opened and cleared by the next step pulse with a disk in the drive
+
+#define	FLPYDSK_DIR_MASK_CHANGE				128	//10000000
+
 //	Main Status Register
 
 #define	FLPYDSK_MSR_MASK_DRIVE1_POS_MODE		1	//00000001
@@ -76,6 +101,7 @@
 #define	FLPYDSK_GAP3_LENGTH_STD 	    42
 #define	FLPYDSK_GAP3_LENGTH_5_14	    32
 #define	FLPYDSK_GAP3_LENGTH_3_5		    27
+#define	FLPYDSK_GAP3_LENGTH_DMF		    12
 
 #define	FLPYDSK_SECTOR_DTL_128			0
 #define	FLPYDSK_SECTOR_DTL_256			1
@@ -85,12 +111,33 @@
 // Floppy IRQ
 const int FLOPPY_IRQ = 6;
 
-// Sectors per track
-const int FLPY_SECTORS_PER_TRACK = 18;
+// Bytes per sector
+const int FLPY_BYTES_PER_SECTOR = 512;
+
+// Geometry of the disk in the drive. Starts out as a 1.44MB disk and is replaced by what
+// the BPB says once FloppyDriveDetectGeometry has read the boot sector
+static int _SectorsPerTrack = 18;
+static int _Heads = 2;
+static int _Cylinders = 80;
+static int _CylinderSectors = 36;
+static int _TotalSectors = 2880;
+static uint8_t _DataRate = FLPY_RATE_500KBPS;
+static uint8_t _Gap3 = FLPYDSK_GAP3_LENGTH_3_5;
+
+// LBA to CHS lookup, one entry for each sector on the disk. Sector in bits 0-5, head in
+// bit 6 and cylinder in bits 7-14. Null if the memory for it could not be found
+static uint16_t* _ChsTable = 0;
 
-// dma tranfer buffer starts here and ends at 0x8000+64k
-// You can change this as needed. It must be below 1MB and is a physical memory address
-int DMA_BUFFER = 0x8000;
+#define	FLPY_CHS_SECTOR_MASK	0x3f
+#define	FLPY_CHS_HEAD_SHIFT		6
+#define	FLPY_CHS_CYLINDER_SHIFT	7
+
+// Media generation the geometry was last detected for
+static uint32_t _GeometryGeneration = 0;
+
+// Set while FloppyDriveDetectGeometry is trying data rates. A failed read means the rate was wrong,
+// so it is not worth retrying, and nothing is read ahead with a geometry that is about to change
+static bool _Probing = false;
 
 // FDC uses DMA channel 2
 const int FDC_DMA_CHANNEL = 2;
@@ -101,45 +148,201 @@ static uint8_t	_CurrentDrive = 0;
 // Set when IRQ fires
 static volatile uint8_t _FloppyDiskIRQ = 0;
 
-typedef union
-{
-    uint8_t 		byte[4];
-    unsigned long 	l;
-} byte_accessable_long;
+// Cylinder the head is currently over. -1 if unknown (i.e. before calibration or after an error)
+static int _CurrentCylinder = -1;
 
-bool FloppyDriveDMAInitialise(uint8_t* buffer, unsigned int length)
+// When the controller gets reset
+static FloppyResetMode _ResetMode = FLPY_RESET_ON_ERROR;
+
+// Motor state. The motor is left running between requests and switched off
+// from the timer once it has been idle for _MotorIdleTicks
+static volatile bool _MotorOn = false;
+static volatile uint32_t _MotorOnSince = 0;
+static volatile int _MotorUsers = 0;
+static volatile uint32_t _MotorLastUsed = 0;
+static uint32_t _MotorIdleTicks = FLPY_MOTOR_IDLE_TICKS_DEFAULT;
+
+// Media generation. Goes up every time the change line shows the disk has been changed or taken out
+static volatile uint32_t _MediaGeneration = 0;
+
+// Set once the change line has been seen (and the generation raised), and once the head has been
+// stepped to clear it. Both go back to false when the line reads clear
+static volatile bool _ChangeNoticed = false;
+static bool _ChangeStepped = false;
+
+// Ticks to wait for the motor to come up to speed
+#define FLPY_MOTOR_SPINUP_TICKS	20
+
+// Ticks to let the head settle after a seek
+#define FLPY_HEAD_SETTLE_TICKS	2
+
+// Number of status register polls before we give up on the controller
+#define FLPY_MSR_TIMEOUT		100000
+
+// Number of ticks to wait for an IRQ before we give up on the controller
+#define FLPY_IRQ_TIMEOUT		300
+
+// Number of times a run is retried (with a reset in between) before the request fails
+#define FLPY_MAX_RETRIES		3
+
+// Number of RECALIBRATE commands to try before giving up. Each one moves the head at most 79 steps
+#define FLPY_CALIBRATE_TRIES	10
+
+// Number of bytes in the FIFO before the controller asks for a DMA transfer (1-16). Low enough to
+// leave room for DMA latency, high enough that the bus is not asked for every byte
+#define FLPY_FIFO_THRESHOLD		8
+
+// States of the request state machine. Every state apart from FLPY_STATE_IDLE is
+// waiting on either the floppy IRQ or a timer tick to move on
+typedef enum _FloppyState
+{
+	FLPY_STATE_IDLE,		// Nothing to do
+	FLPY_STATE_SPINUP,		// Waiting (on the timer) for the motor to come up to speed
+	FLPY_STATE_RESET,		// Waiting for the IRQ that follows a controller reset
+	FLPY_STATE_CALIBRATE,	// Waiting for RECALIBRATE to finish
+	FLPY_STATE_SEEK,		// Waiting for SEEK to finish
+	FLPY_STATE_SETTLE,		// Waiting (on the timer) for the head to settle
+	FLPY_STATE_READ			// Waiting for READ to reach its result phase
+} FloppyState;
+
+// Pending requests, in the order they were submitted. FloppyDriveSchedule picks which one goes next
+static FloppyRequest* volatile _QueueHead = 0;
+static FloppyRequest* volatile _QueueTail = 0;
+
+// Batch being served: one request, plus any pending requests for the sectors straight after it,
+// chained through their Next pointers. The batch covers _BatchCount sectors from _BatchLBA
+static FloppyRequest* volatile _ActiveRequest = 0;
+static int _BatchLBA;
+static int _BatchCount;
+static int _BatchDone;
+
+// Sector the C-SCAN sweep has reached
+static int _ScanPosition = 0;
+
+// Performance counters
+static FloppyDriveStats _Stats;
+
+// Tick at which the current IRQ wait or delay started
+static uint32_t _WaitStart = 0;
+
+// A DMA bounce buffer, and the sectors it currently holds (none if Count is 0)
+typedef struct _FloppyDMABuffer
 {
-	byte_accessable_long byteAccessableAddress;
-	byte_accessable_long byteAccessableLength;
+	uint32_t	Address;
+	int			SectorLBA;
+	int			Count;
+} FloppyDMABuffer;
 
-    byteAccessableAddress.l = (unsigned int)buffer;
-    byteAccessableLength.l = length - 1;
+static FloppyDMABuffer _DMABuffers[FLPY_DMA_BUFFER_COUNT];
 
-	//Check for buffer issues
-	if ((byteAccessableAddress.l >> 24) || 
-        (byteAccessableLength.l >> 16) || 
-	    (((byteAccessableAddress.l & 0xffff) + byteAccessableLength.l) >> 16))
-	{
-		return false;
-    }
-	DMA_Reset(1);
-	DMA_MaskChannel(FDC_DMA_CHANNEL);
-    DMA_ResetFlipflop(1);
+// Bounce buffer filled most recently
+static int _LastFilled = 0;
+
+// Read ahead into the bounce buffers when the queue runs dry, and the sector to read ahead from
+static bool _ReadAhead = true;
+static int _ReadAheadLBA = 0;
+
+// The run (the part of the batch, or a read-ahead, within one cylinder) in progress
+static int _RunLBA;
+static int _RunHead;
+static int _RunTrack;
+static int _RunSector;
+static int _RunCount;
+static bool _RunIsReadAhead;
+
+// Cylinder the current SEEK is moving the head to
+static int _SeekTarget;
+
+// Physical address the current run is transferred to, and the bounce buffer that is
+// (-1 if the run goes straight into the requester's buffer)
+static uint32_t _RunPhysical;
+static int _RunBuffer;
 
-    DMA_SetAddress(FDC_DMA_CHANNEL, byteAccessableAddress.byte[0], byteAccessableAddress.byte[1]);
-    DMA_ResetFlipflop(1);
+// Current state, and the tick at which the current wait ends or times out
+static volatile FloppyState _State = FLPY_STATE_IDLE;
+static volatile uint32_t _Deadline = 0;
 
-    DMA_SetCount(FDC_DMA_CHANNEL, byteAccessableLength.byte[0], byteAccessableLength.byte[1]);
-	DMA_SetExternalPageRegister(2, 0);	
+// Error recovery counters for the active request
+static int _Retries = 0;
+static int _CalibrateTries = 0;
 
+// Set if the controller understands CONFIGURE (an 82077AA or later), and if it has been told to
+// seek to the cylinder given in READ itself
+static bool _Enhanced = false;
+static bool _ImpliedSeek = false;
+
+// Set once the CONFIGURE settings have been locked, so they survive a controller reset
+static bool _Locked = false;
+
+// The drive as seen by the block device layer
+static BlockDevice _BlockDevice;
+
+// Set while the state machine holds the motor, i.e. from the first request until the queue drains
+static bool _HoldingMotor = false;
+
+// Set while the state machine is running from the floppy or timer interrupt
+static volatile bool _InStateMachine = false;
+
+// Sector returned by FloppyDriveReadSector. Aligned so it never crosses a 64K boundary and can be DMAed into
+static uint8_t _SectorBuffer[512] __attribute__((aligned(512)));
+
+static bool FloppyDriveStartNext();
+static void FloppyDriveRunFailed();
+static void FloppyDriveInvalidateBuffers();
+
+// Program the DMA channel to transfer length bytes at physical address buffer.
+// Any buffer below 16MB that stays within a 64K bank will do
+bool FloppyDriveDMAInitialise(uint8_t* buffer, unsigned int length)
+{
+	// Physical address 0 is never handed out, so it means a bounce buffer could not be allocated
+	if (buffer == 0)
+	{
+		return false;
+	}
+	DMA_Reset(1);
+	if (!DMA_SetTransfer(FDC_DMA_CHANNEL, (uint32_t)buffer, length))
+	{
+		return false;
+	}
     DMA_UnmaskChannel(FDC_DMA_CHANNEL);
     return true;
 }
 
-// Set DMA base address
-void FloppyDriveSetDMA(int addr) 
+// Return the physical address of bounce buffer index
+uint32_t FloppyDriveGetDMABuffer(int index)
 {
-	DMA_BUFFER = addr;
+	return _DMABuffers[index].Address;
+}
+
+// Read ahead into the bounce buffers once the queue runs dry
+void FloppyDriveSetReadAhead(bool enable)
+{
+	_ReadAhead = enable;
+}
+
+// Can the ISA DMA controller transfer length bytes straight into buffer? It has to be
+// physically contiguous, below 16MB and must not cross a 64K boundary.
+// If it can, physical is set to the physical address of the buffer
+static bool FloppyDriveIsDMACapable(uint8_t* buffer, unsigned int length, uint32_t* physical)
+{
+	uint32_t start = VMM_GetPhysicalAddress(buffer);
+	uint32_t last = start + length - 1;
+
+	if (start == 0 || (last >> 24) || (start >> 16) != (last >> 16))
+	{
+		return false;
+	}
+	// Every page after the first has to follow on from the one before it
+	uint32_t offset = 4096 - ((uint32_t)buffer & 0xfff);
+	for (; offset < length; offset += 4096)
+	{
+		if (VMM_GetPhysicalAddress(buffer + offset) != start + offset)
+		{
+			return false;
+		}
+	}
+	*physical = start;
+	return true;
 }
 
 // Basic Controller I/O Routines
@@ -158,18 +361,39 @@ void FloppyDriveWriteToDOR(uint8_t val )
 	HAL_OutputByteToPort(FLPYDSK_DOR, val);
 }
 
-// Send command byte to floppy drive controller
-void FloppyDriveSendCommand(uint8_t cmd) 
+// Send command byte to floppy drive controller.
+// Returns false if the controller never became ready to accept it
+bool FloppyDriveSendCommand(uint8_t cmd) 
+{
+	for (int i = 0; i < FLPY_MSR_TIMEOUT; i++)
+	{
+		if (FloppyDriveReadStatus() & FLPYDSK_MSR_MASK_DATAREG)
+		{
+			HAL_OutputByteToPort(FLPYDSK_FIFO, cmd);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Send the first byte of a command to the controller
+static bool FloppyDriveStartCommand(uint8_t cmd)
 {
-	while (!(FloppyDriveReadStatus() & FLPYDSK_MSR_MASK_DATAREG));
-	HAL_OutputByteToPort(FLPYDSK_FIFO, cmd);
+	_Stats.Commands++;
+	return FloppyDriveSendCommand(cmd);
 }
 
 // Get data from floppy drive controller
 uint8_t FloppyDriveReadData() 
 {
-	while (!(FloppyDriveReadStatus() & FLPYDSK_MSR_MASK_DATAREG));
-	return HAL_InputByteFromPort(FLPYDSK_FIFO);
+	for (int i = 0; i < FLPY_MSR_TIMEOUT; i++)
+	{
+		if (FloppyDriveReadStatus() & FLPYDSK_MSR_MASK_DATAREG)
+		{
+			return HAL_InputByteFromPort(FLPYDSK_FIFO);
+		}
+	}
+	return 0;
 }
 
 //  write to the configuation control register
@@ -180,14 +404,24 @@ void FloppyDriveWriteToCCR(uint8_t val)
 
 //	Interrupt Handling Routines
 
-// Wait for IRQ to fire
-void FloppyDriveWaitForInterrupt() 
+// Wait for IRQ to fire. Returns false if it did not fire in time.
+// Only used while the state machine is idle (i.e. at install time)
+bool FloppyDriveWaitForInterrupt() 
 {
+	uint32_t start = HAL_GetTickCount();
+	uint32_t timeout = start + FLPY_IRQ_TIMEOUT;
 	while (_FloppyDiskIRQ == 0)
 	{
+		if (HAL_GetTickCount() > timeout)
+		{
+			_Stats.WaitTicks += HAL_GetTickCount() - start;
+			return false;
+		}
 		HAL_Sleep(1);
 	}
 	_FloppyDiskIRQ = 0;
+	_Stats.WaitTicks += HAL_GetTickCount() - start;
+	return true;
 }
 
 // Floppy disk IRQ handler
@@ -199,6 +433,15 @@ void I86_FloppyDriveInterruptHandler()
 	// Indicate IRQ fired
 	_FloppyDiskIRQ = 1;
 
+	// Move the request state machine on
+	if (_State != FLPY_STATE_IDLE)
+	{
+		_FloppyDiskIRQ = 0;
+		_InStateMachine = true;
+		FloppyDriveServiceInterrupt();
+		_InStateMachine = false;
+	}
+
 	// Tell HAL we are done
 	HAL_InterruptDone(FLOPPY_IRQ);
 
@@ -213,19 +456,14 @@ void I86_FloppyDriveInterruptHandler()
 // Check interrupt status command
 void FloppyDriveCheckInterruptStatus(uint32_t* st0, uint32_t* cyl) 
 {
-	FloppyDriveSendCommand(FDC_CMD_CHECK_INT);
+	FloppyDriveStartCommand(FDC_CMD_CHECK_INT);
 	*st0 = FloppyDriveReadData();
 	*cyl = FloppyDriveReadData();
 }
 
-// Turn the current floppy drives motor on/off
-void FloppyDriveControlMotor(bool b) 
+// Return the DOR motor bit for the current drive
+static uint8_t FloppyDriveMotorMask()
 {
-	// Sanity check for invalid drive
-	if (_CurrentDrive > 3)
-	{
-		return;
-	}
 	uint8_t motor = 0;
 
 	//! select the correct mask based on current drive
@@ -244,18 +482,80 @@ void FloppyDriveControlMotor(bool b)
 			motor = FLPYDSK_DOR_MASK_DRIVE3_MOTOR;
 			break;
 	}
+	return motor;
+}
+
+// Switch the current drives motor on/off without waiting for it.
+// Returns true if the motor was off and has to spin up
+static bool FloppyDriveSwitchMotor(bool b)
+{
+	bool wasOn = _MotorOn;
 
-	// Turn on or off the motor of that drive
 	if (b)
 	{
-		FloppyDriveWriteToDOR((uint8_t)(_CurrentDrive | motor | FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA));
+		FloppyDriveWriteToDOR((uint8_t)(_CurrentDrive | FloppyDriveMotorMask() | FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA));
 	}
 	else
 	{
-		FloppyDriveWriteToDOR(FLPYDSK_DOR_MASK_RESET);
+		FloppyDriveWriteToDOR((uint8_t)(_CurrentDrive | FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA));
+	}
+	_MotorOn = b;
+	if (b && !wasOn)
+	{
+		_MotorOnSince = HAL_GetTickCount();
+		_Stats.SpinUps++;
+		return true;
+	}
+	if (!b)
+	{
+		// The change line can only be read with the motor on, so nothing read before can be trusted
+		FloppyDriveInvalidateBuffers();
+	}
+	return false;
+}
+
+// Turn the current floppy drives motor on/off. Only waits for the motor
+// when it actually has to spin up
+void FloppyDriveControlMotor(bool b) 
+{
+	// Sanity check for invalid drive
+	if (_CurrentDrive > 3)
+	{
+		return;
+	}
+	if (FloppyDriveSwitchMotor(b))
+	{
+		HAL_Sleep(FLPY_MOTOR_SPINUP_TICKS);
+		_Stats.SleepTicks += FLPY_MOTOR_SPINUP_TICKS;
 	}
-	// In all cases, wait a little bit for the motor to spin up/turn off
-	HAL_Sleep(20);
+}
+
+// Claim the motor for a request, spinning it up if it is not already running
+static void FloppyDriveMotorAcquire()
+{
+	_MotorUsers++;
+	_MotorLastUsed = HAL_GetTickCount();
+	FloppyDriveControlMotor(true);
+}
+
+// Done with the motor. It keeps running until the idle timeout expires
+static void FloppyDriveMotorRelease()
+{
+	_MotorLastUsed = HAL_GetTickCount();
+	if (_MotorUsers > 0)
+	{
+		_MotorUsers--;
+	}
+	if (_MotorUsers == 0 && _MotorIdleTicks == 0)
+	{
+		FloppyDriveSwitchMotor(false);
+	}
+}
+
+// Set how long the motor keeps running after the last request
+void FloppyDriveSetMotorIdleTimeout(uint32_t ticks)
+{
+	_MotorIdleTicks = ticks;
 }
 
 // Configure drive
@@ -263,7 +563,7 @@ void FloppyDriveConfigure(uint8_t stepr, uint8_t loadt, uint8_t unloadt, bool dm
 {
 	uint8_t data = 0;
 
-	FloppyDriveSendCommand(FDC_CMD_SPECIFY);
+	FloppyDriveStartCommand(FDC_CMD_SPECIFY);
 	data = ((stepr & 0xf) << 4) | (unloadt & 0xf);
 	FloppyDriveSendCommand(data);
 	data = (( loadt << 1 ) | ( (dma) ? 0 : 1 ));
@@ -281,10 +581,11 @@ int FloppyDriveCalibrate(uint8_t drive)
 		return -2;
 	}
 	// Turn on the motor
-	FloppyDriveControlMotor(true);
-	for (int i = 0; i < 10; i++) 
+	FloppyDriveMotorAcquire();
+	for (int i = 0; i < FLPY_CALIBRATE_TRIES; i++) 
 	{
-		FloppyDriveSendCommand(FDC_CMD_CALIBRATE);
+		_Stats.Calibrations++;
+		FloppyDriveStartCommand(FDC_CMD_CALIBRATE);
 		FloppyDriveSendCommand( drive );
 		FloppyDriveWaitForInterrupt();
 		FloppyDriveCheckInterruptStatus( &st0, &cyl);
@@ -292,11 +593,13 @@ int FloppyDriveCalibrate(uint8_t drive)
 		// Did we find cylinder 0? if so, we are done
 		if (!cyl) 
 		{
-			FloppyDriveControlMotor(false);
+			_CurrentCylinder = 0;
+			FloppyDriveMotorRelease();
 			return 0;
 		}
 	}
-	FloppyDriveControlMotor(false);
+	_CurrentCylinder = -1;
+	FloppyDriveMotorRelease();
 	return -1;
 }
 
@@ -306,107 +609,912 @@ void FloppyDriveDisableController()
 	FloppyDriveWriteToDOR(0);
 }
 
-//! enable controller
+//! enable controller. Leaves the motor running if it was
 void FloppyDriveEnableController() 
 {
-	FloppyDriveWriteToDOR(FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA);
+	uint8_t motor = _MotorOn ? FloppyDriveMotorMask() : 0;
+	FloppyDriveWriteToDOR((uint8_t)(_CurrentDrive | motor | FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA));
 }
 
-// Reset controller
-void FloppyDriveReset() 
+// Turn on the FIFO and implied seek, and switch off drive polling. Returns false if
+// the controller did not take the command
+static bool FloppyDriveConfigureEnhanced()
+{
+	return FloppyDriveStartCommand(FDC_CMD_CONFIGURE) &&
+		   FloppyDriveSendCommand(0) &&
+		   FloppyDriveSendCommand(FDC_CONFIG_IMPLIED_SEEK | FDC_CONFIG_POLL_DISABLE | ((FLPY_FIFO_THRESHOLD - 1) & 0xf)) &&
+		   // Write precompensation starts at track 0
+		   FloppyDriveSendCommand(0);
+}
+
+// Find out if the controller supports the 82077AA enhanced commands and, if it does,
+// configure the FIFO and implied seek and lock the settings. Older controllers are left
+// as they are and the driver seeks explicitly
+static void FloppyDriveDetectController()
+{
+	_Enhanced = false;
+	_ImpliedSeek = false;
+	_Locked = false;
+
+	if (!FloppyDriveStartCommand(FDC_CMD_VERSION) || FloppyDriveReadData() != FDC_VERSION_82077AA)
+	{
+		return;
+	}
+	if (!FloppyDriveConfigureEnhanced())
+	{
+		return;
+	}
+	_Enhanced = true;
+	_ImpliedSeek = true;
+
+	// LOCK returns the new lock bit in bit 4
+	if (FloppyDriveStartCommand(FDC_CMD_LOCK | FDC_CMD_EXT_LOCK))
+	{
+		_Locked = (FloppyDriveReadData() & 0x10) != 0;
+	}
+}
+
+// Second half of a controller reset, once its IRQ has fired. Clears the pending
+// interrupts and reprograms the data rate and drive timings
+static void FloppyDriveFinishReset()
 {
 	uint32_t st0;
 	uint32_t cyl;
 
-	FloppyDriveDisableController();
-	FloppyDriveEnableController();
-	FloppyDriveWaitForInterrupt();
+	_Stats.Resets++;
 
 	// Send CHECK_INT/SENSE INTERRUPT command to all drives
 	for (int i=0; i<4; i++)
 	{
 		FloppyDriveCheckInterruptStatus(&st0,&cyl);
 	}
-	// Transfer speed 500kb/s
-	FloppyDriveWriteToCCR(0);
+	// Transfer speed for the disk in the drive
+	FloppyDriveWriteToCCR(_DataRate);
 
 	// Pass mechanical drive info. steprate=3ms, unload time=240ms, load time=16ms
 	FloppyDriveConfigure(3,16,240,true);
 
+	// A reset clears CONFIGURE unless it was locked
+	if (_Enhanced && !_Locked && !FloppyDriveConfigureEnhanced())
+	{
+		_ImpliedSeek = false;
+	}
+}
+
+// Reset controller
+void FloppyDriveReset() 
+{
+	FloppyDriveDisableController();
+	FloppyDriveEnableController();
+	FloppyDriveWaitForInterrupt();
+	FloppyDriveFinishReset();
+
 	//! calibrate the disk
 	FloppyDriveCalibrate( _CurrentDrive );
 }
 
-// Read a sector
-void FloppyDriveReadSectorHTS(uint8_t head, uint8_t track, uint8_t sector) 
+// Convert LBA to CHS
+void FloppyDriveLBAToCHS(int lba,int *head,int *track,int *sector) 
 {
-	uint32_t st0;
-	uint32_t cyl;
+	if (_ChsTable && lba >= 0 && lba < _TotalSectors)
+	{
+		uint16_t chs = _ChsTable[lba];
+		*head = (chs >> FLPY_CHS_HEAD_SHIFT) & 1;
+		*track = chs >> FLPY_CHS_CYLINDER_SHIFT;
+		*sector = chs & FLPY_CHS_SECTOR_MASK;
+		return;
+	}
+	*head = (lba % _CylinderSectors) / _SectorsPerTrack;
+	*track = lba / _CylinderSectors;
+	*sector = lba % _SectorsPerTrack + 1;
+}
+
+// Switch to a new geometry. Rebuilds the LBA to CHS table, walking the disk in order so
+// there is not a single divide in it
+static void FloppyDriveSetGeometry(int sectorsPerTrack, int heads, int cylinders)
+{
+	_SectorsPerTrack = sectorsPerTrack;
+	_Heads = heads;
+	_Cylinders = cylinders;
+	_CylinderSectors = sectorsPerTrack * heads;
+	_TotalSectors = _CylinderSectors * cylinders;
+	_BlockDevice.SectorCount = _TotalSectors;
+
+	// DMF squeezes 21 sectors onto a track by shrinking the gap between them
+	if (sectorsPerTrack == 21)
+	{
+		_Gap3 = FLPYDSK_GAP3_LENGTH_DMF;
+	}
+	else if (sectorsPerTrack >= 18)
+	{
+		_Gap3 = FLPYDSK_GAP3_LENGTH_3_5;
+	}
+	else
+	{
+		_Gap3 = FLPYDSK_GAP3_LENGTH_STD;
+	}
+
+	if (_ChsTable)
+	{
+		int lba = 0;
+		for (int cylinder = 0; cylinder < cylinders; cylinder++)
+		{
+			for (int head = 0; head < heads; head++)
+			{
+				for (int sector = 1; sector <= sectorsPerTrack; sector++)
+				{
+					_ChsTable[lba++] = (uint16_t)(cylinder << FLPY_CHS_CYLINDER_SHIFT | head << FLPY_CHS_HEAD_SHIFT | sector);
+				}
+			}
+		}
+	}
+	FloppyDriveInvalidateBuffers();
+}
+
+//	Request State Machine
+//
+//	Requests are queued by FloppyDriveSubmit and picked off the queue in C-SCAN order, along
+//	with any requests for the sectors that follow them. Each such batch is broken into runs
+//	that fit in one cylinder, and each run goes through SEEK -> READ. Every command is started
+//	from the floppy IRQ (or the timer, for motor spin-up and head settle delays) that
+//	ended the previous one, so nothing waits on the controller in a loop.
+//
+//	Runs that do not go straight into the requester's buffer go through one of the
+//	FLPY_DMA_BUFFER_COUNT bounce buffers. When a run finishes, the next run (or, once the
+//	queue is empty, a read-ahead of the following cylinder) is started into another bounce
+//	buffer before the finished one is copied out, so the disk keeps turning while the CPU
+//	copies. Later requests for sectors still held in a bounce buffer are served from memory.
+
+// Wait for the floppy IRQ, or give up on it after FLPY_IRQ_TIMEOUT ticks
+static void FloppyDriveExpectInterrupt(FloppyState state)
+{
+	_State = state;
+	_WaitStart = HAL_GetTickCount();
+	_Deadline = _WaitStart + FLPY_IRQ_TIMEOUT;
+}
+
+// Wait for the timer for the given number of ticks
+static void FloppyDriveDelay(FloppyState state, uint32_t ticks)
+{
+	_State = state;
+	_WaitStart = HAL_GetTickCount();
+	_Deadline = _WaitStart + ticks;
+}
+
+// Start a controller reset. The IRQ it raises continues in FLPY_STATE_RESET
+static void FloppyDriveIssueReset()
+{
+	_CurrentCylinder = -1;
+	FloppyDriveExpectInterrupt(FLPY_STATE_RESET);
+	FloppyDriveDisableController();
+	FloppyDriveEnableController();
+}
+
+// Start moving the head back to cylinder 0
+static void FloppyDriveIssueCalibrate()
+{
+	_Stats.Calibrations++;
+	FloppyDriveExpectInterrupt(FLPY_STATE_CALIBRATE);
+	if (!FloppyDriveStartCommand(FDC_CMD_CALIBRATE) ||
+		!FloppyDriveSendCommand(_CurrentDrive))
+	{
+		FloppyDriveRunFailed();
+	}
+}
+
+// Start moving the head to cylinder
+static void FloppyDriveIssueSeek(int cylinder)
+{
+	_SeekTarget = cylinder;
+	FloppyDriveExpectInterrupt(FLPY_STATE_SEEK);
+	if (!FloppyDriveStartCommand(FDC_CMD_SEEK) ||
+		!FloppyDriveSendCommand((uint8_t)(_RunHead << 2 | _CurrentDrive)) ||
+		!FloppyDriveSendCommand((uint8_t)cylinder))
+	{
+		FloppyDriveRunFailed();
+	}
+}
 
-	// Initialize DMA
-	FloppyDriveDMAInitialise((uint8_t*)DMA_BUFFER, 512 );
+// Start reading the current run. With the multitrack bit set the controller carries on
+// from the last sector of head 0 onto head 1, so a single command can transfer anything
+// up to a full cylinder. The DMA terminal count ends the transfer.
+static void FloppyDriveIssueRead()
+{
+	if (!FloppyDriveDMAInitialise((uint8_t*)_RunPhysical, _RunCount * FLPY_BYTES_PER_SECTOR))
+	{
+		FloppyDriveRunFailed();
+		return;
+	}
 
 	// Set the DMA for read transfer
 	DMA_SetRead(FDC_DMA_CHANNEL);
-	
-	// Read in a sector
-	FloppyDriveSendCommand(FDC_CMD_READ_SECT | FDC_CMD_EXT_MULTITRACK | FDC_CMD_EXT_SKIP | FDC_CMD_EXT_DENSITY);
-	FloppyDriveSendCommand(head << 2 | _CurrentDrive);
-	FloppyDriveSendCommand(track);
-	FloppyDriveSendCommand(head);
-	FloppyDriveSendCommand(sector);
-	FloppyDriveSendCommand(FLPYDSK_SECTOR_DTL_512 );
-	uint8_t endSector = sector + 1;
-	if (endSector >= FLPY_SECTORS_PER_TRACK)
-	{
-		endSector = FLPY_SECTORS_PER_TRACK; 
-	}
-	FloppyDriveSendCommand(endSector);
-	FloppyDriveSendCommand(FLPYDSK_GAP3_LENGTH_3_5 );
-	FloppyDriveSendCommand(0xff);
-	FloppyDriveWaitForInterrupt();
-	
-	// Read status info
+
+	FloppyDriveExpectInterrupt(FLPY_STATE_READ);
+	// The data rate goes with the disk, and a reset sets it back, so set it every time
+	FloppyDriveWriteToCCR(_DataRate);
+
+	bool sent = FloppyDriveStartCommand(FDC_CMD_READ_SECT | FDC_CMD_EXT_MULTITRACK | FDC_CMD_EXT_SKIP | FDC_CMD_EXT_DENSITY) &&
+				FloppyDriveSendCommand((uint8_t)(_RunHead << 2 | _CurrentDrive)) &&
+				FloppyDriveSendCommand((uint8_t)_RunTrack) &&
+				FloppyDriveSendCommand((uint8_t)_RunHead) &&
+				FloppyDriveSendCommand((uint8_t)_RunSector) &&
+				FloppyDriveSendCommand(FLPYDSK_SECTOR_DTL_512) &&
+				// End of track is always the last sector, the DMA count stops the transfer early
+				FloppyDriveSendCommand((uint8_t)_SectorsPerTrack) &&
+				FloppyDriveSendCommand(_Gap3) &&
+				FloppyDriveSendCommand(0xff);
+	if (!sent)
+	{
+		FloppyDriveRunFailed();
+	}
+}
+
+// Read the change line of the current drive, which is only valid while its motor is on.
+// The first time the line is seen set, everything read from the old disk is dropped and
+// the media generation goes up. Returns true if the line is set
+static bool FloppyDriveCheckChangeLine()
+{
+	if (!(HAL_InputByteFromPort(FLPYDSK_DIR) & FLPYDSK_DIR_MASK_CHANGE))
+	{
+		_ChangeNoticed = false;
+		_ChangeStepped = false;
+		return false;
+	}
+	if (!_ChangeNoticed)
+	{
+		_ChangeNoticed = true;
+		_MediaGeneration++;
+		_Stats.MediaChanges++;
+		FloppyDriveInvalidateBuffers();
+		_ReadAheadLBA = 0;
+	}
+	return true;
+}
+
+// The change line is set. Only a step pulse clears it, so move the head one cylinder and
+// come back through FloppyDrivePositionAndRead. If the line is still set after that, there
+// is no disk in the drive
+static void FloppyDriveClearChangeLine()
+{
+	if (_ChangeStepped)
+	{
+		// Fail for good. The next run steps again, in case a disk has gone in since,
+		// and that counts as another change
+		_ChangeStepped = false;
+		_ChangeNoticed = false;
+		_Retries = FLPY_MAX_RETRIES;
+		FloppyDriveRunFailed();
+		return;
+	}
+	_ChangeStepped = true;
+	_Stats.Seeks++;
+	_Stats.SeekDistance++;
+	FloppyDriveIssueSeek(_CurrentCylinder > 0 ? _CurrentCylinder - 1 : 1);
+}
+
+// Get the head over the cylinder of the current run, then read it
+static void FloppyDrivePositionAndRead()
+{
+	if (_CurrentCylinder < 0)
+	{
+		// We don't know where the head is
+		_CalibrateTries = 0;
+		FloppyDriveIssueCalibrate();
+	}
+	else if (FloppyDriveCheckChangeLine())
+	{
+		FloppyDriveClearChangeLine();
+	}
+	else if (_CurrentCylinder != _RunTrack)
+	{
+		_Stats.Seeks++;
+		_Stats.SeekDistance += (_CurrentCylinder > _RunTrack) ? _CurrentCylinder - _RunTrack : _RunTrack - _CurrentCylinder;
+		if (_ImpliedSeek)
+		{
+			// The controller seeks to the cylinder in the READ command and waits for the head to settle
+			// itself. If the read fails the reset in between retries loses track of the head anyway
+			_CurrentCylinder = _RunTrack;
+			FloppyDriveIssueRead();
+		}
+		else
+		{
+			FloppyDriveIssueSeek(_RunTrack);
+		}
+	}
+	else
+	{
+		// Head is already there. The READ command selects the head itself
+		FloppyDriveIssueRead();
+	}
+}
+
+// Return the index of the bounce buffer holding sector lba, or -1 if none does
+static int FloppyDriveFindBuffer(int lba)
+{
+	for (int i = 0; i < FLPY_DMA_BUFFER_COUNT; i++)
+	{
+		if (_DMABuffers[i].Count > 0 && lba >= _DMABuffers[i].SectorLBA &&
+			lba < _DMABuffers[i].SectorLBA + _DMABuffers[i].Count)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Forget everything held in the bounce buffers
+static void FloppyDriveInvalidateBuffers()
+{
+	for (int i = 0; i < FLPY_DMA_BUFFER_COUNT; i++)
+	{
+		_DMABuffers[i].Count = 0;
+	}
+}
+
+// Start a hardware run of up to count sectors from lba. The run is clipped to the end of
+// the cylinder. A read-ahead run is not part of any request and always lands in a bounce buffer
+static void FloppyDriveStartRun(int lba, int count, bool readAhead)
+{
+	FloppyDriveLBAToCHS(lba, &_RunHead, &_RunTrack, &_RunSector);
+
+	// Clip the run to what is left of this cylinder (both heads)
+	int remaining = _SectorsPerTrack * (_Heads - _RunHead) - (_RunSector - 1);
+	_RunLBA = lba;
+	_RunCount = count > remaining ? remaining : count;
+	_RunIsReadAhead = readAhead;
+
+	// If the whole run belongs to one request and its buffer is DMA capable, the controller
+	// can transfer straight into it. Otherwise it goes through a bounce buffer
+	_RunBuffer = -1;
+	FloppyRequest* request = readAhead ? 0 : _ActiveRequest;
+	while (request && request->SectorLBA + request->Count <= lba)
+	{
+		request = request->Next;
+	}
+	if (!request || lba + _RunCount > request->SectorLBA + request->Count ||
+		!FloppyDriveIsDMACapable(request->Buffer + (lba - request->SectorLBA) * FLPY_BYTES_PER_SECTOR,
+								 _RunCount * FLPY_BYTES_PER_SECTOR, &_RunPhysical))
+	{
+		// Never reuse the buffer filled last, it may still be waiting to be copied out
+		_RunBuffer = (_LastFilled + 1) % FLPY_DMA_BUFFER_COUNT;
+		_DMABuffers[_RunBuffer].Count = 0;
+		_RunPhysical = _DMABuffers[_RunBuffer].Address;
+	}
+
+	// Hold the motor for as long as the driver has work, and make sure it is up to speed
+	if (!_HoldingMotor)
+	{
+		_HoldingMotor = true;
+		_MotorUsers++;
+	}
+	_MotorLastUsed = HAL_GetTickCount();
+	FloppyDriveSwitchMotor(true);
+	uint32_t running = _MotorLastUsed - _MotorOnSince;
+	if (running < FLPY_MOTOR_SPINUP_TICKS)
+	{
+		// Still coming up to speed. It may only just have been started to read the change line
+		FloppyDriveDelay(FLPY_STATE_SPINUP, FLPY_MOTOR_SPINUP_TICKS - running);
+	}
+	else if (_ResetMode == FLPY_RESET_ALWAYS && !readAhead)
+	{
+		FloppyDriveIssueReset();
+	}
+	else
+	{
+		FloppyDrivePositionAndRead();
+	}
+}
+
+// Finish the request at the front of the active batch
+static void FloppyDriveCompleteRequest(int status)
+{
+	FloppyRequest* request = _ActiveRequest;
+
+	_ActiveRequest = request->Next;
+	request->Next = 0;
+	request->Status = status;
+	if (request->Completion)
+	{
+		request->Completion(request);
+	}
+}
+
+// Hand count sectors starting at lba to the requests in the active batch and complete any that
+// are now full. source is where the data is, or 0 if it was DMAed straight into the requester's buffer
+static void FloppyDriveDeliver(int lba, int count, uint8_t* source)
+{
+	// Requests in a batch are contiguous and in LBA order, so the data is shared out front to back
+	int end = lba + count;
+	for (FloppyRequest* request = _ActiveRequest; request && request->SectorLBA < end; request = request->Next)
+	{
+		int from = request->SectorLBA + request->Transferred;
+		int to = request->SectorLBA + request->Count;
+		if (to > end)
+		{
+			to = end;
+		}
+		if (from >= lba && from < to)
+		{
+			if (source)
+			{
+				memcpy(request->Buffer + request->Transferred * FLPY_BYTES_PER_SECTOR,
+					   source + (from - lba) * FLPY_BYTES_PER_SECTOR,
+					   (to - from) * FLPY_BYTES_PER_SECTOR);
+			}
+			request->Transferred += to - from;
+		}
+	}
+	while (_ActiveRequest && _ActiveRequest->Transferred >= _ActiveRequest->Count)
+	{
+		FloppyDriveCompleteRequest(FLPY_REQUEST_DONE);
+	}
+}
+
+// Start reading ahead into a bounce buffer from where the last run ended, if that is worth
+// doing. Returns true if a run was started
+static bool FloppyDriveStartReadAhead()
+{
+	if (!_ReadAhead || _Probing || _ReadAheadLBA <= 0 || _ReadAheadLBA >= _TotalSectors ||
+		FloppyDriveFindBuffer(_ReadAheadLBA) >= 0)
+	{
+		return false;
+	}
+	FloppyDriveStartRun(_ReadAheadLBA, _TotalSectors - _ReadAheadLBA, true);
+	return true;
+}
+
+// Keep the drive busy. Serves what it can of the active batch from the bounce buffers, then
+// starts the next hardware run of the batch, or takes the next batch off the queue. Once the
+// queue is empty it starts a read-ahead, and releases the motor if there is nothing left to do.
+// Only called when no command is in progress
+static void FloppyDriveContinue()
+{
+	while (_State == FLPY_STATE_IDLE)
+	{
+		if (_ActiveRequest)
+		{
+			// The bounce buffers only survive while the motor is on, and then the change line
+			// says whether they still hold what is on the disk
+			if (_MotorOn)
+			{
+				FloppyDriveCheckChangeLine();
+			}
+			int lba = _BatchLBA + _BatchDone;
+			int buffer = FloppyDriveFindBuffer(lba);
+			if (buffer < 0)
+			{
+				FloppyDriveStartRun(lba, _BatchCount - _BatchDone, false);
+				continue;
+			}
+			// Already have it
+			FloppyDMABuffer* dmaBuffer = &_DMABuffers[buffer];
+			int count = dmaBuffer->SectorLBA + dmaBuffer->Count - lba;
+			if (count > _BatchCount - _BatchDone)
+			{
+				count = _BatchCount - _BatchDone;
+			}
+			_BatchDone += count;
+			_ReadAheadLBA = lba + count;
+			_Stats.BufferHits += count;
+			FloppyDriveDeliver(lba, count, (uint8_t*)dmaBuffer->Address + (lba - dmaBuffer->SectorLBA) * FLPY_BYTES_PER_SECTOR);
+			continue;
+		}
+		if (FloppyDriveStartNext() || FloppyDriveStartReadAhead())
+		{
+			continue;
+		}
+
+		// Nothing left to do
+		if (_HoldingMotor)
+		{
+			_HoldingMotor = false;
+			FloppyDriveMotorRelease();
+		}
+		return;
+	}
+}
+
+// Give up on the requests in the active batch
+static void FloppyDriveFailBatch()
+{
+	while (_ActiveRequest)
+	{
+		FloppyDriveCompleteRequest(FLPY_REQUEST_ERROR);
+	}
+}
+
+// Something went wrong with the current run. Reset the controller and try the run
+// again, or fail the batch once it has used up its retries. A failed read-ahead is just dropped
+static void FloppyDriveRunFailed()
+{
+	if (_RunIsReadAhead || _Probing || ++_Retries > FLPY_MAX_RETRIES)
+	{
+		_Stats.Errors++;
+		// Leave the controller in a known state for whoever is next
+		_CurrentCylinder = -1;
+		_State = FLPY_STATE_IDLE;
+		if (!_RunIsReadAhead)
+		{
+			FloppyDriveFailBatch();
+		}
+		_ReadAheadLBA = 0;
+		_Retries = 0;
+		_ChangeStepped = false;
+		FloppyDriveContinue();
+		return;
+	}
+	_Stats.Retries++;
+	FloppyDriveIssueReset();
+}
+
+// The READ result phase has been reached. Check the result, start the next transfer and
+// hand the data to the requests in the batch
+static void FloppyDriveFinishRead()
+{
+	uint8_t status[7];
+
+	// READ has its own result phase, so no SENSE INTERRUPT is needed
 	for (int j=0; j<7; j++)
 	{
-		FloppyDriveReadData();
+		status[j] = FloppyDriveReadData();
+	}
+	if ((status[0] >> 6) != FLPYDSK_ST0_TYP_NORMAL)
+	{
+		FloppyDriveRunFailed();
+		return;
+	}
+	_State = FLPY_STATE_IDLE;
+	_Retries = 0;
+
+	int lba = _RunLBA;
+	int count = _RunCount;
+	_Stats.Sectors += count;
+	uint8_t* source = 0;
+	if (_RunBuffer >= 0)
+	{
+		_DMABuffers[_RunBuffer].SectorLBA = lba;
+		_DMABuffers[_RunBuffer].Count = count;
+		_LastFilled = _RunBuffer;
+		source = (uint8_t*)_DMABuffers[_RunBuffer].Address;
+	}
+	_ReadAheadLBA = lba + count;
+	if (_RunIsReadAhead)
+	{
+		FloppyDriveContinue();
+		return;
+	}
+	_BatchDone += count;
+
+	// Get the disk going on the next part of the batch (or a read-ahead, if nothing else is
+	// waiting) before spending time copying this run out
+	if (_BatchDone < _BatchCount)
+	{
+		if (FloppyDriveFindBuffer(_BatchLBA + _BatchDone) < 0)
+		{
+			FloppyDriveStartRun(_BatchLBA + _BatchDone, _BatchCount - _BatchDone, false);
+		}
+	}
+	else if (!_QueueHead)
+	{
+		FloppyDriveStartReadAhead();
+	}
+
+	FloppyDriveDeliver(lba, count, source);
+	if (_State == FLPY_STATE_IDLE)
+	{
+		FloppyDriveContinue();
+	}
+}
+
+// Remove a request from the pending queue
+static void FloppyDriveUnqueue(FloppyRequest* request, FloppyRequest* previous)
+{
+	if (previous)
+	{
+		previous->Next = request->Next;
+	}
+	else
+	{
+		_QueueHead = request->Next;
+	}
+	if (_QueueTail == request)
+	{
+		_QueueTail = previous;
+	}
+	request->Next = 0;
+}
+
+// Choose the next request to serve. Pending requests are served in C-SCAN order: the
+// first request at or beyond the last sector read, wrapping round to the lowest sector
+// once the head has swept to the end of the disk. LBA order is cylinder/head/sector
+// order, so sorting on LBA sorts on cylinder. A request that has been passed over
+// FLPY_SCHEDULER_MAX_BYPASS times is served next regardless of where it is.
+static FloppyRequest* FloppyDriveSchedule()
+{
+	FloppyRequest* chosen = 0;
+	FloppyRequest* chosenPrevious = 0;
+	FloppyRequest* lowest = 0;
+	FloppyRequest* lowestPrevious = 0;
+	FloppyRequest* previous = 0;
+
+	for (FloppyRequest* request = _QueueHead; request; previous = request, request = request->Next)
+	{
+		if (request->Bypassed >= FLPY_SCHEDULER_MAX_BYPASS)
+		{
+			// The queue is in arrival order, so this is the oldest starved request
+			chosen = request;
+			chosenPrevious = previous;
+			_Stats.Starved++;
+			break;
+		}
+		if (request->SectorLBA >= _ScanPosition &&
+			(!chosen || request->SectorLBA < chosen->SectorLBA))
+		{
+			chosen = request;
+			chosenPrevious = previous;
+		}
+		if (!lowest || request->SectorLBA < lowest->SectorLBA)
+		{
+			lowest = request;
+			lowestPrevious = previous;
+		}
+	}
+	if (!chosen)
+	{
+		// Nothing further up the disk. Sweep back to the start
+		chosen = lowest;
+		chosenPrevious = lowestPrevious;
+	}
+	if (!chosen)
+	{
+		return 0;
+	}
+
+	// Everything that arrived before the chosen request has been passed over
+	for (FloppyRequest* request = _QueueHead; request != chosen; request = request->Next)
+	{
+		request->Bypassed++;
+	}
+	FloppyDriveUnqueue(chosen, chosenPrevious);
+	return chosen;
+}
+
+// Pull any pending requests that carry on where the batch ends into the batch,
+// so they are read by the same commands
+static void FloppyDriveMergeRequests(FloppyRequest* last)
+{
+	bool merged = true;
+	while (merged)
+	{
+		merged = false;
+		FloppyRequest* previous = 0;
+		for (FloppyRequest* request = _QueueHead; request; previous = request, request = request->Next)
+		{
+			if (request->SectorLBA == _BatchLBA + _BatchCount)
+			{
+				FloppyDriveUnqueue(request, previous);
+				last->Next = request;
+				last = request;
+				_BatchCount += request->Count;
+				_Stats.Merged++;
+				merged = true;
+				break;
+			}
+		}
+	}
+}
+
+// Take the next batch of requests off the queue and make it the active batch.
+// Returns false if the queue is empty
+static bool FloppyDriveStartNext()
+{
+	FloppyRequest* request = FloppyDriveSchedule();
+	if (!request)
+	{
+		return false;
 	}
-	// Let FDC know we handled interrupt
-	FloppyDriveCheckInterruptStatus(&st0,&cyl);
+	_ActiveRequest = request;
+	_BatchLBA = request->SectorLBA;
+	_BatchCount = request->Count;
+	_BatchDone = 0;
+	FloppyDriveMergeRequests(request);
+	_ScanPosition = _BatchLBA + _BatchCount;
+	_Retries = 0;
+	return true;
 }
 
-// Seek to given track/cylinder
-int FloppyDriveSeek(uint8_t cyl, uint8_t head) 
+// Called from the floppy IRQ while a request is in progress
+void FloppyDriveServiceInterrupt()
 {
 	uint32_t st0;
-	uint32_t cyl0;
+	uint32_t cyl;
+
+	_Stats.WaitTicks += HAL_GetTickCount() - _WaitStart;
+	switch (_State)
+	{
+		case FLPY_STATE_RESET:
+			FloppyDriveFinishReset();
+			_CalibrateTries = 0;
+			FloppyDriveIssueCalibrate();
+			break;
+
+		case FLPY_STATE_CALIBRATE:
+			FloppyDriveCheckInterruptStatus(&st0, &cyl);
+			if (cyl == 0)
+			{
+				_CurrentCylinder = 0;
+				FloppyDrivePositionAndRead();
+			}
+			else if (++_CalibrateTries < FLPY_CALIBRATE_TRIES)
+			{
+				FloppyDriveIssueCalibrate();
+			}
+			else
+			{
+				FloppyDriveRunFailed();
+			}
+			break;
+
+		case FLPY_STATE_SEEK:
+			FloppyDriveCheckInterruptStatus(&st0, &cyl);
+			if (cyl == (uint32_t)_SeekTarget)
+			{
+				// Give the head time to settle
+				_CurrentCylinder = _SeekTarget;
+				FloppyDriveDelay(FLPY_STATE_SETTLE, FLPY_HEAD_SETTLE_TICKS);
+			}
+			else
+			{
+				_CurrentCylinder = -1;
+				FloppyDriveRunFailed();
+			}
+			break;
+
+		case FLPY_STATE_READ:
+			FloppyDriveFinishRead();
+			break;
+
+		default:
+			// Not expecting an IRQ here. Ignore it
+			break;
+	}
+}
+
+// Called on every timer tick. Ends the delay states, times out lost IRQs and
+// switches the motor off once it has been idle long enough
+static void FloppyDriveTick(uint32_t tickCount)
+{
+	if (_State != FLPY_STATE_IDLE && tickCount >= _Deadline)
+	{
+		_InStateMachine = true;
+		if (_State == FLPY_STATE_SPINUP || _State == FLPY_STATE_SETTLE)
+		{
+			_Stats.SleepTicks += tickCount - _WaitStart;
+		}
+		else
+		{
+			_Stats.WaitTicks += tickCount - _WaitStart;
+		}
+		switch (_State)
+		{
+			case FLPY_STATE_SPINUP:
+				if (_ResetMode == FLPY_RESET_ALWAYS && !_RunIsReadAhead)
+				{
+					FloppyDriveIssueReset();
+				}
+				else
+				{
+					FloppyDrivePositionAndRead();
+				}
+				break;
+
+			case FLPY_STATE_SETTLE:
+				// Normally the head is now over the run. After the step that clears the change
+				// line it still has to go there
+				FloppyDrivePositionAndRead();
+				break;
+
+			default:
+				// The IRQ we were waiting for never came
+				FloppyDriveRunFailed();
+				break;
+		}
+		_InStateMachine = false;
+	}
+
+	if (_MotorOn && _MotorUsers == 0 && _MotorIdleTicks != 0 &&
+		tickCount - _MotorLastUsed >= _MotorIdleTicks)
+	{
+		FloppyDriveSwitchMotor(false);
+	}
+}
 
-	if (_CurrentDrive >= 4)
+// Queue a request. The completion routine is called (from interrupt context) once the
+// request has finished, with request->Status set to FLPY_REQUEST_DONE or FLPY_REQUEST_ERROR.
+// Returns 0 if the request was queued
+int FloppyDriveSubmit(FloppyRequest* request, FloppyCompletion completion)
+{
+	if (!request || !request->Buffer || request->Count <= 0 || _CurrentDrive >= 4 ||
+		request->SectorLBA < 0 || request->SectorLBA + request->Count > _TotalSectors)
 	{
 		return -1;
 	}
-	for (int i = 0; i < 10; i++ ) 
+	request->Completion = completion;
+	request->Status = FLPY_REQUEST_PENDING;
+	request->Transferred = 0;
+	request->Bypassed = 0;
+	request->Next = 0;
+
+	// The queue is shared with the interrupt handlers. If we are being called from a
+	// completion routine we are already inside one, interrupts are off and the state
+	// machine will pick the request up when it moves on
+	bool inInterrupt = _InStateMachine;
+	if (!inInterrupt)
 	{
-		FloppyDriveSendCommand(FDC_CMD_SEEK);
-		FloppyDriveSendCommand((head) << 2 | _CurrentDrive);
-		FloppyDriveSendCommand(cyl);
-		FloppyDriveWaitForInterrupt();
-		FloppyDriveCheckInterruptStatus(&st0,&cyl0);
-		if (cyl0 == cyl)
+		HAL_DisableInterrupts();
+	}
+	if (_QueueTail)
+	{
+		_QueueTail->Next = request;
+	}
+	else
+	{
+		_QueueHead = request;
+	}
+	_QueueTail = request;
+	if (!inInterrupt)
+	{
+		if (_State == FLPY_STATE_IDLE)
 		{
-			// We have found the cylinder
-			return 0;
+			// Requests served from the bounce buffers complete here, so behave as the interrupt handlers do
+			_InStateMachine = true;
+			FloppyDriveContinue();
+			_InStateMachine = false;
 		}
+		HAL_EnableInterrupts();
 	}
-	return -1;
+	return 0;
 }
 
-// Convert LBA to CHS
-void FloppyDriveLBAToCHS(int lba,int *head,int *track,int *sector) 
+// Submit a request and wait for it to finish. Returns true if it succeeded
+static bool FloppyDriveSubmitAndWait(FloppyRequest* request)
 {
-   *head = (lba % (FLPY_SECTORS_PER_TRACK * 2 )) / (FLPY_SECTORS_PER_TRACK);
-   *track = lba / (FLPY_SECTORS_PER_TRACK * 2 );
-   *sector = lba % FLPY_SECTORS_PER_TRACK + 1;
+	if (FloppyDriveSubmit(request, 0) != 0)
+	{
+		return false;
+	}
+	// Sleep between IRQs rather than spin. Interrupts are off while the status is checked,
+	// so the IRQ that completes the request cannot slip in between the check and the halt
+	HAL_DisableInterrupts();
+	while (request->Status == FLPY_REQUEST_PENDING)
+	{
+		HAL_WaitForInterrupt();
+		HAL_DisableInterrupts();
+	}
+	HAL_EnableInterrupts();
+	return request->Status == FLPY_REQUEST_DONE;
+}
+
+// Block device read. FloppyDriveReadSectors stops at the end of the cylinder, the
+// block device layer comes back for the rest
+static int FloppyDriveBlockRead(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	(void)device;
+	return FloppyDriveReadSectors((int)lba, (int)count, buffer);
+}
+
+// Block device media generation
+static uint32_t FloppyDriveBlockMediaGeneration(BlockDevice* device)
+{
+	(void)device;
+	return FloppyDriveGetMediaGeneration();
+}
+
+// Block device revalidate, before the disk is mounted
+static int FloppyDriveBlockRevalidate(BlockDevice* device)
+{
+	(void)device;
+	return FloppyDriveRevalidate() ? 0 : -1;
 }
 
 // Install floppy driver
@@ -418,6 +1526,55 @@ void FloppyDriveInstall(int irq)
 	FloppyDriveReset();
 	// Set drive information
 	FloppyDriveConfigure(13, 1, 0xf, true);
+	// Use the FIFO and implied seeks if the controller has them
+	FloppyDriveDetectController();
+	// Bounce buffers for DMA transfers, from memory the DMA controller can reach
+	uint32_t blocks = (FLPY_DMA_BUFFER_SIZE + PMM_GetBlockSize() - 1) / PMM_GetBlockSize();
+	for (int i = 0; i < FLPY_DMA_BUFFER_COUNT; i++)
+	{
+		if (_DMABuffers[i].Address == 0)
+		{
+			_DMABuffers[i].Address = (uint32_t)PMM_AllocateDmaBlocks(blocks);
+		}
+		_DMABuffers[i].Count = 0;
+	}
+	// The timer drives the request state machine and switches the motor off once the drive goes idle
+	HAL_AddTickHandler(FloppyDriveTick);
+
+	// Make the drive available to the file system. The driver does not write yet
+	_BlockDevice.Name = "fd0";
+	_BlockDevice.SectorSize = FLPY_BYTES_PER_SECTOR;
+	_BlockDevice.SectorCount = _TotalSectors;
+	_BlockDevice.QueueDepth = 1;
+	_BlockDevice.Read = FloppyDriveBlockRead;
+	_BlockDevice.Write = 0;
+	_BlockDevice.Flush = 0;
+	_BlockDevice.Submit = 0;
+	_BlockDevice.Poll = 0;
+	_BlockDevice.MediaGeneration = FloppyDriveBlockMediaGeneration;
+	_BlockDevice.Revalidate = FloppyDriveBlockRevalidate;
+	_BlockDevice.Private = 0;
+	BlockDevice_Register(&_BlockDevice);
+
+	// Work out the geometry of the disk in the drive
+	if (!_ChsTable)
+	{
+		uint32_t tableBlocks = (FLPY_MAX_SECTORS * sizeof(uint16_t) + PMM_GetBlockSize() - 1) / PMM_GetBlockSize();
+		_ChsTable = (uint16_t*)PMM_AllocateBlocks(tableBlocks);
+		if (_ChsTable && !VMM_IdentityMapRange(_ChsTable, tableBlocks * PMM_GetBlockSize()))
+		{
+			PMM_FreeBlocks(_ChsTable, tableBlocks);
+			_ChsTable = 0;
+		}
+	}
+	FloppyDriveSetGeometry(_SectorsPerTrack, _Heads, _Cylinders);
+	FloppyDriveDetectGeometry();
+}
+
+// Return the drive's block device
+BlockDevice* FloppyDriveGetBlockDevice()
+{
+	return &_BlockDevice;
 }
 
 // Set current working drive
@@ -435,33 +1592,163 @@ uint8_t FloppyDriveGetWorkingDrive()
 	return _CurrentDrive;
 }
 
-// read a sector
+// Return the performance counters
+void FloppyDriveGetStats(FloppyDriveStats* stats)
+{
+	HAL_DisableInterrupts();
+	*stats = _Stats;
+	HAL_EnableInterrupts();
+}
+
+// Set all the performance counters back to zero
+void FloppyDriveResetStats()
+{
+	HAL_DisableInterrupts();
+	memset(&_Stats, 0, sizeof(_Stats));
+	HAL_EnableInterrupts();
+}
+
+// Return the media generation. The change line is only driven while the drive is selected
+// with its motor on, so it is only read if the motor is running already. Starting the motor
+// here would spin the drive up for every cached file system operation
+uint32_t FloppyDriveGetMediaGeneration()
+{
+	if (_MotorOn && _CurrentDrive < 4)
+	{
+		bool inInterrupt = _InStateMachine;
+		if (!inInterrupt)
+		{
+			HAL_DisableInterrupts();
+		}
+		FloppyDriveCheckChangeLine();
+		if (!inInterrupt)
+		{
+			HAL_EnableInterrupts();
+		}
+	}
+	return _MediaGeneration;
+}
+
+// Get ready to mount the disk. The change line does not need the disk up to speed, so the
+// motor is switched on without waiting and left to the idle timeout
+bool FloppyDriveRevalidate()
+{
+	if (_CurrentDrive >= 4 || _InStateMachine)
+	{
+		return false;
+	}
+	HAL_DisableInterrupts();
+	if (!_MotorOn)
+	{
+		FloppyDriveSwitchMotor(true);
+		_MotorLastUsed = HAL_GetTickCount();
+	}
+	FloppyDriveCheckChangeLine();
+	HAL_EnableInterrupts();
+
+	// A different disk may have a different format
+	if (_GeometryGeneration != _MediaGeneration)
+	{
+		return FloppyDriveDetectGeometry();
+	}
+	return true;
+}
+
+// Read the boot sector and take the geometry from its BPB. Sector 1 of cylinder 0, head 0 is
+// in the same place on every format, only the data rate differs, so each rate is tried in turn
+bool FloppyDriveDetectGeometry()
+{
+	static const uint8_t rates[] = { FLPY_RATE_500KBPS, FLPY_RATE_1MBPS, FLPY_RATE_250KBPS };
+
+	if (_InStateMachine)
+	{
+		return false;
+	}
+	uint8_t previousRate = _DataRate;
+	uint8_t* sector = 0;
+	_Probing = true;
+	for (uint32_t i = 0; i < sizeof(rates) / sizeof(rates[0]) && !sector; i++)
+	{
+		_DataRate = rates[i];
+		sector = FloppyDriveReadSector(0);
+	}
+	_Probing = false;
+	_GeometryGeneration = _MediaGeneration;
+	if (!sector)
+	{
+		// Nothing readable in the drive. Leave things as they were for whatever goes in next
+		_DataRate = previousRate;
+		return false;
+	}
+
+	// Anything that does not look like a floppy BPB is read as a 1.44MB (or 2.88MB) disk
+	pBIOSParameterBlock bpb = &((pBootSector)sector)->Bpb;
+	int sectorsPerTrack = bpb->SectorsPerTrack;
+	int heads = bpb->HeadsPerCyl;
+	int total = bpb->NumSectors;
+	if (bpb->BytesPerSector != FLPY_BYTES_PER_SECTOR || sectorsPerTrack == 0 ||
+		sectorsPerTrack > FLPY_MAX_SECTORS_PER_TRACK || heads == 0 || heads > FLPY_MAX_HEADS ||
+		total == 0 || total > FLPY_MAX_SECTORS || total % (sectorsPerTrack * heads) != 0 ||
+		total / (sectorsPerTrack * heads) > FLPY_MAX_CYLINDERS)
+	{
+		sectorsPerTrack = _DataRate == FLPY_RATE_1MBPS ? 36 : 18;
+		heads = 2;
+		total = sectorsPerTrack * heads * 80;
+	}
+	FloppyDriveSetGeometry(sectorsPerTrack, heads, total / (sectorsPerTrack * heads));
+	return true;
+}
+
+// Return the geometry of the disk in the drive
+void FloppyDriveGetGeometry(FloppyGeometry* geometry)
+{
+	geometry->SectorsPerTrack = _SectorsPerTrack;
+	geometry->Heads = _Heads;
+	geometry->Cylinders = _Cylinders;
+	geometry->DataRate = _DataRate;
+}
+
+// Set when the controller is reset and recalibrated
+void FloppyDriveSetResetMode(FloppyResetMode mode)
+{
+	_ResetMode = mode;
+}
+
+// read a sector. The returned buffer is only valid until the next call
 uint8_t* FloppyDriveReadSector(int sectorLBA) 
 {
-	// The following line is put it because we were
-	// encountering problems under Bochs when we do a seek
-	// following a read - the seek command could not be sent.
-	FloppyDriveReset();
-	if (_CurrentDrive >= 4)
+	FloppyRequest request;
+	request.SectorLBA = sectorLBA;
+	request.Count = 1;
+	request.Buffer = _SectorBuffer;
+	if (!FloppyDriveSubmitAndWait(&request))
 	{
 		return 0;
 	}
-	// Convert LBA sector to CHS
+	return _SectorBuffer;
+}
+
+// Read up to count sectors starting at sectorLBA into buffer. A single FDC command
+// is used, so the run is cut short at the end of the cylinder containing sectorLBA.
+// If buffer is DMA capable (below 16MB, physically contiguous and not crossing a 64K
+// boundary) the controller transfers straight into it, otherwise it is copied in from
+// the bounce buffer. Returns the number of sectors read, 0 on failure.
+int FloppyDriveReadSectors(int sectorLBA, int count, uint8_t* buffer)
+{
 	int head = 0;
 	int	track = 0;
 	int sector = 1;
 	FloppyDriveLBAToCHS(sectorLBA, &head, &track, &sector);
-	// Turn motor on and seek to track on both heads
-	FloppyDriveControlMotor(true);
-	if (FloppyDriveSeek((uint8_t)track, (uint8_t)head) != 0)
+
+	// Clip the run to what is left of this cylinder (both heads)
+	int remaining = _SectorsPerTrack * (_Heads - head) - (sector - 1);
+	FloppyRequest request;
+	request.SectorLBA = sectorLBA;
+	request.Count = count > remaining ? remaining : count;
+	request.Buffer = buffer;
+	if (!FloppyDriveSubmitAndWait(&request))
 	{
 		return 0;
 	}
-	HAL_Sleep(10);
-	// Read sector and turn motor off
-	FloppyDriveReadSectorHTS((uint8_t)head, (uint8_t)track, (uint8_t)sector);
-	FloppyDriveControlMotor(false);
-
-	return (uint8_t*)DMA_BUFFER;
+	return request.Count;
 }
-
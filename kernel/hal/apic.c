@@ -0,0 +1,95 @@
+//	Local APIC handling
+
+#include <Hal.h>
+#include "apic.h"
+
+//	Local APIC registers, offsets from the APIC base
+
+#define I86_APIC_REG_ID					0x020
+#define I86_APIC_REG_TPR				0x080		// Task priority
+#define I86_APIC_REG_EOI				0x0b0
+#define I86_APIC_REG_SPURIOUS			0x0f0
+#define I86_APIC_REG_LVT_LINT0			0x350
+#define I86_APIC_REG_LVT_LINT1			0x360
+
+// Spurious interrupt register bit that software enables the APIC
+#define I86_APIC_SPURIOUS_ENABLE		0x100
+
+// LVT delivery modes
+#define I86_APIC_LVT_NMI				0x400
+#define I86_APIC_LVT_EXTINT				0x700
+
+// Model specific register holding the APIC base, and its global enable bit
+#define I86_APIC_BASE_MSR				0x1b
+#define I86_APIC_BASE_ENABLE			0x800
+#define I86_APIC_BASE_MASK				0xfffff000
+
+// CPUID 1 EDX bit saying there is a local APIC
+#define I86_CPUID_APIC					0x200
+
+static volatile uint8_t* _apic = 0;
+
+static inline uint32_t I86_APIC_Read(uint32_t reg)
+{
+	return *(volatile uint32_t*)(_apic + reg);
+}
+
+static inline void I86_APIC_Write(uint32_t reg, uint32_t value)
+{
+	*(volatile uint32_t*)(_apic + reg) = value;
+}
+
+// Spurious interrupts need no end-of-interrupt
+static void I86_APIC_SpuriousInterruptHandler()
+{
+	asm("leave");
+	asm("iret");
+}
+
+// Return the physical address of the local APIC registers
+uint32_t I86_APIC_GetAddress()
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	if (!(edx & I86_CPUID_APIC))
+	{
+		return 0;
+	}
+	asm volatile("rdmsr" : "=a"(eax), "=d"(edx) : "c"(I86_APIC_BASE_MSR));
+	return eax & I86_APIC_BASE_MASK;
+}
+
+// Enable the local APIC
+void I86_APIC_Initialise(volatile uint8_t* registers)
+{
+	uint32_t low, high;
+
+	_apic = registers;
+	HAL_SetInterruptVector(I86_APIC_SPURIOUS_VECTOR, I86_APIC_SpuriousInterruptHandler);
+
+	// Globally enable it, in case the BIOS did not
+	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(I86_APIC_BASE_MSR));
+	asm volatile("wrmsr" : : "a"(low | I86_APIC_BASE_ENABLE), "d"(high), "c"(I86_APIC_BASE_MSR));
+
+	// Virtual wire mode: the PICs come in on LINT0, NMI on LINT1
+	I86_APIC_Write(I86_APIC_REG_LVT_LINT0, I86_APIC_LVT_EXTINT);
+	I86_APIC_Write(I86_APIC_REG_LVT_LINT1, I86_APIC_LVT_NMI);
+	I86_APIC_Write(I86_APIC_REG_TPR, 0);
+	I86_APIC_Write(I86_APIC_REG_SPURIOUS, I86_APIC_SPURIOUS_ENABLE | I86_APIC_SPURIOUS_VECTOR);
+}
+
+// Return the ID of the local APIC
+uint8_t I86_APIC_GetId()
+{
+	return (uint8_t)(I86_APIC_Read(I86_APIC_REG_ID) >> 24);
+}
+
+// Send end-of-interrupt to the local APIC
+void I86_APIC_SendEOI()
+{
+	if (_apic)
+	{
+		I86_APIC_Write(I86_APIC_REG_EOI, 0);
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef _APIC_H_INCLUDED
+# define _APIC_H_INCLUDED
+
+// Local APIC handling. The 8259 PICs still deliver the ISA IRQs (through LINT0 in
+// virtual wire mode); the local APIC is used for message signalled interrupts
+
+#include <stdint.h>
+
+// Vector for spurious interrupts from the local APIC
+#define		I86_APIC_SPURIOUS_VECTOR	0xff
+
+// Return the physical address of the local APIC registers, or 0 if the CPU has no local APIC
+uint32_t I86_APIC_GetAddress();
+
+// Enable the local APIC, whose registers are mapped at registers
+void I86_APIC_Initialise(volatile uint8_t* registers);
+
+// Return the ID of this processor's local APIC
+uint8_t I86_APIC_GetId();
+
+// Send end-of-interrupt to the local APIC
+void I86_APIC_SendEOI();
+
+#endif
@@ -37,7 +37,7 @@ void DMA_Reset(int dma)
 // Reset flipflop
 void DMA_ResetFlipflop(int dma)
 {
-	if (dma < 2)
+	if (dma > 1)
 	{
 		return;
 	}
@@ -199,3 +199,42 @@ void DMA_SetExternalPageRegister(uint8_t reg, uint8_t val)
 	HAL_OutputByteToPort(port, val);
 }
 
+// Set up a transfer
+bool DMA_SetTransfer(uint8_t channel, uint32_t physical, uint32_t length)
+{
+	if (channel > 7 || channel == 4 || length == 0)
+	{
+		return false;
+	}
+	int dma = (channel < 4) ? 0 : 1;
+	uint32_t last = physical + length - 1;
+
+	// The page register holds address bits 16-23, so nothing above 16MB. The address
+	// register does not carry into it, so the buffer has to stay in one bank
+	uint32_t bankShift = (dma == 0) ? 16 : 17;
+	if ((last >> 24) || (physical >> bankShift) != (last >> bankShift))
+	{
+		return false;
+	}
+
+	// The slave controller counts in words, and its address register holds address bits 1-16
+	uint32_t address = physical;
+	uint32_t count = length - 1;
+	if (dma == 1)
+	{
+		if ((physical & 1) || (length & 1))
+		{
+			return false;
+		}
+		address = physical >> 1;
+		count = (length >> 1) - 1;
+	}
+
+	DMA_MaskChannel(channel);
+	DMA_ResetFlipflop(dma);
+	DMA_SetAddress(channel, address & 0xff, (address >> 8) & 0xff);
+	DMA_ResetFlipflop(dma);
+	DMA_SetCount(channel, count & 0xff, (count >> 8) & 0xff);
+	DMA_SetExternalPageRegister(channel, (physical >> 16) & 0xff);
+	return true;
+}
@@ -11,6 +11,7 @@
 #include "idt.h"
 #include "pic.h"
 #include "pit.h"
+#include "apic.h"
 #include <console.h>
 
 static bool _halInitialised = false;
@@ -74,6 +75,30 @@ inline void HAL_InterruptDone(unsigned int intno)
 	I86_PIC_SendCommand(I86_PIC_OCW2_MASK_EOI, 0);
 }
 
+// Notify hal a message signalled interrupt is done
+void HAL_MessageInterruptDone()
+{
+	I86_APIC_SendEOI();
+}
+
+// Return the physical address of the local APIC's registers
+uint32_t HAL_GetLocalApicAddress()
+{
+	return I86_APIC_GetAddress();
+}
+
+// Enable the local APIC so it can take message signalled interrupts
+void HAL_EnableLocalApic(void* registers)
+{
+	I86_APIC_Initialise((volatile uint8_t*)registers);
+}
+
+// Return the local APIC ID of this processor
+uint8_t HAL_GetLocalApicId()
+{
+	return I86_APIC_GetId();
+}
+
 // Read byte from device using port mapped io
 uint8_t HAL_InputByteFromPort(uint16_t portid) 
 {
@@ -92,12 +117,71 @@ void  HAL_OutputByteToPort(uint16_t portid, uint8_t value)
 
 }
 
+// Read word from device using port mapped io
+uint16_t HAL_InputWordFromPort(uint16_t portid) 
+{
+	uint16_t result = 0;
+	
+	asm volatile ("inw %1, %0" : "=a"(result) : "Nd"(portid));
+	return result;
+}
+
+// Write word to device through port mapped io
+void  HAL_OutputWordToPort(uint16_t portid, uint16_t value) 
+{
+	asm volatile ("outw %0, %1"
+				  :
+				  : "a"(value), "Nd"(portid));
+}
+
+// Read double word from device using port mapped io
+uint32_t HAL_InputDwordFromPort(uint16_t portid) 
+{
+	uint32_t result = 0;
+	
+	asm volatile ("inl %1, %0" : "=a"(result) : "Nd"(portid));
+	return result;
+}
+
+// Write double word to device through port mapped io
+void  HAL_OutputDwordToPort(uint16_t portid, uint32_t value) 
+{
+	asm volatile ("outl %0, %1"
+				  :
+				  : "a"(value), "Nd"(portid));
+}
+
+// Read count words from the same port into buffer (rep insw)
+void  HAL_InputWordsFromPort(uint16_t portid, void* buffer, uint32_t count) 
+{
+	asm volatile ("cld; rep insw"
+				  : "+D"(buffer), "+c"(count)
+				  : "d"(portid)
+				  : "memory");
+}
+
+// Write count words from buffer to the same port (rep outsw)
+void  HAL_OutputWordsToPort(uint16_t portid, const void* buffer, uint32_t count) 
+{
+	asm volatile ("cld; rep outsw"
+				  : "+S"(buffer), "+c"(count)
+				  : "d"(portid)
+				  : "memory");
+}
+
 //! Enable all hardware interrupts
 void HAL_EnableInterrupts() 
 {
 	asm("sti");
 }
 
+// Enable interrupts and halt until one arrives. Call with interrupts disabled after checking
+// what you are waiting for: sti only takes effect after hlt, so the wakeup cannot be missed
+void HAL_WaitForInterrupt() 
+{
+	asm volatile ("sti; hlt");
+}
+
 
 //! Disable all hardware interrupts
 void  HAL_DisableInterrupts() 
@@ -145,6 +229,12 @@ uint32_t HAL_GetTickCount()
 	return I86_PIT_HAL_GetTickCount();
 }
 
+// Add a routine to be called from the timer interrupt on every tick
+bool HAL_AddTickHandler(void (*handler)(uint32_t tickCount))
+{
+	return I86_PIT_AddTickHandler(handler);
+}
+
 // Sleep for specified number of clock ticks.
 // This uses the HALs HAL_GetTickCount() which in turn uses the PIT
 
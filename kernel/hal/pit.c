@@ -17,6 +17,9 @@
 //! Global Tick count
 static volatile uint32_t			_pit_ticks = 0;
 
+// Routines called on every tick
+static I86_PIT_TICK_HANDLER			_pit_tickHandlers[I86_PIT_MAX_TICK_HANDLERS];
+
 // Test if pit is initialized
 static bool							_pit_IsInitialised = false;
 
@@ -33,6 +36,15 @@ void  I86_PIT_TimerInterruptHandler()
 	// Increment tick count
 	_pit_ticks++;
 
+	// Let anyone who asked know about the tick
+	for (int i = 0; i < I86_PIT_MAX_TICK_HANDLERS; i++)
+	{
+		if (_pit_tickHandlers[i])
+		{
+			_pit_tickHandlers[i](_pit_ticks);
+		}
+	}
+
 	// Tell hal we are done
 	HAL_InterruptDone(0);
 
@@ -62,6 +74,20 @@ uint32_t I86_PIT_HAL_GetTickCount()
 	return _pit_ticks;
 }
 
+// Add a routine to be called on every tick. Returns false if there is no room for it
+bool I86_PIT_AddTickHandler(I86_PIT_TICK_HANDLER handler)
+{
+	for (int i = 0; i < I86_PIT_MAX_TICK_HANDLERS; i++)
+	{
+		if (!_pit_tickHandlers[i] || _pit_tickHandlers[i] == handler)
+		{
+			_pit_tickHandlers[i] = handler;
+			return true;
+		}
+	}
+	return false;
+}
+
 // Send command to pit
 void I86_PIT_SendCommand(uint8_t cmd) 
 {
@@ -36,6 +36,13 @@
 #define		I86_PIT_OCW_COUNTER_1			0x40	//01000000
 #define		I86_PIT_OCW_COUNTER_2			0x80	//10000000
 
+// Maximum number of routines that can be called on each tick
+#define		I86_PIT_MAX_TICK_HANDLERS		4
+
+// Routine called from the timer interrupt with the new tick count. Runs with interrupts
+// disabled, so it must be short and must not wait on anything
+typedef void (*I86_PIT_TICK_HANDLER)(uint32_t tickCount);
+
 // Send operational command to pit. Set up command by using the operational
 // command bit masks and setting them with the control bits. Shouldn't need to use
 // this outside the interface
@@ -53,6 +60,9 @@ uint32_t I86_PIT_SetTickCount(uint32_t i);
 // Return current tick count
 uint32_t I86_PIT_HAL_GetTickCount();
 
+// Add a routine to be called on every tick. Returns false if there is no room for it
+bool I86_PIT_AddTickHandler(I86_PIT_TICK_HANDLER handler);
+
 // Start a counter. Counter continues until another call to this routine
 void I86_PIT_StartCounter(uint32_t freq, uint8_t counter, uint8_t mode);
 
@@ -9,9 +9,30 @@
 #include "virtualmemorymanager.h"
 #include "bootinfo.h"
 #include <filesystem.h>
+#include <ata.h>
+#include <ahci.h>
+#include <virtioblk.h>
+#include <nvme.h>
+#include <pci.h>
+#include <buffercache.h>
+#include <ramdisk.h>
+#include <bpb.h>
 
 BootInfo *	_bootInfo;
 
+// How long the boot prompt for the RAM disk waits for a key, in ticks (the PIT runs at 100Hz)
+#define RAMDISK_PROMPT_TICKS 200
+
+// Set to 1 to have NVMe completions signalled by interrupts rather than found by polling
+#ifndef NVME_INTERRUPTS
+#define NVME_INTERRUPTS 0
+#endif
+
+// Number of sectors the buffer cache holds (each takes 512 bytes, plus about 32 for bookkeeping)
+#ifndef BUFFER_CACHE_SECTORS
+#define BUFFER_CACHE_SECTORS 512
+#endif
+
 // This is a dummy __main.  For some reason, gcc puts in a call to 
 // __main from main, so we just include a dummy.
  
@@ -69,9 +90,52 @@ void InitialisePhysicalMemory()
 	// Reserve two blocks for the stack and make unavailable (the stack is set at 0x90000 in boot loader)
 	uint32_t stackSize = PMM_GetBlockSize() * 2;
 	PMM_MarkRegionAsUnavailable(_bootInfo->StackTop - stackSize, stackSize);
-	
-	// Reserve block used for DMA transfers
-	PMM_MarkRegionAsUnavailable(0x8000, 4096);
+}
+
+// Give the user a moment to ask for the boot floppy to be copied into memory, so every
+// later file system access runs at memory speed. Returns true if R was pressed
+bool AskForRamDisk()
+{
+	ConsoleWriteString("Press R to load the boot floppy into a RAM disk\n");
+	KeyboardDiscardLastKey();
+	uint32_t end = HAL_GetTickCount() + RAMDISK_PROMPT_TICKS;
+	while (HAL_GetTickCount() < end)
+	{
+		keycode key = KeyboardGetLastKey();
+		if (key != KEY_UNKNOWN)
+		{
+			KeyboardDiscardLastKey();
+			return key == KEY_R;
+		}
+		HAL_WaitForInterrupt();
+	}
+	return false;
+}
+
+// Copy the boot floppy into a RAM disk and report how long it took.
+// Returns the RAM disk, or NULL if it could not be loaded
+BlockDevice* LoadRamDisk()
+{
+	FloppyGeometry geometry;
+
+	ConsoleWriteString("Loading RAM disk... ");
+	// Read a cylinder at a time so each read is one multi-track transfer
+	FloppyDriveGetGeometry(&geometry);
+	uint32_t start = HAL_GetTickCount();
+	BlockDevice* device = RamDisk_CreateFrom("rd0", FloppyDriveGetBlockDevice(),
+											 (uint32_t)(geometry.Heads * geometry.SectorsPerTrack));
+	uint32_t ticks = HAL_GetTickCount() - start;
+	if (device == NULL)
+	{
+		ConsoleWriteString("failed, reading from the floppy instead\n");
+		return NULL;
+	}
+	ConsoleWriteInt(device->SectorCount * device->SectorSize, 10);
+	ConsoleWriteString(" bytes in ");
+	// The PIT runs at 100Hz
+	ConsoleWriteInt(ticks * 10, 10);
+	ConsoleWriteString("ms\n");
+	return device;
 }
 
 void Initialise()
@@ -90,7 +154,34 @@ void Initialise()
 	FloppyDriveSetWorkingDrive(_bootInfo->BootDevice);
 	// install floppy disk to interrupt vector 38, uses IRQ 6
 	FloppyDriveInstall(38);
-	FsFat12_Initialise();
+	// Find what is on the PCI bus before the drivers go looking
+	PCI_Initialise();
+	// install hard disk driver to interrupt vectors 46 and 47, uses IRQ 14 and 15
+	AtaInstall(46, 47);
+	// install SATA driver, its IRQ comes from PCI and is relative to vector 32
+	AhciInstall(32);
+	// install virtio disk driver, again with IRQs from PCI relative to vector 32
+	VirtioBlkInstall(32);
+	// install NVMe driver
+	NvmeInstall(32, NVME_INTERRUPTS);
+	// Keep recently read sectors in memory for the file system
+	if (!BufferCache_Initialise(BUFFER_CACHE_SECTORS))
+	{
+		ConsoleWriteString("Unable to allocate the buffer cache\n");
+	}
+	BlockDevice* bootDevice = NULL;
+	if (AskForRamDisk())
+	{
+		bootDevice = LoadRamDisk();
+	}
+	if (bootDevice == NULL)
+	{
+		bootDevice = FloppyDriveGetBlockDevice();
+	}
+	if (!FsFat12_Initialise(bootDevice))
+	{
+		ConsoleWriteString("Unable to mount the boot floppy\n");
+	}
 }
 
 
@@ -154,6 +245,173 @@ void testOpen()
 	}
 }
 
+// Return true if the first count bytes of a and b are the same
+static bool SameBytes(const unsigned char* a, const unsigned char* b, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (a[i] != b[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static uint32_t _deviceReads = 0;
+
+// Read from the device in Private, counting each read the file system makes
+static int CountingRead(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	BlockDevice* inner = (BlockDevice*)device->Private;
+	_deviceReads++;
+	return inner->Read(inner, lba, count, buffer);
+}
+
+// Test reading a whole file in one go. It should come back the same as reading it a sector
+// at a time, and since the clusters of TestOne.txt are next to each other on the disk it
+// should take fewer device reads than the file has clusters
+void testContiguousRead()
+{
+	static unsigned char whole[2054];
+	static unsigned char sector[512];
+	static BlockDevice counting;
+
+	BlockDevice* mounted = FsFat12_GetDevice();
+	if (mounted == NULL || BlockDevice_Read(mounted, 0, 1, sector) != 0)
+	{
+		ConsoleWriteString("testContiguousRead FAIL: nothing mounted to read\n");
+		return;
+	}
+	pBootSector bootSector = (pBootSector)sector;
+	uint32_t clusterBytes = bootSector->Bpb.BytesPerSector * bootSector->Bpb.SectorsPerCluster;
+
+	// Mount the same disk behind a device that counts reads. It is new to the buffer
+	// cache, so nothing the file system asks for is already there
+	memset(&counting, 0, sizeof(counting));
+	counting.Name = "count";
+	counting.SectorSize = mounted->SectorSize;
+	counting.SectorCount = mounted->SectorCount;
+	counting.QueueDepth = 1;
+	counting.Read = CountingRead;
+	counting.Private = mounted;
+	FsFat12_Initialise(&counting);
+
+	FILE file = FsFat12_Open("\\Testing\\TestOne.txt");
+	uint32_t before = _deviceReads;
+	unsigned int read = FsFat12_Read(&file, whole, sizeof(whole));
+	uint32_t reads = _deviceReads - before;
+	uint32_t clusters = clusterBytes == 0 ? 0 : (file.FileLength + clusterBytes - 1) / clusterBytes;
+
+	file = FsFat12_Open("\\Testing\\TestOne.txt");
+	unsigned int position = 0;
+	bool same = read == sizeof(whole);
+	while (same && file.Eof == 0)
+	{
+		unsigned int length = FsFat12_Read(&file, sector, sizeof(sector));
+		same = length > 0 && position + length <= read && SameBytes(sector, whole + position, length);
+		position += length;
+	}
+	same = same && position == read;
+	FsFat12_Initialise(mounted);
+
+	ConsoleWriteString(same && reads < clusters ? "testContiguousRead PASS: " : "testContiguousRead FAIL: ");
+	ConsoleWriteInt(read, 10);
+	ConsoleWriteString(same ? " bytes, the same as a sector at a time, in " : " bytes, not the same as a sector at a time, in ");
+	ConsoleWriteInt(reads, 10);
+	ConsoleWriteString(" device reads for ");
+	ConsoleWriteInt(clusters, 10);
+	ConsoleWriteString(" clusters\n");
+}
+
+// Test seeking. TestOne.txt is 2054 bytes, so it ends just past a cluster boundary,
+// and HiTest.txt is 2048 bytes, so it ends exactly on one
+void testSeek()
+{
+	static unsigned char whole[2054];
+	unsigned char part[16];
+
+	FILE file = FsFat12_Open("\\Testing\\TestOne.txt");
+	if (file.Flags != FS_FILE || FsFat12_Read(&file, whole, sizeof(whole)) != sizeof(whole))
+	{
+		ConsoleWriteString("Unable to read \\Testing\\TestOne.txt\n");
+		return;
+	}
+
+	if (FsFat12_Seek(&file, 1000, FS_SEEK_SET) == 1000 && FsFat12_Read(&file, part, 16) == 16 &&
+		SameBytes(part, whole + 1000, 16))
+	{
+		ConsoleWriteString("FS_SEEK_SET to 1000 read the bytes at 1000\n");
+	}
+	if (FsFat12_Seek(&file, -516, FS_SEEK_CUR) == 500 && FsFat12_Read(&file, part, 16) == 16 &&
+		SameBytes(part, whole + 500, 16))
+	{
+		ConsoleWriteString("FS_SEEK_CUR back 516 read the bytes at 500\n");
+	}
+	if (FsFat12_Seek(&file, -6, FS_SEEK_END) == 2048 && FsFat12_Read(&file, part, 16) == 6 &&
+		SameBytes(part, whole + 2048, 6) && file.Eof)
+	{
+		ConsoleWriteString("FS_SEEK_END back 6 read the last 6 bytes\n");
+	}
+	if (FsFat12_Seek(&file, -1, FS_SEEK_SET) == -1 && FsFat12_Seek(&file, 1, FS_SEEK_END) == -1 &&
+		FsFat12_Seek(&file, -3000, FS_SEEK_CUR) == -1)
+	{
+		ConsoleWriteString("Seeking before the start or past the end returned -1\n");
+	}
+
+	file = FsFat12_Open("\\HiTest.txt");
+	if (file.Flags == FS_FILE && FsFat12_Seek(&file, 0, FS_SEEK_END) == 2048 && file.Eof &&
+		FsFat12_Read(&file, part, 16) == 0)
+	{
+		ConsoleWriteString("FS_SEEK_END to the cluster boundary at 2048 then read returned 0\n");
+	}
+	if (FsFat12_Seek(&file, 2040, FS_SEEK_SET) == 2040 && !file.Eof && FsFat12_Read(&file, part, 16) == 8 && file.Eof)
+	{
+		ConsoleWriteString("FS_SEEK_SET to 2040 read the last 8 bytes\n");
+	}
+}
+
+// Return the number of sectors the buffer cache has been asked for
+static uint32_t CacheLookups()
+{
+	BufferCacheStats stats;
+	BufferCache_GetStats(&stats);
+	return stats.Hits + stats.Misses;
+}
+
+// Test the dentry cache. Opening a path a second time, in any case, and looking for a
+// missing file a second time should not read any directories. A remount, as happens
+// when the disk is changed, should empty the cache
+void testDentryCache()
+{
+	BlockDevice* mounted = FsFat12_GetDevice();
+	FILE file = FsFat12_Open("\\Testing\\TestTwoLongFileName.txt");
+	uint32_t lookups = CacheLookups();
+	FILE again = FsFat12_Open("\\TESTING\\testtwolongfilename.TXT");
+	if (file.Flags == FS_FILE && again.Flags == FS_FILE && CacheLookups() == lookups &&
+		again.FileLength == file.FileLength && strcmp(again.Name, file.Name) == 0)
+	{
+		ConsoleWriteString("Opening \\Testing\\TestTwoLongFileName.txt again read no directories\n");
+	}
+
+	file = FsFat12_Open("\\Testing\\Missing.txt");
+	lookups = CacheLookups();
+	again = FsFat12_Open("\\Testing\\Missing.txt");
+	if (file.Flags == FS_INVALID && again.Flags == FS_INVALID && CacheLookups() == lookups)
+	{
+		ConsoleWriteString("Looking for \\Testing\\Missing.txt again read no directories\n");
+	}
+
+	// Mount whatever was mounted before again, be it the floppy or a RAM disk
+	FsFat12_Initialise(mounted);
+	lookups = CacheLookups();
+	file = FsFat12_Open("\\Testing\\TestTwoLongFileName.txt");
+	if (file.Flags == FS_FILE && CacheLookups() != lookups)
+	{
+		ConsoleWriteString("After a remount opening \\Testing\\TestTwoLongFileName.txt read the directories again\n");
+	}
+}
+
 void main(BootInfo * bootInfo) 
 {
 	_bootInfo = bootInfo;
@@ -162,6 +420,9 @@ void main(BootInfo * bootInfo)
 	//testFileClose();
 	//testFileReadNull();
 	//testOpen();
+	//testContiguousRead();
+	//testSeek();
+	//testDentryCache();
 
 	Run();
 	while (1);
@@ -0,0 +1,861 @@
+#include <hal.h>
+#include <nvme.h>
+#include <pci.h>
+#include <string.h>
+#include "physicalmemorymanager.h"
+#include "virtualmemorymanager.h"
+
+// NVMe disk support
+//
+// Commands go to the controller through submission queues in memory and come back on
+// completion queues, each pair with its own doorbells, so several queues can be worked
+// without any locking between them. We create an admin queue pair for set up, then up to
+// NVME_IO_QUEUES I/O pairs and spread requests across them. A completion queue entry
+// is new when its phase bit matches the phase we expect; the controller flips the bit
+// it writes each time round the queue, so we can spot new entries without reading any
+// registers. Data is described with PRPs: a pointer to the first page and either the
+// second page or a list of the rest.
+
+//	Controller registers
+
+#define	NVME_REG_CAP				0x00	// 64 bits
+#define	NVME_REG_VS					0x08
+#define	NVME_REG_INTMS				0x0c	// Interrupt mask set
+#define	NVME_REG_INTMC				0x10	// Interrupt mask clear
+#define	NVME_REG_CC					0x14
+#define	NVME_REG_CSTS				0x1c
+#define	NVME_REG_AQA				0x24
+#define	NVME_REG_ASQ				0x28	// 64 bits
+#define	NVME_REG_ACQ				0x30	// 64 bits
+#define	NVME_REG_DOORBELLS			0x1000
+
+// Fields of CAP. The upper half holds the doorbell stride
+#define	NVME_CAP_MQES_MASK			0xffff
+#define	NVME_CAP_TO_SHIFT			24
+#define	NVME_CAP_TO_MASK			0xff
+#define	NVME_CAP_HI_DSTRD_MASK		0x0f
+
+#define	NVME_CC_EN					0x00000001
+#define	NVME_CC_IOSQES				(6 << 16)	// 64 byte submission entries
+#define	NVME_CC_IOCQES				(4 << 20)	// 16 byte completion entries
+
+#define	NVME_CSTS_RDY				0x00000001
+#define	NVME_CSTS_CFS				0x00000002
+
+//	Admin commands
+
+#define	NVME_ADMIN_CREATE_SQ		0x01
+#define	NVME_ADMIN_CREATE_CQ		0x05
+#define	NVME_ADMIN_IDENTIFY			0x06
+#define	NVME_ADMIN_SET_FEATURES		0x09
+
+#define	NVME_IDENTIFY_NAMESPACE		0
+#define	NVME_IDENTIFY_CONTROLLER	1
+
+#define	NVME_FEATURE_QUEUES			0x07
+
+// Queue creation flags
+#define	NVME_QUEUE_CONTIGUOUS		0x0001
+#define	NVME_QUEUE_INTERRUPTS		0x0002
+
+//	I/O commands
+
+#define	NVME_CMD_FLUSH				0x00
+#define	NVME_CMD_WRITE				0x01
+#define	NVME_CMD_READ				0x02
+
+//	Identify data offsets
+
+#define	NVME_ID_MODEL				24
+#define	NVME_ID_MODEL_LENGTH		40
+#define	NVME_ID_MDTS				77
+#define	NVME_ID_NS_SIZE				0
+#define	NVME_ID_NS_FLBAS			26
+#define	NVME_ID_NS_LBAF				128
+
+// PCI class of NVMe controllers
+#define	NVME_PCI_CLASS				0x01
+#define	NVME_PCI_SUBCLASS			0x08
+
+#define	NVME_PAGE_SIZE				4096u
+
+// Entries in the admin queues
+#define	NVME_ADMIN_ENTRIES			16
+
+// Entries in each I/O queue. A page of submission entries
+#define	NVME_IO_ENTRIES				64
+
+// Commands outstanding on each I/O queue. Less than the queue size, so it can never overflow
+#define	NVME_QUEUE_SLOTS			32
+
+// PRP list entries for a command: every page after the first, which goes in PRP1. An unaligned
+// buffer touches one page more than an aligned one
+#define	NVME_PRP_ENTRIES			(NVME_MAX_TRANSFER / NVME_PAGE_SIZE + 1)
+
+// Bytes set aside for each slot's PRP list. A list must not cross a page, so a power of two
+#define	NVME_PRP_LIST_BYTES			256
+
+// Blocks holding the PRP lists of all the slots of a queue
+#define	NVME_PRP_LIST_BLOCKS		(NVME_QUEUE_SLOTS * NVME_PRP_LIST_BYTES / NVME_PAGE_SIZE)
+
+// Number of ticks to wait for a command
+#define	NVME_TIMEOUT				300
+
+// Submission queue entry
+typedef struct _NvmeCommand
+{
+	uint8_t		Opcode;
+	uint8_t		Flags;
+	uint16_t	Id;
+	uint32_t	Namespace;
+	uint32_t	Reserved[2];
+	uint32_t	Metadata[2];
+	uint32_t	Prp1;
+	uint32_t	Prp1Upper;
+	uint32_t	Prp2;
+	uint32_t	Prp2Upper;
+	uint32_t	Dword10;
+	uint32_t	Dword11;
+	uint32_t	Dword12;
+	uint32_t	Dword13;
+	uint32_t	Dword14;
+	uint32_t	Dword15;
+} __attribute__((packed)) NvmeCommand;
+
+// Completion queue entry
+typedef struct _NvmeCompletion
+{
+	uint32_t	Result;
+	uint32_t	Reserved;
+	uint16_t	SubmissionHead;
+	uint16_t	SubmissionId;
+	uint16_t	Id;
+	uint16_t	Status;			// Bit 0 is the phase
+} __attribute__((packed)) NvmeCompletion;
+
+typedef struct _NvmeQueue
+{
+	uint16_t					Id;
+	uint16_t					Entries;
+	NvmeCommand*				Submission;
+	uint16_t					Tail;
+	volatile NvmeCompletion*	Completion;
+	uint16_t					Head;
+	uint16_t					Phase;			// Phase bit of new completion entries
+	volatile uint32_t*			SubmissionDoorbell;
+	volatile uint32_t*			CompletionDoorbell;
+	uint32_t*					PrpLists;		// NVME_PRP_LIST_BYTES for each slot
+	BlockRequest*				Requests[NVME_QUEUE_SLOTS];
+	uint32_t					Active;			// Slots in use
+} NvmeQueue;
+
+typedef struct _NvmeController
+{
+	volatile uint8_t*	Registers;
+	uint32_t			DoorbellStride;		// Bytes
+	uint32_t			MaxEntries;			// Largest queue the controller takes
+	uint32_t			Timeout;			// Ticks to wait for the controller to become ready
+	bool				Interrupts;			// Completions found by the IRQ handler rather than polling
+	NvmeQueue			Admin;
+	NvmeQueue			Io[NVME_IO_QUEUES];
+	int					QueueCount;
+	int					NextQueue;			// Where the next request goes
+	uint32_t			MaxSectors;
+	char				Model[NVME_ID_MODEL_LENGTH + 1];
+	char				Name[4];
+	BlockDevice			Device;
+} NvmeController;
+
+static NvmeController _Disks[NVME_MAX_DISKS];
+static int _DiskCount = 0;
+
+// Highest IRQ line any controller without MSI uses. The PICs take a non specific EOI
+static int _Irq = -1;
+
+// Set while the IRQ handler runs, so requests submitted from a completion routine
+// do not turn interrupts back on
+static volatile bool _InInterrupt = false;
+
+// Read a register
+static inline uint32_t NvmeRead(NvmeController* controller, uint32_t reg)
+{
+	return *(volatile uint32_t*)(controller->Registers + reg);
+}
+
+// Write a register
+static inline void NvmeWrite(NvmeController* controller, uint32_t reg, uint32_t value)
+{
+	*(volatile uint32_t*)(controller->Registers + reg) = value;
+}
+
+// Give back whatever memory a queue pair has
+static void NvmeFreeQueue(NvmeQueue* queue)
+{
+	if (queue->Submission)
+	{
+		PMM_FreeBlock(queue->Submission);
+		queue->Submission = 0;
+	}
+	if (queue->Completion)
+	{
+		PMM_FreeBlock((void*)queue->Completion);
+		queue->Completion = 0;
+	}
+	if (queue->PrpLists)
+	{
+		PMM_FreeBlocks(queue->PrpLists, NVME_PRP_LIST_BLOCKS);
+		queue->PrpLists = 0;
+	}
+}
+
+// Set up the memory and doorbells of a queue pair. Returns false if the memory could not be found
+static bool NvmeAllocateQueue(NvmeController* controller, NvmeQueue* queue, uint16_t id, uint16_t entries)
+{
+	queue->Id = id;
+	queue->Entries = entries;
+	queue->Submission = (NvmeCommand*)PMM_AllocateBlock();
+	queue->Completion = (volatile NvmeCompletion*)PMM_AllocateBlock();
+	// The admin queue's commands have no data, or a page at most
+	queue->PrpLists = id == 0 ? 0 : (uint32_t*)PMM_AllocateBlocks(NVME_PRP_LIST_BLOCKS);
+	// The controller is given their physical addresses, so they must be mapped at them
+	if (!queue->Submission || !queue->Completion || (id != 0 && !queue->PrpLists) ||
+		!VMM_IdentityMapRange(queue->Submission, NVME_PAGE_SIZE) ||
+		!VMM_IdentityMapRange((void*)queue->Completion, NVME_PAGE_SIZE) ||
+		(queue->PrpLists && !VMM_IdentityMapRange(queue->PrpLists, NVME_PRP_LIST_BLOCKS * NVME_PAGE_SIZE)))
+	{
+		NvmeFreeQueue(queue);
+		return false;
+	}
+	memset(queue->Submission, 0, NVME_PAGE_SIZE);
+	memset((void*)queue->Completion, 0, NVME_PAGE_SIZE);
+	queue->Tail = 0;
+	queue->Head = 0;
+	queue->Phase = 1;
+	queue->Active = 0;
+	for (int slot = 0; slot < NVME_QUEUE_SLOTS; slot++)
+	{
+		queue->Requests[slot] = 0;
+	}
+	queue->SubmissionDoorbell = (volatile uint32_t*)(controller->Registers + NVME_REG_DOORBELLS + (2 * id) * controller->DoorbellStride);
+	queue->CompletionDoorbell = (volatile uint32_t*)(controller->Registers + NVME_REG_DOORBELLS + (2 * id + 1) * controller->DoorbellStride);
+	return true;
+}
+
+// Copy command to the tail of a queue and ring its doorbell
+static void NvmePush(NvmeQueue* queue, NvmeCommand* command)
+{
+	queue->Submission[queue->Tail] = *command;
+	queue->Tail = (uint16_t)((queue->Tail + 1) % queue->Entries);
+	asm volatile("" ::: "memory");
+	*queue->SubmissionDoorbell = queue->Tail;
+}
+
+// Run an admin command, polling for its completion. Returns false if it failed
+static bool NvmeAdmin(NvmeController* controller, NvmeCommand* command, uint32_t* result)
+{
+	NvmeQueue* queue = &controller->Admin;
+	uint32_t timeout = HAL_GetTickCount() + NVME_TIMEOUT;
+
+	command->Id = queue->Tail;
+	NvmePush(queue, command);
+	while ((queue->Completion[queue->Head].Status & 1) != queue->Phase)
+	{
+		if (HAL_GetTickCount() > timeout)
+		{
+			return false;
+		}
+	}
+	uint16_t status = queue->Completion[queue->Head].Status;
+	if (result)
+	{
+		*result = queue->Completion[queue->Head].Result;
+	}
+	queue->Head = (uint16_t)((queue->Head + 1) % queue->Entries);
+	if (queue->Head == 0)
+	{
+		queue->Phase ^= 1;
+	}
+	*queue->CompletionDoorbell = queue->Head;
+	return (status >> 1) == 0;
+}
+
+// Collect finished commands from an I/O queue. Returns the number found
+static int NvmeServiceQueue(NvmeQueue* queue)
+{
+	int count = 0;
+
+	while ((queue->Completion[queue->Head].Status & 1) == queue->Phase)
+	{
+		asm volatile("" ::: "memory");
+		uint16_t id = queue->Completion[queue->Head].Id;
+		uint16_t status = queue->Completion[queue->Head].Status;
+		queue->Head = (uint16_t)((queue->Head + 1) % queue->Entries);
+		if (queue->Head == 0)
+		{
+			queue->Phase ^= 1;
+		}
+		if (id >= NVME_QUEUE_SLOTS || !(queue->Active & (1u << id)))
+		{
+			continue;
+		}
+		BlockRequest* request = queue->Requests[id];
+		queue->Requests[id] = 0;
+		queue->Active &= ~(1u << id);
+		count++;
+		if (!request)
+		{
+			// Whoever submitted it gave up waiting
+			continue;
+		}
+		request->Status = (status >> 1) == 0 ? BLOCK_REQUEST_DONE : BLOCK_REQUEST_ERROR;
+		if (request->Completion)
+		{
+			request->Completion(request);
+		}
+	}
+	// One doorbell write for everything we found
+	if (count > 0)
+	{
+		*queue->CompletionDoorbell = queue->Head;
+	}
+	return count;
+}
+
+// Collect finished commands from every I/O queue of a controller
+static int NvmeServiceController(NvmeController* controller)
+{
+	int count = 0;
+	for (int i = 0; i < controller->QueueCount; i++)
+	{
+		count += NvmeServiceQueue(&controller->Io[i]);
+	}
+	return count;
+}
+
+void NvmeServiceInterrupt()
+{
+	for (int i = 0; i < _DiskCount; i++)
+	{
+		if (_Disks[i].Interrupts)
+		{
+			NvmeServiceController(&_Disks[i]);
+		}
+	}
+}
+
+// NVMe IRQ handler
+void I86_NvmeInterruptHandler()
+{
+	asm("pushal");
+	asm("cli");
+
+	_InInterrupt = true;
+	NvmeServiceInterrupt();
+	_InInterrupt = false;
+
+	// Tell HAL we are done
+	HAL_InterruptDone(_Irq);
+
+	asm("sti");
+	asm("popal");
+	asm("leave");
+	asm("iret");
+}
+
+// NVMe MSI handler
+void I86_NvmeMsiHandler()
+{
+	asm("pushal");
+	asm("cli");
+
+	_InInterrupt = true;
+	NvmeServiceInterrupt();
+	_InInterrupt = false;
+
+	// Tell HAL we are done
+	HAL_MessageInterruptDone();
+
+	asm("sti");
+	asm("popal");
+	asm("leave");
+	asm("iret");
+}
+
+// Block device Poll
+static int NvmePoll(BlockDevice* device)
+{
+	bool interruptsOff = !_InInterrupt;
+	if (interruptsOff)
+	{
+		HAL_DisableInterrupts();
+	}
+	int count = NvmeServiceController((NvmeController*)device->Private);
+	if (interruptsOff)
+	{
+		HAL_EnableInterrupts();
+	}
+	return count;
+}
+
+// Fill in the PRPs of command for bytes of buffer, using list for the PRP list if it needs one.
+// Returns false if part of the buffer is not mapped or is not dword aligned
+static bool NvmeBuildPrps(NvmeCommand* command, uint32_t* list, uint8_t* buffer, uint32_t bytes)
+{
+	uint32_t physical = VMM_GetPhysicalAddress(buffer);
+	if (physical == 0 || (physical & 3))
+	{
+		return false;
+	}
+	command->Prp1 = physical;
+	command->Prp2 = 0;
+
+	// Everything after the first page starts on a page boundary
+	uint32_t first = NVME_PAGE_SIZE - (physical & (NVME_PAGE_SIZE - 1));
+	if (bytes <= first)
+	{
+		return true;
+	}
+	buffer += first;
+	bytes -= first;
+	if (bytes <= NVME_PAGE_SIZE)
+	{
+		command->Prp2 = VMM_GetPhysicalAddress(buffer);
+		return command->Prp2 != 0;
+	}
+	int entries = 0;
+	while (bytes > 0)
+	{
+		physical = VMM_GetPhysicalAddress(buffer);
+		if (physical == 0 || entries == NVME_PRP_ENTRIES)
+		{
+			return false;
+		}
+		list[entries * 2] = physical;
+		list[entries * 2 + 1] = 0;
+		entries++;
+		buffer += NVME_PAGE_SIZE;
+		bytes -= bytes > NVME_PAGE_SIZE ? NVME_PAGE_SIZE : bytes;
+	}
+	command->Prp2 = VMM_GetPhysicalAddress(list);
+	return true;
+}
+
+// Put a command for request on the least busy I/O queue. Returns -1 if every slot is in use
+// or the buffer cannot be described to the controller
+static int NvmeIssue(NvmeController* controller, BlockRequest* request, uint8_t opcode)
+{
+	bool interruptsOff = !_InInterrupt;
+	int result = -1;
+
+	if (interruptsOff)
+	{
+		HAL_DisableInterrupts();
+	}
+	// Round robin, skipping full queues
+	NvmeQueue* queue = 0;
+	uint32_t slot = 0;
+	for (int i = 0; i < controller->QueueCount && !queue; i++)
+	{
+		NvmeQueue* candidate = &controller->Io[(controller->NextQueue + i) % controller->QueueCount];
+		for (slot = 0; slot < NVME_QUEUE_SLOTS; slot++)
+		{
+			if (!(candidate->Active & (1u << slot)))
+			{
+				queue = candidate;
+				break;
+			}
+		}
+	}
+	if (queue)
+	{
+		controller->NextQueue = (controller->NextQueue + 1) % controller->QueueCount;
+
+		NvmeCommand command;
+		memset(&command, 0, sizeof(NvmeCommand));
+		command.Opcode = opcode;
+		command.Id = (uint16_t)slot;
+		command.Namespace = 1;
+		bool described = true;
+		if (opcode != NVME_CMD_FLUSH)
+		{
+			described = NvmeBuildPrps(&command, &queue->PrpLists[slot * NVME_PRP_LIST_BYTES / 4],
+									  request->Buffer, request->Count * controller->Device.SectorSize);
+			command.Dword10 = request->LBA;
+			command.Dword11 = 0;
+			command.Dword12 = request->Count - 1;
+		}
+		if (described)
+		{
+			request->Status = BLOCK_REQUEST_PENDING;
+			queue->Requests[slot] = request;
+			queue->Active |= 1u << slot;
+			NvmePush(queue, &command);
+			result = 0;
+		}
+	}
+	if (interruptsOff)
+	{
+		HAL_EnableInterrupts();
+	}
+	return result;
+}
+
+// Block device Submit
+static int NvmeSubmit(BlockDevice* device, BlockRequest* request)
+{
+	NvmeController* controller = (NvmeController*)device->Private;
+	if (request->Count > controller->MaxSectors)
+	{
+		return -1;
+	}
+	return NvmeIssue(controller, request, request->Write ? NVME_CMD_WRITE : NVME_CMD_READ);
+}
+
+// Forget a request we have stopped waiting for. Its slot stays busy until the controller returns it
+static void NvmeAbandon(NvmeController* controller, BlockRequest* request)
+{
+	for (int i = 0; i < controller->QueueCount; i++)
+	{
+		for (int slot = 0; slot < NVME_QUEUE_SLOTS; slot++)
+		{
+			if (controller->Io[i].Requests[slot] == request)
+			{
+				controller->Io[i].Requests[slot] = 0;
+			}
+		}
+	}
+}
+
+// Wait for something to finish: spin on the completion queues, or sleep until an interrupt
+static void NvmeWaitForCompletion(NvmeController* controller)
+{
+	if (controller->Interrupts)
+	{
+		HAL_WaitForInterrupt();
+		HAL_DisableInterrupts();
+	}
+	else
+	{
+		NvmeServiceController(controller);
+	}
+}
+
+// Issue a command and wait for it
+static bool NvmeExecute(NvmeController* controller, BlockRequest* request, uint8_t opcode)
+{
+	uint32_t timeout = HAL_GetTickCount() + NVME_TIMEOUT;
+
+	request->Completion = 0;
+	request->Context = 0;
+	while (NvmeIssue(controller, request, opcode) != 0)
+	{
+		HAL_DisableInterrupts();
+		bool busy = false;
+		for (int i = 0; i < controller->QueueCount; i++)
+		{
+			busy = busy || controller->Io[i].Active != 0;
+		}
+		// With nothing in flight to make room the buffer is the problem, and will stay one
+		if (!busy || HAL_GetTickCount() > timeout)
+		{
+			HAL_EnableInterrupts();
+			return false;
+		}
+		NvmeWaitForCompletion(controller);
+		HAL_EnableInterrupts();
+	}
+	HAL_DisableInterrupts();
+	while (request->Status == BLOCK_REQUEST_PENDING)
+	{
+		if (HAL_GetTickCount() > timeout)
+		{
+			NvmeAbandon(controller, request);
+			HAL_EnableInterrupts();
+			return false;
+		}
+		NvmeWaitForCompletion(controller);
+	}
+	HAL_EnableInterrupts();
+	return request->Status == BLOCK_REQUEST_DONE;
+}
+
+// Block device read and write
+static int NvmeTransfer(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer, bool write)
+{
+	NvmeController* controller = (NvmeController*)device->Private;
+	BlockRequest request;
+
+	request.LBA = lba;
+	request.Count = count > controller->MaxSectors ? controller->MaxSectors : count;
+	request.Buffer = buffer;
+	request.Write = write;
+	request.Status = BLOCK_REQUEST_PENDING;
+	if (!NvmeExecute(controller, &request, write ? NVME_CMD_WRITE : NVME_CMD_READ))
+	{
+		return 0;
+	}
+	return request.Count;
+}
+
+static int NvmeBlockRead(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	return NvmeTransfer(device, lba, count, buffer, false);
+}
+
+static int NvmeBlockWrite(BlockDevice* device, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+	return NvmeTransfer(device, lba, count, (uint8_t*)buffer, true);
+}
+
+static int NvmeBlockFlush(BlockDevice* device)
+{
+	BlockRequest request;
+
+	request.LBA = 0;
+	request.Count = 0;
+	request.Buffer = 0;
+	request.Write = false;
+	request.Status = BLOCK_REQUEST_PENDING;
+	return NvmeExecute((NvmeController*)device->Private, &request, NVME_CMD_FLUSH) ? 0 : -1;
+}
+
+// Wait for the controller's ready bit to reach ready. Returns false if it did not in time
+static bool NvmeWaitReady(NvmeController* controller, bool ready)
+{
+	uint32_t timeout = HAL_GetTickCount() + controller->Timeout;
+	while (((NvmeRead(controller, NVME_REG_CSTS) & NVME_CSTS_RDY) != 0) != ready)
+	{
+		if (HAL_GetTickCount() > timeout || (NvmeRead(controller, NVME_REG_CSTS) & NVME_CSTS_CFS))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Reset the controller and bring it up with an admin queue
+static bool NvmeEnable(NvmeController* controller)
+{
+	uint32_t cap = NvmeRead(controller, NVME_REG_CAP);
+	uint32_t capUpper = NvmeRead(controller, NVME_REG_CAP + 4);
+	controller->MaxEntries = (cap & NVME_CAP_MQES_MASK) + 1;
+	// CAP.TO is in 500ms units, a tick is 10ms
+	controller->Timeout = ((cap >> NVME_CAP_TO_SHIFT) & NVME_CAP_TO_MASK) * 50 + 1;
+	controller->DoorbellStride = 4 << (capUpper & NVME_CAP_HI_DSTRD_MASK);
+
+	if (NvmeRead(controller, NVME_REG_CC) & NVME_CC_EN)
+	{
+		NvmeWrite(controller, NVME_REG_CC, 0);
+		if (!NvmeWaitReady(controller, false))
+		{
+			return false;
+		}
+	}
+	uint16_t entries = controller->MaxEntries < NVME_ADMIN_ENTRIES ? controller->MaxEntries : NVME_ADMIN_ENTRIES;
+	if (!NvmeAllocateQueue(controller, &controller->Admin, 0, entries))
+	{
+		return false;
+	}
+	NvmeWrite(controller, NVME_REG_AQA, ((uint32_t)(entries - 1) << 16) | (entries - 1));
+	NvmeWrite(controller, NVME_REG_ASQ, VMM_GetPhysicalAddress(controller->Admin.Submission));
+	NvmeWrite(controller, NVME_REG_ASQ + 4, 0);
+	NvmeWrite(controller, NVME_REG_ACQ, VMM_GetPhysicalAddress((void*)controller->Admin.Completion));
+	NvmeWrite(controller, NVME_REG_ACQ + 4, 0);
+
+	// Nothing is serviced by interrupts until the I/O queues exist
+	NvmeWrite(controller, NVME_REG_INTMS, 0xffffffff);
+	NvmeWrite(controller, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+	return NvmeWaitReady(controller, true);
+}
+
+// Identify the controller and namespace 1
+static bool NvmeIdentify(NvmeController* controller)
+{
+	uint8_t* identify = (uint8_t*)PMM_AllocateBlock();
+	NvmeCommand command;
+	bool result = false;
+
+	if (!identify)
+	{
+		return false;
+	}
+	if (!VMM_IdentityMapRange(identify, NVME_PAGE_SIZE))
+	{
+		PMM_FreeBlock(identify);
+		return false;
+	}
+	memset(&command, 0, sizeof(NvmeCommand));
+	command.Opcode = NVME_ADMIN_IDENTIFY;
+	command.Prp1 = VMM_GetPhysicalAddress(identify);
+	command.Dword10 = NVME_IDENTIFY_CONTROLLER;
+	if (NvmeAdmin(controller, &command, 0))
+	{
+		int length = NVME_ID_MODEL_LENGTH;
+		memcpy(controller->Model, identify + NVME_ID_MODEL, length);
+		while (length > 0 && controller->Model[length - 1] == ' ')
+		{
+			length--;
+		}
+		controller->Model[length] = 0;
+
+		// Maximum data transfer size, in units of the 4K page size. 0 means no limit
+		uint32_t maxTransfer = NVME_MAX_TRANSFER;
+		uint8_t mdts = identify[NVME_ID_MDTS];
+		if (mdts != 0 && mdts < 5 && (NVME_PAGE_SIZE << mdts) < maxTransfer)
+		{
+			maxTransfer = NVME_PAGE_SIZE << mdts;
+		}
+
+		memset(&command, 0, sizeof(NvmeCommand));
+		command.Opcode = NVME_ADMIN_IDENTIFY;
+		command.Namespace = 1;
+		command.Prp1 = VMM_GetPhysicalAddress(identify);
+		command.Dword10 = NVME_IDENTIFY_NAMESPACE;
+		if (NvmeAdmin(controller, &command, 0))
+		{
+			uint32_t* words = (uint32_t*)identify;
+			uint32_t format = identify[NVME_ID_NS_FLBAS] & 0x0f;
+			uint32_t sectorShift = (words[NVME_ID_NS_LBAF / 4 + format] >> 16) & 0xff;
+			if (sectorShift >= 9 && sectorShift <= 12)
+			{
+				controller->Device.SectorSize = 1u << sectorShift;
+				controller->Device.SectorCount = words[NVME_ID_NS_SIZE / 4 + 1] ? 0xffffffff : words[NVME_ID_NS_SIZE / 4];
+				controller->MaxSectors = maxTransfer / controller->Device.SectorSize;
+				result = controller->Device.SectorCount != 0;
+			}
+		}
+	}
+	PMM_FreeBlock(identify);
+	return result;
+}
+
+// Create the I/O queue pairs
+static bool NvmeCreateQueues(NvmeController* controller)
+{
+	NvmeCommand command;
+	uint32_t granted;
+
+	// Ask for NVME_IO_QUEUES pairs, the controller says how many we may have (0 based)
+	memset(&command, 0, sizeof(NvmeCommand));
+	command.Opcode = NVME_ADMIN_SET_FEATURES;
+	command.Dword10 = NVME_FEATURE_QUEUES;
+	command.Dword11 = ((NVME_IO_QUEUES - 1) << 16) | (NVME_IO_QUEUES - 1);
+	if (!NvmeAdmin(controller, &command, &granted))
+	{
+		return false;
+	}
+	int queues = (int)((granted & 0xffff) < (granted >> 16) ? (granted & 0xffff) : (granted >> 16)) + 1;
+	queues = queues > NVME_IO_QUEUES ? NVME_IO_QUEUES : queues;
+
+	uint16_t entries = controller->MaxEntries < NVME_IO_ENTRIES ? controller->MaxEntries : NVME_IO_ENTRIES;
+	if (entries <= NVME_QUEUE_SLOTS)
+	{
+		return false;
+	}
+	controller->QueueCount = 0;
+	for (int i = 0; i < queues; i++)
+	{
+		NvmeQueue* queue = &controller->Io[i];
+		uint16_t id = (uint16_t)(i + 1);
+		if (!NvmeAllocateQueue(controller, queue, id, entries))
+		{
+			break;
+		}
+		// Completion queue first, the submission queue names it
+		memset(&command, 0, sizeof(NvmeCommand));
+		command.Opcode = NVME_ADMIN_CREATE_CQ;
+		command.Prp1 = VMM_GetPhysicalAddress((void*)queue->Completion);
+		command.Dword10 = ((uint32_t)(entries - 1) << 16) | id;
+		command.Dword11 = NVME_QUEUE_CONTIGUOUS | (controller->Interrupts ? NVME_QUEUE_INTERRUPTS : 0);
+		if (!NvmeAdmin(controller, &command, 0))
+		{
+			break;
+		}
+		memset(&command, 0, sizeof(NvmeCommand));
+		command.Opcode = NVME_ADMIN_CREATE_SQ;
+		command.Prp1 = VMM_GetPhysicalAddress(queue->Submission);
+		command.Dword10 = ((uint32_t)(entries - 1) << 16) | id;
+		command.Dword11 = ((uint32_t)id << 16) | NVME_QUEUE_CONTIGUOUS;
+		if (!NvmeAdmin(controller, &command, 0))
+		{
+			break;
+		}
+		controller->QueueCount++;
+	}
+	controller->NextQueue = 0;
+	return controller->QueueCount > 0;
+}
+
+// Find the NVMe controllers and register their disks
+int NvmeInstall(int irqBaseVector, bool interrupts)
+{
+	PciAddress address;
+
+	for (int index = 0; _DiskCount < NVME_MAX_DISKS && PCI_FindClass(NVME_PCI_CLASS, NVME_PCI_SUBCLASS, index, &address); index++)
+	{
+		NvmeController* controller = &_Disks[_DiskCount];
+		PciDevice* device = PCI_GetDeviceAt(address);
+		// The BAR covers the registers and every doorbell
+		controller->Registers = (volatile uint8_t*)PCI_MapBar(device, 0);
+		if (!controller->Registers)
+		{
+			continue;
+		}
+		uint16_t pciCommand = PCI_ReadConfig16(address, PCI_CONFIG_COMMAND) | PCI_COMMAND_BUS_MASTER;
+		pciCommand = interrupts ? pciCommand & ~PCI_COMMAND_INTX_DISABLE : pciCommand | PCI_COMMAND_INTX_DISABLE;
+		PCI_WriteConfig16(address, PCI_CONFIG_COMMAND, pciCommand);
+
+		controller->Interrupts = interrupts;
+		if (!NvmeEnable(controller) || !NvmeIdentify(controller) || !NvmeCreateQueues(controller))
+		{
+			continue;
+		}
+		if (interrupts)
+		{
+			// A vector of our own if the controller can do MSI, otherwise the legacy IRQ line
+			if (PCI_EnableMsi(device, I86_NvmeMsiHandler) >= 0)
+			{
+				NvmeWrite(controller, NVME_REG_INTMC, 0xffffffff);
+			}
+			else if (device->InterruptLine <= 15)
+			{
+				HAL_SetInterruptVector(irqBaseVector + device->InterruptLine, I86_NvmeInterruptHandler);
+				_Irq = device->InterruptLine > _Irq ? device->InterruptLine : _Irq;
+				NvmeWrite(controller, NVME_REG_INTMC, 0xffffffff);
+			}
+			else
+			{
+				// No way to be interrupted, so poll after all
+				controller->Interrupts = false;
+			}
+		}
+
+		controller->Name[0] = 'n';
+		controller->Name[1] = 'v';
+		controller->Name[2] = (char)('0' + _DiskCount);
+		controller->Name[3] = 0;
+		controller->Device.Name = controller->Name;
+		controller->Device.QueueDepth = controller->QueueCount * NVME_QUEUE_SLOTS;
+		controller->Device.Read = NvmeBlockRead;
+		controller->Device.Write = NvmeBlockWrite;
+		controller->Device.Flush = NvmeBlockFlush;
+		controller->Device.Submit = NvmeSubmit;
+		controller->Device.Poll = controller->Interrupts ? 0 : NvmePoll;
+		controller->Device.MediaGeneration = 0;
+		controller->Device.Revalidate = 0;
+		controller->Device.Private = controller;
+		_DiskCount++;
+		BlockDevice_Register(&controller->Device);
+	}
+	return _DiskCount;
+}
+
+// Return the block device for disk
+BlockDevice* NvmeGetBlockDevice(int disk)
+{
+	if (disk < 0 || disk >= _DiskCount)
+	{
+		return 0;
+	}
+	return &_Disks[disk].Device;
+}
@@ -0,0 +1,401 @@
+#include <hal.h>
+#include <pci.h>
+#include <string.h>
+#include "virtualmemorymanager.h"
+
+// PCI bus support: configuration space access, enumeration, BARs and MSI
+
+#define	PCI_CONFIG_ADDRESS		0xcf8
+#define	PCI_CONFIG_DATA			0xcfc
+
+// Set when a function answers with no vendor
+#define	PCI_VENDOR_NONE			0xffff
+
+// Header type bit saying the device has more than one function
+#define	PCI_HEADER_MULTIFUNCTION	0x80
+
+// Header layouts
+#define	PCI_HEADER_DEVICE			0x00
+#define	PCI_HEADER_BRIDGE			0x01
+
+//	Low bits of a BAR
+
+#define	PCI_BAR_SPACE_IO			0x01
+#define	PCI_BAR_MEMORY_TYPE			0x06
+#define	PCI_BAR_MEMORY_64			0x04
+#define	PCI_BAR_MEMORY_PREFETCHABLE	0x08
+
+//	MSI capability registers, offsets from the capability
+
+#define	PCI_MSI_CONTROL				0x02
+#define	PCI_MSI_ADDRESS				0x04
+#define	PCI_MSI_DATA_32				0x08	// Data register if the address is 32 bits
+#define	PCI_MSI_ADDRESS_UPPER		0x08
+#define	PCI_MSI_DATA_64				0x0c	// Data register if the address is 64 bits
+
+#define	PCI_MSI_CONTROL_ENABLE		0x0001
+#define	PCI_MSI_CONTROL_MME			0x0070	// Vectors enabled, as a power of two
+#define	PCI_MSI_CONTROL_64BIT		0x0080
+
+// MSI messages are writes to the local APIC, with the target APIC ID in bits 12-19
+#define	PCI_MSI_ADDRESS_BASE		0xfee00000
+#define	PCI_MSI_ADDRESS_DEST_SHIFT	12
+
+// Vectors handed out for MSI, between the PICs' and the APIC spurious vector
+#define	PCI_MSI_FIRST_VECTOR		0x40
+#define	PCI_MSI_LAST_VECTOR			0xef
+
+static PciDevice _Devices[PCI_MAX_DEVICES];
+static int _DeviceCount = 0;
+
+// Next free MSI vector
+static int _NextMsiVector = PCI_MSI_FIRST_VECTOR;
+
+// Set once the local APIC is ready to take MSIs
+static bool _ApicEnabled = false;
+
+// Point the configuration data port at a register
+static void PCI_SelectRegister(PciAddress address, uint8_t offset)
+{
+	HAL_OutputDwordToPort(PCI_CONFIG_ADDRESS,
+						  0x80000000 | ((uint32_t)address.Bus << 16) | ((uint32_t)(address.Device & 0x1f) << 11) |
+						  ((uint32_t)(address.Function & 0x7) << 8) | (offset & 0xfc));
+}
+
+// Read a configuration space register
+uint32_t PCI_ReadConfig32(PciAddress address, uint8_t offset)
+{
+	PCI_SelectRegister(address, offset);
+	return HAL_InputDwordFromPort(PCI_CONFIG_DATA);
+}
+
+uint16_t PCI_ReadConfig16(PciAddress address, uint8_t offset)
+{
+	return (uint16_t)(PCI_ReadConfig32(address, offset) >> ((offset & 2) * 8));
+}
+
+uint8_t PCI_ReadConfig8(PciAddress address, uint8_t offset)
+{
+	return (uint8_t)(PCI_ReadConfig32(address, offset) >> ((offset & 3) * 8));
+}
+
+// Write a configuration space register
+void PCI_WriteConfig32(PciAddress address, uint8_t offset, uint32_t value)
+{
+	PCI_SelectRegister(address, offset);
+	HAL_OutputDwordToPort(PCI_CONFIG_DATA, value);
+}
+
+void PCI_WriteConfig16(PciAddress address, uint8_t offset, uint16_t value)
+{
+	// Write just the word, so the register next to it (e.g. the write-one-to-clear
+	// status bits beside the command register) is left alone
+	PCI_SelectRegister(address, offset);
+	HAL_OutputWordToPort(PCI_CONFIG_DATA + (offset & 2), value);
+}
+
+// Decode and size the BARs of a function. Decoding is turned off while each BAR
+// holds all ones, so the function cannot claim addresses meant for something else
+static void PCI_SizeBars(PciDevice* device)
+{
+	PciAddress address = device->Address;
+	int count = 0;
+
+	switch (device->HeaderType & ~PCI_HEADER_MULTIFUNCTION)
+	{
+		case PCI_HEADER_DEVICE:
+			count = PCI_BAR_COUNT;
+			break;
+		case PCI_HEADER_BRIDGE:
+			count = 2;
+			break;
+	}
+	uint16_t command = PCI_ReadConfig16(address, PCI_CONFIG_COMMAND);
+	PCI_WriteConfig16(address, PCI_CONFIG_COMMAND, command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+	for (int n = 0; n < count; n++)
+	{
+		uint8_t offset = (uint8_t)(PCI_CONFIG_BAR0 + n * 4);
+		PciBar* bar = &device->Bars[n];
+		uint32_t value = PCI_ReadConfig32(address, offset);
+		PCI_WriteConfig32(address, offset, 0xffffffff);
+		uint32_t mask = PCI_ReadConfig32(address, offset);
+		PCI_WriteConfig32(address, offset, value);
+		if (mask == 0)
+		{
+			continue;
+		}
+		if (value & PCI_BAR_SPACE_IO)
+		{
+			bar->Flags = PCI_BAR_IO;
+			bar->Base = value & ~0x3;
+			bar->Size = (~(mask & ~0x3) + 1) & 0xffff;
+			continue;
+		}
+		bar->Base = value & ~0xf;
+		bar->Size = ~(mask & ~0xf) + 1;
+		bar->Flags = (value & PCI_BAR_MEMORY_PREFETCHABLE) ? PCI_BAR_PREFETCHABLE : 0;
+		if ((value & PCI_BAR_MEMORY_TYPE) == PCI_BAR_MEMORY_64 && n + 1 < count)
+		{
+			// The upper half of the address is in the next BAR
+			n++;
+			bar->Flags |= PCI_BAR_64BIT;
+			if (PCI_ReadConfig32(address, (uint8_t)(offset + 4)) != 0 || (mask & ~0xf) == 0)
+			{
+				bar->Flags |= PCI_BAR_HIGH;
+			}
+		}
+	}
+	PCI_WriteConfig16(address, PCI_CONFIG_COMMAND, command);
+}
+
+// Find the offset of the MSI capability, or 0 if there is none
+static uint8_t PCI_FindMsiCapability(PciAddress address)
+{
+	if (!(PCI_ReadConfig16(address, PCI_CONFIG_STATUS) & PCI_STATUS_CAPABILITIES))
+	{
+		return 0;
+	}
+	uint8_t offset = PCI_ReadConfig8(address, PCI_CONFIG_CAPABILITIES) & ~0x3;
+	// The list lives in the 192 bytes after the header, so it cannot be longer than 48
+	for (int i = 0; i < 48 && offset != 0; i++)
+	{
+		if (PCI_ReadConfig8(address, offset) == PCI_CAPABILITY_MSI)
+		{
+			return offset;
+		}
+		offset = PCI_ReadConfig8(address, (uint8_t)(offset + 1)) & ~0x3;
+	}
+	return 0;
+}
+
+// Record the function at address
+static void PCI_AddDevice(PciAddress address)
+{
+	if (_DeviceCount == PCI_MAX_DEVICES)
+	{
+		return;
+	}
+	PciDevice* device = &_Devices[_DeviceCount++];
+	memset(device, 0, sizeof(PciDevice));
+	device->Address = address;
+	device->Vendor = PCI_ReadConfig16(address, PCI_CONFIG_VENDOR_ID);
+	device->Device = PCI_ReadConfig16(address, PCI_CONFIG_DEVICE_ID);
+	device->Class = PCI_ReadConfig8(address, PCI_CONFIG_CLASS);
+	device->Subclass = PCI_ReadConfig8(address, PCI_CONFIG_SUBCLASS);
+	device->ProgIf = PCI_ReadConfig8(address, PCI_CONFIG_PROG_IF);
+	device->Revision = PCI_ReadConfig8(address, PCI_CONFIG_REVISION);
+	device->HeaderType = PCI_ReadConfig8(address, PCI_CONFIG_HEADER_TYPE);
+	device->InterruptLine = PCI_ReadConfig8(address, PCI_CONFIG_INTERRUPT_LINE);
+	device->MsiCapability = PCI_FindMsiCapability(address);
+	device->MsiVector = -1;
+	PCI_SizeBars(device);
+}
+
+// Walk the buses and record every function
+int PCI_Initialise()
+{
+	PciAddress current;
+
+	_DeviceCount = 0;
+	for (int bus = 0; bus < 256; bus++)
+	{
+		for (int device = 0; device < 32; device++)
+		{
+			current.Bus = (uint8_t)bus;
+			current.Device = (uint8_t)device;
+			current.Function = 0;
+			if (PCI_ReadConfig16(current, PCI_CONFIG_VENDOR_ID) == PCI_VENDOR_NONE)
+			{
+				continue;
+			}
+			int functions = (PCI_ReadConfig8(current, PCI_CONFIG_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION) ? 8 : 1;
+			for (int function = 0; function < functions; function++)
+			{
+				current.Function = (uint8_t)function;
+				if (PCI_ReadConfig16(current, PCI_CONFIG_VENDOR_ID) != PCI_VENDOR_NONE)
+				{
+					PCI_AddDevice(current);
+				}
+			}
+		}
+	}
+	return _DeviceCount;
+}
+
+// Return the number of functions found
+int PCI_GetDeviceCount()
+{
+	return _DeviceCount;
+}
+
+// Return function index
+PciDevice* PCI_GetDevice(int index)
+{
+	if (index < 0 || index >= _DeviceCount)
+	{
+		return 0;
+	}
+	return &_Devices[index];
+}
+
+// Return the function at address
+PciDevice* PCI_GetDeviceAt(PciAddress address)
+{
+	for (int i = 0; i < _DeviceCount; i++)
+	{
+		PciAddress* current = &_Devices[i].Address;
+		if (current->Bus == address.Bus && current->Device == address.Device && current->Function == address.Function)
+		{
+			return &_Devices[i];
+		}
+	}
+	return 0;
+}
+
+// Find the index'th function with the given class and subclass
+bool PCI_FindClass(uint8_t classCode, uint8_t subclass, int index, PciAddress* address)
+{
+	for (int i = 0; i < _DeviceCount; i++)
+	{
+		if (_Devices[i].Class == classCode && _Devices[i].Subclass == subclass && index-- == 0)
+		{
+			*address = _Devices[i].Address;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Find the index'th function with the given vendor and device id
+bool PCI_FindDevice(uint16_t vendor, uint16_t device, int index, PciAddress* address)
+{
+	for (int i = 0; i < _DeviceCount; i++)
+	{
+		if (_Devices[i].Vendor == vendor && _Devices[i].Device == device && index-- == 0)
+		{
+			*address = _Devices[i].Address;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Return BAR n of a function
+uint32_t PCI_GetBar(PciAddress address, int n)
+{
+	return PCI_ReadConfig32(address, (uint8_t)(PCI_CONFIG_BAR0 + n * 4));
+}
+
+// Turn on bits in the command register
+void PCI_EnableCommand(PciAddress address, uint16_t bits)
+{
+	PCI_WriteConfig16(address, PCI_CONFIG_COMMAND, PCI_ReadConfig16(address, PCI_CONFIG_COMMAND) | bits);
+}
+
+// Map memory BAR n of a function
+void* PCI_MapBar(PciDevice* device, int n)
+{
+	if (n < 0 || n >= PCI_BAR_COUNT)
+	{
+		return 0;
+	}
+	PciBar* bar = &device->Bars[n];
+	if (bar->Size == 0 || (bar->Flags & (PCI_BAR_IO | PCI_BAR_HIGH)))
+	{
+		return 0;
+	}
+	void* registers = VMM_MapDevice(bar->Base, bar->Size);
+	if (registers)
+	{
+		PCI_EnableCommand(device->Address, PCI_COMMAND_MEMORY);
+	}
+	return registers;
+}
+
+// Turn on the local APIC, the first time someone wants MSI
+static bool PCI_EnableApic()
+{
+	if (!_ApicEnabled)
+	{
+		uint32_t physical = HAL_GetLocalApicAddress();
+		void* registers = physical ? VMM_MapDevice(physical, 4096) : 0;
+		if (!registers)
+		{
+			return false;
+		}
+		HAL_EnableLocalApic(registers);
+		_ApicEnabled = true;
+	}
+	return true;
+}
+
+// Route the function's interrupt to handler through MSI
+int PCI_EnableMsi(PciDevice* device, void (*handler)())
+{
+	if (device->MsiVector >= 0)
+	{
+		return device->MsiVector;
+	}
+	if (!device->MsiCapability || _NextMsiVector > PCI_MSI_LAST_VECTOR || !PCI_EnableApic())
+	{
+		return -1;
+	}
+	int vector = _NextMsiVector++;
+	HAL_SetInterruptVector(vector, handler);
+
+	PciAddress address = device->Address;
+	uint8_t capability = device->MsiCapability;
+	uint16_t control = PCI_ReadConfig16(address, (uint8_t)(capability + PCI_MSI_CONTROL));
+	PCI_WriteConfig32(address, (uint8_t)(capability + PCI_MSI_ADDRESS),
+					  PCI_MSI_ADDRESS_BASE | ((uint32_t)HAL_GetLocalApicId() << PCI_MSI_ADDRESS_DEST_SHIFT));
+	if (control & PCI_MSI_CONTROL_64BIT)
+	{
+		PCI_WriteConfig32(address, (uint8_t)(capability + PCI_MSI_ADDRESS_UPPER), 0);
+		PCI_WriteConfig16(address, (uint8_t)(capability + PCI_MSI_DATA_64), (uint16_t)vector);
+	}
+	else
+	{
+		PCI_WriteConfig16(address, (uint8_t)(capability + PCI_MSI_DATA_32), (uint16_t)vector);
+	}
+	// One vector, fixed delivery, edge triggered
+	control = (control & ~PCI_MSI_CONTROL_MME) | PCI_MSI_CONTROL_ENABLE;
+	PCI_WriteConfig16(address, (uint8_t)(capability + PCI_MSI_CONTROL), control);
+	PCI_EnableCommand(address, PCI_COMMAND_INTX_DISABLE);
+	device->MsiVector = vector;
+	return vector;
+}
+
+// Return a short description of a class
+const char* PCI_GetClassName(uint8_t classCode, uint8_t subclass)
+{
+	switch (classCode)
+	{
+		case 0x01:
+			switch (subclass)
+			{
+				case 0x00: return "SCSI controller";
+				case 0x01: return "IDE controller";
+				case 0x02: return "Floppy controller";
+				case 0x06: return "SATA controller";
+				case 0x08: return "NVMe controller";
+			}
+			return "Storage controller";
+		case 0x02: return "Network controller";
+		case 0x03: return "Display controller";
+		case 0x04: return "Multimedia controller";
+		case 0x05: return "Memory controller";
+		case 0x06:
+			switch (subclass)
+			{
+				case 0x00: return "Host bridge";
+				case 0x01: return "ISA bridge";
+				case 0x04: return "PCI bridge";
+			}
+			return "Bridge";
+		case 0x07: return "Communication controller";
+		case 0x08: return "System peripheral";
+		case 0x0c:
+			return subclass == 0x03 ? "USB controller" : "Serial bus controller";
+	}
+	return "Unknown device";
+}
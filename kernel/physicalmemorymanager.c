@@ -5,6 +5,10 @@
 // The amount of blocks
 #define PMM_BLOCK_SIZE 4096
 
+// ISA DMA can only address the first 16MB, and its address counter wraps within a 64K bank
+#define PMM_DMA_LIMIT 0x1000000
+#define PMM_DMA_BANK_SIZE 0x10000
+
 // The memory bitmap, as a 32 bit array pointer.
 uint32_t *_memBitmap = 0;
 
@@ -316,6 +320,49 @@ void PMM_FreeBlocks(void *p, size_t size)
     }
 }
 
+// Allocate blocks for ISA DMA transfers. The bitmap is walked a block at a time, as
+// the run has to be restarted at every 64K bank as well as at every used block.
+// @param count : the amount of frames needed (no more than fit in a 64K bank)
+// @return the free memory, or NULL if there is no suitable run.
+void* PMM_AllocateDmaBlocks(size_t count)
+{
+    uint32_t blocksPerBank = PMM_DMA_BANK_SIZE / PMM_BLOCK_SIZE;
+    uint32_t limit = PMM_DMA_LIMIT / PMM_BLOCK_SIZE;
+
+    if (count == 0 || count > blocksPerBank || count > PMM_GetFreeBlockCount())
+    {
+        return (void*) NULL;
+    }
+    if (limit > _totalBlocks)
+    {
+        limit = _totalBlocks;
+    }
+
+    uint32_t run = 0;
+    for (uint32_t block = 0; block < limit; block++)
+    {
+        // A run can't carry on into the next bank
+        if (block % blocksPerBank == 0)
+        {
+            run = 0;
+        }
+
+        if (_memBitmap[block / 32] & (0x1 << (block % 32)))
+        {
+            run = 0;
+        }
+        else if (++run == count)
+        {
+            uint32_t memAddr = (block + 1 - count) * PMM_BLOCK_SIZE;
+            PMM_MarkRegionAsUnavailable(memAddr, count * PMM_BLOCK_SIZE);
+            return (void*) memAddr;
+        }
+    }
+
+    // We've failed. Return NULL
+    return (void*) NULL;
+}
+
 // Get the amount of available physical memory (in K)
 // @return the size of the available memory in kb.
 uint32_t PMM_GetAvailableMemorySize()
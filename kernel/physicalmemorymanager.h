@@ -35,6 +35,11 @@ void * PMM_AllocateBlocks(size_t size);
 
 void PMM_FreeBlocks(void* p, size_t size); 
 
+// Allocate 'count' contiguous blocks that the ISA DMA controller can reach, i.e. below 16MB
+// and not crossing a 64K boundary. Free them with PMM_FreeBlocks
+
+void* PMM_AllocateDmaBlocks(size_t count); 
+
 // Get the amount of available physical memory (in K)
 
 size_t PMM_GetAvailableMemorySize(); 
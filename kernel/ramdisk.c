@@ -0,0 +1,119 @@
+#include <ramdisk.h>
+#include <string.h>
+#include "physicalmemorymanager.h"
+#include "virtualmemorymanager.h"
+
+static BlockDevice _RamDisks[RAMDISK_MAX];
+static int _RamDiskCount = 0;
+
+// Read from the RAM disk
+static int RamDisk_Read(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	memcpy(buffer, (uint8_t*)device->Private + lba * device->SectorSize, count * device->SectorSize);
+	return count;
+}
+
+// Write to the RAM disk
+static int RamDisk_Write(BlockDevice* device, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+	memcpy((uint8_t*)device->Private + lba * device->SectorSize, buffer, count * device->SectorSize);
+	return count;
+}
+
+// Set up the next free RAM disk, without registering it
+static BlockDevice* RamDisk_Allocate(const char* name, uint32_t sectorCount, uint32_t sectorSize)
+{
+	if (_RamDiskCount >= RAMDISK_MAX || sectorCount == 0 || sectorSize == 0 || BlockDevice_Find(name))
+	{
+		return 0;
+	}
+	uint32_t size = sectorCount * sectorSize;
+	uint32_t blocks = (size + PMM_GetBlockSize() - 1) / PMM_GetBlockSize();
+	uint8_t* memory = (uint8_t*)PMM_AllocateBlocks(blocks);
+	if (!memory)
+	{
+		return 0;
+	}
+	if (!VMM_IdentityMapRange(memory, blocks * PMM_GetBlockSize()))
+	{
+		PMM_FreeBlocks(memory, blocks);
+		return 0;
+	}
+
+	BlockDevice* device = &_RamDisks[_RamDiskCount];
+	device->Name = name;
+	device->SectorSize = sectorSize;
+	device->SectorCount = sectorCount;
+	device->QueueDepth = 1;
+	device->Read = RamDisk_Read;
+	device->Write = RamDisk_Write;
+	device->Flush = 0;
+	device->Submit = 0;
+	device->Poll = 0;
+	device->MediaGeneration = 0;
+	device->Revalidate = 0;
+	device->Private = memory;
+	return device;
+}
+
+// Give back the memory of a RAM disk that was never registered
+static void RamDisk_Free(BlockDevice* device)
+{
+	uint32_t size = device->SectorCount * device->SectorSize;
+	PMM_FreeBlocks(device->Private, (size + PMM_GetBlockSize() - 1) / PMM_GetBlockSize());
+}
+
+// Register a RAM disk set up by RamDisk_Allocate
+static BlockDevice* RamDisk_Register(BlockDevice* device)
+{
+	if (!BlockDevice_Register(device))
+	{
+		RamDisk_Free(device);
+		return 0;
+	}
+	_RamDiskCount++;
+	return device;
+}
+
+// Create and register a RAM disk
+BlockDevice* RamDisk_Create(const char* name, uint32_t sectorCount, uint32_t sectorSize)
+{
+	BlockDevice* device = RamDisk_Allocate(name, sectorCount, sectorSize);
+	if (!device)
+	{
+		return 0;
+	}
+	memset(device->Private, 0, sectorCount * sectorSize);
+	return RamDisk_Register(device);
+}
+
+// Create and register a RAM disk holding a copy of source
+BlockDevice* RamDisk_CreateFrom(const char* name, BlockDevice* source, uint32_t chunkSectors)
+{
+	if (!source)
+	{
+		return 0;
+	}
+	if (chunkSectors == 0)
+	{
+		chunkSectors = RAMDISK_COPY_SECTORS;
+	}
+	BlockDevice* device = RamDisk_Allocate(name, source->SectorCount, source->SectorSize);
+	if (!device)
+	{
+		return 0;
+	}
+	// Copy straight into the disk's memory
+	uint8_t* memory = (uint8_t*)device->Private;
+	for (uint32_t lba = 0; lba < source->SectorCount; lba += chunkSectors)
+	{
+		uint32_t count = source->SectorCount - lba;
+		count = count > chunkSectors ? chunkSectors : count;
+		if (BlockDevice_Read(source, lba, count, memory + lba * source->SectorSize) != 0)
+		{
+			RamDisk_Free(device);
+			return 0;
+		}
+	}
+	return RamDisk_Register(device);
+}
@@ -0,0 +1,618 @@
+#include <hal.h>
+#include <virtioblk.h>
+#include <pci.h>
+#include <string.h>
+#include "physicalmemorymanager.h"
+#include "virtualmemorymanager.h"
+
+// virtio-blk paravirtual disk support
+//
+// Requests are handed to the host through a split virtqueue: a table of descriptors naming
+// guest memory, an available ring we add descriptor chains to and a used ring the host returns
+// them on. Each request is a header, the data and a status byte. Where the host supports
+// indirect descriptors the whole chain lives in a per-request table and takes one slot of the
+// ring, so a multi-page transfer costs one ring entry and one notification. We only notify
+// (kick) the host when it has not told us it is already looking at the ring, kicks for requests
+// submitted from completion routines are held until the interrupt has been dealt with, and
+// interrupts are suppressed while the used ring is being emptied.
+
+//	Legacy virtio PCI registers, offsets from BAR0 (an I/O port range)
+
+#define	VIRTIO_REG_DEVICE_FEATURES	0x00
+#define	VIRTIO_REG_GUEST_FEATURES	0x04
+#define	VIRTIO_REG_QUEUE_ADDRESS	0x08
+#define	VIRTIO_REG_QUEUE_SIZE		0x0c
+#define	VIRTIO_REG_QUEUE_SELECT		0x0e
+#define	VIRTIO_REG_QUEUE_NOTIFY		0x10
+#define	VIRTIO_REG_DEVICE_STATUS	0x12
+#define	VIRTIO_REG_ISR_STATUS		0x13
+#define	VIRTIO_REG_CONFIG			0x14	// Device specific configuration (no MSI-X)
+
+//	Device status bits
+
+#define	VIRTIO_STATUS_ACKNOWLEDGE	0x01
+#define	VIRTIO_STATUS_DRIVER		0x02
+#define	VIRTIO_STATUS_DRIVER_OK		0x04
+#define	VIRTIO_STATUS_FAILED		0x80
+
+//	Feature bits
+
+#define	VIRTIO_BLK_F_RO				0x00000020
+#define	VIRTIO_BLK_F_FLUSH			0x00000200
+#define	VIRTIO_RING_F_INDIRECT_DESC	0x10000000
+
+//	Block configuration, offsets from VIRTIO_REG_CONFIG
+
+#define	VIRTIO_BLK_CONFIG_CAPACITY	0x00	// 64 bits, in 512 byte sectors
+
+//	Request types
+
+#define	VIRTIO_BLK_T_IN				0
+#define	VIRTIO_BLK_T_OUT			1
+#define	VIRTIO_BLK_T_FLUSH			4
+
+#define	VIRTIO_BLK_S_OK				0
+
+//	Descriptor flags
+
+#define	VIRTQ_DESC_F_NEXT			0x0001
+#define	VIRTQ_DESC_F_WRITE			0x0002	// The device writes to the buffer
+#define	VIRTQ_DESC_F_INDIRECT		0x0004
+
+// Set in the available ring flags to ask the host not to interrupt
+#define	VIRTQ_AVAIL_F_NO_INTERRUPT	0x0001
+
+// Set in the used ring flags by the host when it does not need kicking
+#define	VIRTQ_USED_F_NO_NOTIFY		0x0001
+
+// The PCI ids of a (transitional) virtio block device
+#define	VIRTIO_PCI_VENDOR			0x1af4
+#define	VIRTIO_PCI_DEVICE_BLK		0x1001
+
+#define	VIRTIO_BYTES_PER_SECTOR		512
+#define	VIRTIO_PAGE_SIZE			4096
+
+// Requests in flight on each disk
+#define	VIRTIO_BLK_MAX_REQUESTS		32
+
+// Descriptors in a request: header, status and the data, which needs at most 17 for 64K
+// even if every page is somewhere else
+#define	VIRTIO_BLK_MAX_DESCRIPTORS	20
+
+// Number of ticks to wait for a request before giving up on it
+#define	VIRTIO_TIMEOUT				300
+
+// Descriptor
+typedef struct _VirtqDescriptor
+{
+	uint32_t	Address;
+	uint32_t	AddressUpper;
+	uint32_t	Length;
+	uint16_t	Flags;
+	uint16_t	Next;
+} __attribute__((packed)) VirtqDescriptor;
+
+// Available ring. Followed by used event, which we do not use
+typedef struct _VirtqAvailable
+{
+	uint16_t	Flags;
+	uint16_t	Index;
+	uint16_t	Ring[];
+} __attribute__((packed)) VirtqAvailable;
+
+typedef struct _VirtqUsedElement
+{
+	uint32_t	Id;			// Head of the descriptor chain
+	uint32_t	Length;		// Bytes written by the device
+} __attribute__((packed)) VirtqUsedElement;
+
+// Used ring
+typedef struct _VirtqUsed
+{
+	uint16_t			Flags;
+	uint16_t			Index;
+	VirtqUsedElement	Ring[];
+} __attribute__((packed)) VirtqUsed;
+
+// Header of a request
+typedef struct _VirtioBlkHeader
+{
+	uint32_t	Type;
+	uint32_t	Reserved;
+	uint32_t	Sector;
+	uint32_t	SectorUpper;
+} __attribute__((packed)) VirtioBlkHeader;
+
+// What the device reads and writes for a request. Physically contiguous
+typedef struct _VirtioBlkSlot
+{
+	VirtqDescriptor		Table[VIRTIO_BLK_MAX_DESCRIPTORS];
+	VirtioBlkHeader		Header;
+	volatile uint8_t	Status;
+} VirtioBlkSlot;
+
+typedef struct _VirtioBlkDisk
+{
+	uint16_t				Base;				// I/O ports
+	uint16_t				QueueSize;			// Descriptors in the ring
+	VirtqDescriptor*		Descriptors;
+	volatile VirtqAvailable*	Available;
+	volatile VirtqUsed*		Used;
+	uint16_t				LastUsed;			// Used ring index we have got to
+	bool					Indirect;			// Host supports indirect descriptors
+	uint32_t				SlotCount;			// Requests that fit in the ring
+	uint32_t				SlotDescriptors;	// Ring descriptors each request takes
+	VirtioBlkSlot*			Slots;
+	BlockRequest*			Requests[VIRTIO_BLK_MAX_REQUESTS];
+	uint32_t				Active;				// Slots handed to the device
+	bool					KickPending;		// Requests added since the last kick
+	char					Name[4];
+	BlockDevice				Device;
+} VirtioBlkDisk;
+
+static VirtioBlkDisk _Disks[VIRTIO_BLK_MAX_DISKS];
+static int _DiskCount = 0;
+
+// Highest IRQ line any disk uses. The PICs take a non specific EOI, so acknowledging
+// this line acknowledges any of them
+static int _Irq = -1;
+
+// Set while the IRQ handler runs. Requests submitted from completion routines leave
+// interrupts alone and have their kicks held until the handler finishes
+static volatile bool _InInterrupt = false;
+
+// Stop the compiler moving memory accesses across this point. x86 does not reorder
+// stores with other stores, so this is all the ring needs
+static inline void VirtioBarrier()
+{
+	asm volatile("" ::: "memory");
+}
+
+// Tell the host there is something in the available ring, unless it says it does not need telling
+static void VirtioBlkKick(VirtioBlkDisk* disk)
+{
+	disk->KickPending = false;
+	VirtioBarrier();
+	if (!(disk->Used->Flags & VIRTQ_USED_F_NO_NOTIFY))
+	{
+		HAL_OutputWordToPort(disk->Base + VIRTIO_REG_QUEUE_NOTIFY, 0);
+	}
+}
+
+// Collect finished requests from the used ring
+static void VirtioBlkServiceDisk(VirtioBlkDisk* disk)
+{
+	for (;;)
+	{
+		// No interrupts for requests we are about to find anyway
+		disk->Available->Flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+		while (disk->LastUsed != disk->Used->Index)
+		{
+			VirtioBarrier();
+			uint32_t id = disk->Used->Ring[disk->LastUsed % disk->QueueSize].Id;
+			disk->LastUsed++;
+			uint32_t slot = id / disk->SlotDescriptors;
+			if (slot >= disk->SlotCount || !(disk->Active & (1u << slot)))
+			{
+				continue;
+			}
+			BlockRequest* request = disk->Requests[slot];
+			disk->Requests[slot] = 0;
+			disk->Active &= ~(1u << slot);
+			if (!request)
+			{
+				// Whoever submitted it gave up waiting
+				continue;
+			}
+			request->Status = disk->Slots[slot].Status == VIRTIO_BLK_S_OK ? BLOCK_REQUEST_DONE : BLOCK_REQUEST_ERROR;
+			if (request->Completion)
+			{
+				request->Completion(request);
+			}
+		}
+		disk->Available->Flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+		VirtioBarrier();
+		// Anything that finished while interrupts were off would otherwise wait for the next one
+		if (disk->LastUsed == disk->Used->Index)
+		{
+			break;
+		}
+	}
+	if (disk->KickPending)
+	{
+		VirtioBlkKick(disk);
+	}
+}
+
+void VirtioBlkServiceInterrupt()
+{
+	for (int i = 0; i < _DiskCount; i++)
+	{
+		// Reading the ISR status acknowledges the interrupt
+		if (HAL_InputByteFromPort(_Disks[i].Base + VIRTIO_REG_ISR_STATUS) & 1)
+		{
+			VirtioBlkServiceDisk(&_Disks[i]);
+		}
+	}
+}
+
+// virtio IRQ handler
+void I86_VirtioBlkInterruptHandler()
+{
+	asm("pushal");
+	asm("cli");
+
+	_InInterrupt = true;
+	VirtioBlkServiceInterrupt();
+	_InInterrupt = false;
+
+	// Tell HAL we are done
+	HAL_InterruptDone(_Irq);
+
+	asm("sti");
+	asm("popal");
+	asm("leave");
+	asm("iret");
+}
+
+// Fill in a descriptor
+static void VirtioBlkSetDescriptor(VirtqDescriptor* descriptor, uint32_t address, uint32_t length, uint16_t flags, uint16_t next)
+{
+	descriptor->Address = address;
+	descriptor->AddressUpper = 0;
+	descriptor->Length = length;
+	descriptor->Flags = flags;
+	descriptor->Next = next;
+}
+
+// Build the descriptor chain for a request in the slot's table. Returns the number of
+// descriptors, or 0 if part of the buffer is not mapped or it needs too many
+static int VirtioBlkBuildChain(VirtioBlkSlot* slot, BlockRequest* request, uint32_t type)
+{
+	int count = 0;
+
+	slot->Header.Type = type;
+	slot->Header.Reserved = 0;
+	slot->Header.Sector = request->LBA;
+	slot->Header.SectorUpper = 0;
+	slot->Status = 0xff;
+	VirtioBlkSetDescriptor(&slot->Table[count], VMM_GetPhysicalAddress(&slot->Header), sizeof(VirtioBlkHeader), VIRTQ_DESC_F_NEXT, 1);
+	count++;
+
+	// Data, one descriptor for each physically contiguous piece
+	uint16_t dataFlags = VIRTQ_DESC_F_NEXT | (request->Write ? 0 : VIRTQ_DESC_F_WRITE);
+	uint8_t* buffer = request->Buffer;
+	uint32_t bytes = request->Count * VIRTIO_BYTES_PER_SECTOR;
+	while (bytes > 0)
+	{
+		uint32_t physical = VMM_GetPhysicalAddress(buffer);
+		if (physical == 0)
+		{
+			return 0;
+		}
+		uint32_t piece = VIRTIO_PAGE_SIZE - (physical & (VIRTIO_PAGE_SIZE - 1));
+		piece = piece > bytes ? bytes : piece;
+		VirtqDescriptor* previous = &slot->Table[count - 1];
+		if (count > 1 && previous->Address + previous->Length == physical)
+		{
+			previous->Length += piece;
+		}
+		else
+		{
+			// Leave room for the status
+			if (count == VIRTIO_BLK_MAX_DESCRIPTORS - 1)
+			{
+				return 0;
+			}
+			VirtioBlkSetDescriptor(&slot->Table[count], physical, piece, dataFlags, (uint16_t)(count + 1));
+			count++;
+		}
+		buffer += piece;
+		bytes -= piece;
+	}
+	VirtioBlkSetDescriptor(&slot->Table[count], VMM_GetPhysicalAddress((void*)&slot->Status), 1, VIRTQ_DESC_F_WRITE, 0);
+	return count + 1;
+}
+
+// Put a request in the available ring. Returns -1 if every slot is in use or the buffer
+// cannot be described to the device
+static int VirtioBlkIssue(VirtioBlkDisk* disk, BlockRequest* request, uint32_t type)
+{
+	bool interruptsOff = !_InInterrupt;
+	int result = -1;
+
+	if (interruptsOff)
+	{
+		HAL_DisableInterrupts();
+	}
+	uint32_t slot = 0;
+	while (slot < disk->SlotCount && (disk->Active & (1u << slot)))
+	{
+		slot++;
+	}
+	if (slot < disk->SlotCount)
+	{
+		VirtioBlkSlot* entry = &disk->Slots[slot];
+		int count = VirtioBlkBuildChain(entry, request, type);
+		if (count > 0)
+		{
+			uint16_t head = (uint16_t)(slot * disk->SlotDescriptors);
+			if (disk->Indirect)
+			{
+				VirtioBlkSetDescriptor(&disk->Descriptors[head], VMM_GetPhysicalAddress(entry->Table),
+									   count * sizeof(VirtqDescriptor), VIRTQ_DESC_F_INDIRECT, 0);
+			}
+			else
+			{
+				// The slot owns SlotDescriptors entries of the ring, starting at head
+				for (int i = 0; i < count; i++)
+				{
+					disk->Descriptors[head + i] = entry->Table[i];
+					disk->Descriptors[head + i].Next = (uint16_t)(head + entry->Table[i].Next);
+				}
+			}
+			request->Status = BLOCK_REQUEST_PENDING;
+			disk->Requests[slot] = request;
+			disk->Active |= 1u << slot;
+
+			// The descriptors must be visible before the ring entry, and the entry before the index
+			uint16_t index = disk->Available->Index;
+			disk->Available->Ring[index % disk->QueueSize] = head;
+			VirtioBarrier();
+			disk->Available->Index = index + 1;
+
+			// A completion routine's requests are kicked together once the used ring is empty
+			disk->KickPending = true;
+			if (!_InInterrupt)
+			{
+				VirtioBlkKick(disk);
+			}
+			result = 0;
+		}
+	}
+	if (interruptsOff)
+	{
+		HAL_EnableInterrupts();
+	}
+	return result;
+}
+
+// Block device Submit
+static int VirtioBlkSubmit(BlockDevice* device, BlockRequest* request)
+{
+	if (request->Count > VIRTIO_BLK_MAX_SECTORS)
+	{
+		return -1;
+	}
+	return VirtioBlkIssue((VirtioBlkDisk*)device->Private, request, request->Write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN);
+}
+
+// Issue a request and wait for it. Waits for a slot if the disk is busy with queued requests
+static bool VirtioBlkExecute(VirtioBlkDisk* disk, BlockRequest* request, uint32_t type)
+{
+	uint32_t timeout = HAL_GetTickCount() + VIRTIO_TIMEOUT;
+
+	request->Completion = 0;
+	request->Context = 0;
+	while (VirtioBlkIssue(disk, request, type) != 0)
+	{
+		HAL_DisableInterrupts();
+		// A buffer we cannot use will never work, a busy disk will free a slot eventually
+		if (disk->Active == 0 || HAL_GetTickCount() > timeout)
+		{
+			HAL_EnableInterrupts();
+			return false;
+		}
+		HAL_WaitForInterrupt();
+	}
+	HAL_DisableInterrupts();
+	while (request->Status == BLOCK_REQUEST_PENDING)
+	{
+		if (HAL_GetTickCount() > timeout)
+		{
+			// The device still owns the slot, so it stays busy until the host hands it back,
+			// but the request is on our stack and must be forgotten
+			for (uint32_t slot = 0; slot < disk->SlotCount; slot++)
+			{
+				if (disk->Requests[slot] == request)
+				{
+					disk->Requests[slot] = 0;
+				}
+			}
+			HAL_EnableInterrupts();
+			return false;
+		}
+		HAL_WaitForInterrupt();
+		HAL_DisableInterrupts();
+	}
+	HAL_EnableInterrupts();
+	return request->Status == BLOCK_REQUEST_DONE;
+}
+
+// Block device read and write
+static int VirtioBlkTransfer(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer, bool write)
+{
+	BlockRequest request;
+
+	request.LBA = lba;
+	request.Count = count > VIRTIO_BLK_MAX_SECTORS ? VIRTIO_BLK_MAX_SECTORS : count;
+	request.Buffer = buffer;
+	request.Write = write;
+	if (!VirtioBlkExecute((VirtioBlkDisk*)device->Private, &request, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN))
+	{
+		return 0;
+	}
+	return request.Count;
+}
+
+static int VirtioBlkRead(BlockDevice* device, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+	return VirtioBlkTransfer(device, lba, count, buffer, false);
+}
+
+static int VirtioBlkWrite(BlockDevice* device, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+	return VirtioBlkTransfer(device, lba, count, (uint8_t*)buffer, true);
+}
+
+// Ask the host to write out its cache
+static int VirtioBlkFlush(BlockDevice* device)
+{
+	BlockRequest request;
+
+	request.LBA = 0;
+	request.Count = 0;
+	request.Buffer = 0;
+	request.Write = false;
+	return VirtioBlkExecute((VirtioBlkDisk*)device->Private, &request, VIRTIO_BLK_T_FLUSH) ? 0 : -1;
+}
+
+// Set up queue 0 of a disk. Returns false if it has none or the memory could not be found
+static bool VirtioBlkSetupQueue(VirtioBlkDisk* disk)
+{
+	HAL_OutputWordToPort(disk->Base + VIRTIO_REG_QUEUE_SELECT, 0);
+	disk->QueueSize = HAL_InputWordFromPort(disk->Base + VIRTIO_REG_QUEUE_SIZE);
+	if (disk->QueueSize == 0)
+	{
+		return false;
+	}
+
+	// Descriptors, then the available ring, then (on the next page) the used ring
+	uint32_t availableOffset = disk->QueueSize * sizeof(VirtqDescriptor);
+	uint32_t usedOffset = (availableOffset + 6 + 2 * disk->QueueSize + VIRTIO_PAGE_SIZE - 1) & ~(VIRTIO_PAGE_SIZE - 1);
+	uint32_t bytes = usedOffset + ((6 + 8 * disk->QueueSize + VIRTIO_PAGE_SIZE - 1) & ~(VIRTIO_PAGE_SIZE - 1));
+	uint32_t ringBlocks = bytes / VIRTIO_PAGE_SIZE;
+	uint8_t* ring = (uint8_t*)PMM_AllocateBlocks(ringBlocks);
+	if (!ring)
+	{
+		return false;
+	}
+	if (!VMM_IdentityMapRange(ring, bytes))
+	{
+		PMM_FreeBlocks(ring, ringBlocks);
+		return false;
+	}
+	memset(ring, 0, bytes);
+	disk->Descriptors = (VirtqDescriptor*)ring;
+	disk->Available = (volatile VirtqAvailable*)(ring + availableOffset);
+	disk->Used = (volatile VirtqUsed*)(ring + usedOffset);
+	disk->LastUsed = 0;
+
+	// With indirect descriptors a request takes one ring entry, otherwise it needs room for the longest chain
+	disk->SlotDescriptors = disk->Indirect ? 1 : VIRTIO_BLK_MAX_DESCRIPTORS;
+	disk->SlotCount = disk->QueueSize / disk->SlotDescriptors;
+	disk->SlotCount = disk->SlotCount > VIRTIO_BLK_MAX_REQUESTS ? VIRTIO_BLK_MAX_REQUESTS : disk->SlotCount;
+	if (disk->SlotCount == 0)
+	{
+		PMM_FreeBlocks(ring, ringBlocks);
+		disk->Descriptors = 0;
+		return false;
+	}
+	uint32_t slotBlocks = (disk->SlotCount * sizeof(VirtioBlkSlot) + VIRTIO_PAGE_SIZE - 1) / VIRTIO_PAGE_SIZE;
+	disk->Slots = (VirtioBlkSlot*)PMM_AllocateBlocks(slotBlocks);
+	if (!disk->Slots || !VMM_IdentityMapRange(disk->Slots, slotBlocks * VIRTIO_PAGE_SIZE))
+	{
+		if (disk->Slots)
+		{
+			PMM_FreeBlocks(disk->Slots, slotBlocks);
+			disk->Slots = 0;
+		}
+		PMM_FreeBlocks(ring, ringBlocks);
+		disk->Descriptors = 0;
+		return false;
+	}
+	memset(disk->Slots, 0, slotBlocks * VIRTIO_PAGE_SIZE);
+	disk->Active = 0;
+	disk->KickPending = false;
+
+	HAL_OutputDwordToPort(disk->Base + VIRTIO_REG_QUEUE_ADDRESS, VMM_GetPhysicalAddress(ring) / VIRTIO_PAGE_SIZE);
+	return true;
+}
+
+// Bring up the device at address. Returns false if it cannot be used
+static bool VirtioBlkSetupDisk(VirtioBlkDisk* disk, PciAddress address)
+{
+	uint32_t bar = PCI_GetBar(address, 0);
+	if (!(bar & 1))
+	{
+		// Legacy devices put their registers in I/O space
+		return false;
+	}
+	disk->Base = (uint16_t)(bar & ~3);
+	uint16_t pciCommand = PCI_ReadConfig16(address, PCI_CONFIG_COMMAND);
+	PCI_WriteConfig16(address, PCI_CONFIG_COMMAND,
+					  (pciCommand | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER) & ~PCI_COMMAND_INTX_DISABLE);
+
+	// Reset, then tell the device we have found it and know how to drive it
+	HAL_OutputByteToPort(disk->Base + VIRTIO_REG_DEVICE_STATUS, 0);
+	HAL_OutputByteToPort(disk->Base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	HAL_OutputByteToPort(disk->Base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	uint32_t features = HAL_InputDwordFromPort(disk->Base + VIRTIO_REG_DEVICE_FEATURES);
+	features &= VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH | VIRTIO_RING_F_INDIRECT_DESC;
+	HAL_OutputDwordToPort(disk->Base + VIRTIO_REG_GUEST_FEATURES, features);
+	disk->Indirect = (features & VIRTIO_RING_F_INDIRECT_DESC) != 0;
+
+	if (!VirtioBlkSetupQueue(disk))
+	{
+		HAL_OutputByteToPort(disk->Base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+		return false;
+	}
+
+	uint32_t capacityUpper = HAL_InputDwordFromPort(disk->Base + VIRTIO_REG_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY + 4);
+	uint32_t capacity = HAL_InputDwordFromPort(disk->Base + VIRTIO_REG_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY);
+	disk->Device.SectorCount = capacityUpper ? 0xffffffff : capacity;
+	disk->Device.SectorSize = VIRTIO_BYTES_PER_SECTOR;
+	disk->Device.QueueDepth = disk->SlotCount;
+	disk->Device.Read = VirtioBlkRead;
+	disk->Device.Write = (features & VIRTIO_BLK_F_RO) ? 0 : VirtioBlkWrite;
+	disk->Device.Flush = (features & VIRTIO_BLK_F_FLUSH) ? VirtioBlkFlush : 0;
+	disk->Device.Submit = VirtioBlkSubmit;
+	disk->Device.Poll = 0;
+	disk->Device.MediaGeneration = 0;
+	disk->Device.Revalidate = 0;
+	disk->Device.Private = disk;
+
+	HAL_OutputByteToPort(disk->Base + VIRTIO_REG_DEVICE_STATUS,
+						 VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	return true;
+}
+
+// Find the virtio block devices and register them
+int VirtioBlkInstall(int irqBaseVector)
+{
+	PciAddress address;
+
+	for (int index = 0; _DiskCount < VIRTIO_BLK_MAX_DISKS &&
+						PCI_FindDevice(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLK, index, &address); index++)
+	{
+		uint8_t line = PCI_ReadConfig8(address, PCI_CONFIG_INTERRUPT_LINE);
+		VirtioBlkDisk* disk = &_Disks[_DiskCount];
+		// Without an IRQ nothing would complete
+		if (line > 15 || !VirtioBlkSetupDisk(disk, address))
+		{
+			continue;
+		}
+		HAL_SetInterruptVector(irqBaseVector + line, I86_VirtioBlkInterruptHandler);
+		_Irq = line > _Irq ? line : _Irq;
+
+		disk->Name[0] = 'v';
+		disk->Name[1] = 'd';
+		disk->Name[2] = (char)('0' + _DiskCount);
+		disk->Name[3] = 0;
+		disk->Device.Name = disk->Name;
+		_DiskCount++;
+		BlockDevice_Register(&disk->Device);
+	}
+	return _DiskCount;
+}
+
+// Return the block device for disk
+BlockDevice* VirtioBlkGetBlockDevice(int disk)
+{
+	if (disk < 0 || disk >= _DiskCount)
+	{
+		return 0;
+	}
+	return &_Disks[disk].Device;
+}
@@ -122,6 +122,73 @@ void VMM_MapPage(void* phys, void* virt)
     PTE_AddAttribute( page, I86_PTE_PRESENT);
 }
 
+// Translate a virtual address in the current page directory to the physical address it maps to.
+// Returns 0 if the address is not mapped. Before paging is set up, addresses are physical
+uint32_t VMM_GetPhysicalAddress(void* virt)
+{
+	PageDirectory* pageDirectory = VMM_GetDirectory();
+	if (!pageDirectory)
+	{
+		return (uint32_t)virt;
+	}
+	PageDirectoryEntry* e = &pageDirectory->entries[PAGE_DIRECTORY_INDEX((uint32_t)virt)];
+	if ((*e & I86_PDE_PRESENT) != I86_PDE_PRESENT)
+	{
+		return 0;
+	}
+	PageTable* table = (PageTable*)PAGE_GET_PHYSICAL_ADDRESS(e);
+	PageTableEntry* page = &table->entries[PAGE_TABLE_INDEX((uint32_t)virt)];
+	if (!PTE_IsPresent(*page))
+	{
+		return 0;
+	}
+	return PTE_PhysicalAddress(*page) | ((uint32_t)virt & 0xfff);
+}
+
+// Map size bytes of device registers at physical address physical, at the same virtual address.
+// The pages are writable and uncached, so every access goes to the device. Returns the virtual address
+void* VMM_MapDevice(uint32_t physical, uint32_t size)
+{
+	PageDirectory* pageDirectory = VMM_GetDirectory();
+	uint32_t end = physical + size;
+
+	for (uint32_t page = physical & ~0xfff; page < end; page += 4096)
+	{
+		VMM_MapPage((void*)page, (void*)page);
+		PageDirectoryEntry* e = &pageDirectory->entries[PAGE_DIRECTORY_INDEX(page)];
+		if ((*e & I86_PDE_PRESENT) != I86_PDE_PRESENT)
+		{
+			// No memory for the page table
+			return 0;
+		}
+		PageTable* table = (PageTable*)PAGE_GET_PHYSICAL_ADDRESS(e);
+		PageTableEntry* entry = &table->entries[PAGE_TABLE_INDEX(page)];
+		PTE_AddAttribute(entry, I86_PTE_WRITABLE | I86_PTE_WRITETHOUGH | I86_PTE_NOT_CACHEABLE);
+		VMM_FlushTLBEntry(page);
+	}
+	return (void*)physical;
+}
+
+// Make sure size bytes of memory from address can be reached at their physical address.
+// Only the first 4MB are mapped at boot, so memory handed out beyond that has to be mapped
+// before it is used. Returns false if a page table could not be allocated
+bool VMM_IdentityMapRange(void* address, uint32_t size)
+{
+	uint32_t end = (uint32_t)address + size;
+	for (uint32_t page = (uint32_t)address & ~0xfff; page < end; page += 4096)
+	{
+		if (VMM_GetPhysicalAddress((void*)page) != page)
+		{
+			VMM_MapPage((void*)page, (void*)page);
+			if (VMM_GetPhysicalAddress((void*)page) != page)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
 void VMM_Initialise() 
 {
 	// Allocate default page table
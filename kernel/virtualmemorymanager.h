@@ -39,6 +39,9 @@ PageDirectory* VMM_GetDirectory();
 bool VMM_AllocatePage(PageTableEntry* e); 
 void VMM_FreePage(PageTableEntry* e); 
 void VMM_MapPage(void* phys, void* virt); 
+uint32_t VMM_GetPhysicalAddress(void* virt); 
+void* VMM_MapDevice(uint32_t physical, uint32_t size); 
+bool VMM_IdentityMapRange(void* address, uint32_t size); 
 void VMM_Initialise(); 
 
 #endif